@@ -0,0 +1,262 @@
+// Link performance sweep.
+// Runs the link layer over the loopback harness for every combination of
+// baud rate, bit error rate, propagation delay and frame (llwrite block)
+// size, and writes one CSV row per transfer: goodput, efficiency and the
+// transmitter's retransmission counters. Each point uses a bit error pattern
+// seeded from its parameters, so reruns are comparable row by row.
+//
+// Usage: ./bin/link_sweep [-b bauds] [-e bers] [-p prop_usecs] [-f frames]
+//                         [-s line_seconds | -n bytes] [-r seed] [-j jobs] [-o file.csv]
+// Lists are comma separated; a frame size of 0 lets the link layer adapt it.
+// By default each transfer is sized to take 2 s at the line rate. The link
+// options come from the LL_* variables (LL_ARQ, LL_WINDOW, LL_FCS, LL_FEC).
+// The exit status is 1 if any transfer failed or delivered corrupt data.
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "loopback.h"
+
+#define MAX_VALUES 32
+#define MAX_JOBS 64
+
+typedef struct
+{
+    double values[MAX_VALUES];
+    int count;
+} ValueList;
+
+// Parse a comma-separated list of numbers.
+// Return 0 on success or -1 if it is empty, too long or not a number.
+static int parseList(const char *text, ValueList *list)
+{
+    char *end;
+    list->count = 0;
+    while (list->count < MAX_VALUES)
+    {
+        list->values[list->count++] = strtod(text, &end);
+        if (end == text || (*end != ',' && *end != '\0'))
+            return -1;
+        if (*end == '\0')
+            return 0;
+        text = end + 1;
+    }
+    return -1;
+}
+
+// Seed the bit errors of a point from its parameters and the base seed.
+static unsigned long long pointSeed(unsigned long long base, const TrialSetup *setup)
+{
+    unsigned long long berBits;
+    memcpy(&berBits, &setup->ber, sizeof(berBits));
+    unsigned long long seed = base * 0x9E3779B97F4A7C15ULL;
+    seed ^= (unsigned long long)setup->baud * 0xBF58476D1CE4E5B9ULL;
+    seed ^= (unsigned long long)(setup->prop * 1e6) * 0x94D049BB133111EBULL;
+    seed ^= (unsigned long long)setup->payload * 0xD6E8FEB86659FD93ULL;
+    seed ^= berBits;
+    return seed != 0 ? seed : 1;
+}
+
+static void printHeader(FILE *out)
+{
+    fprintf(out, "baud,ber,prop_us,frame,arq,window,fcs,fec,bytes,status,seconds,goodput_bps,"
+                 "efficiency,frames_sent,retransmissions,timeouts,rej_received,frame_errors,"
+                 "line_bytes\n");
+}
+
+static void printRow(FILE *out, const LinkOptions *options, const TrialSetup *setup,
+                     const TrialResult *result)
+{
+    const char *ARQ_NAMES[] = {"sw", "gbn", "sr"};
+    const char *FCS_NAMES[] = {"xor", "crc16", "crc32"};
+    const char *FEC_NAMES[] = {"off", "rs"};
+    const char *STATUS_NAMES[] = {"ok", "failed", "corrupt"};
+
+    double goodput = result->status == TrialOk && result->seconds > 0
+                         ? setup->bytes * 8 / result->seconds
+                         : 0;
+    fprintf(out, "%d,%g,%.0f,%d,%s,%d,%s,%s,%ld,%s,%.3f,%.0f,%.4f,%d,%d,%d,%d,%d,%ld\n", setup->baud,
+            setup->ber, setup->prop * 1e6, setup->payload, ARQ_NAMES[options->arqMode],
+            options->windowSize, FCS_NAMES[options->fcsMode], FEC_NAMES[options->fecMode],
+            setup->bytes, STATUS_NAMES[result->status], result->seconds, goodput,
+            goodput / setup->baud, result->tx.framesSent, result->tx.retransmissions,
+            result->tx.timeouts, result->tx.rejReceived, result->rx.frameErrors,
+            result->tx.lineBytes);
+    fflush(out);
+}
+
+// Run "count" trials at once, each in its own process, and collect their
+// results in order.
+static void runJobs(const LinkOptions *options, const TrialSetup *setups, TrialResult *results,
+                    int count)
+{
+    if (count == 1)
+    {
+        runTrial(options, &setups[0], &results[0]);
+        return;
+    }
+
+    int pipes[MAX_JOBS];
+    pid_t pids[MAX_JOBS];
+    for (int i = 0; i < count; i++)
+    {
+        int fds[2];
+        if (pipe(fds) < 0)
+        {
+            perror("pipe");
+            exit(1);
+        }
+        fflush(NULL);
+        pids[i] = fork();
+        if (pids[i] == 0)
+        {
+            close(fds[0]);
+            TrialResult result;
+            runTrial(options, &setups[i], &result);
+            exit(write(fds[1], &result, sizeof(result)) != sizeof(result));
+        }
+        close(fds[1]);
+        pipes[i] = fds[0];
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        if (read(pipes[i], &results[i], sizeof(TrialResult)) != sizeof(TrialResult))
+        {
+            memset(&results[i], 0, sizeof(TrialResult));
+            results[i].status = TrialFailed;
+        }
+        close(pipes[i]);
+        waitpid(pids[i], NULL, 0);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    ValueList bauds, bers, props, frames;
+    parseList("9600,38400,115200", &bauds);
+    parseList("0,1e-5,1e-4", &bers);
+    parseList("0,20000", &props);
+    parseList("256,1024,0", &frames);
+    double lineSeconds = 2;
+    long bytes = 0;
+    unsigned long long seed = 1;
+    int jobs = 1;
+    FILE *out = stdout;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:e:p:f:s:n:r:j:o:")) != -1)
+    {
+        int valid = TRUE;
+        switch (opt)
+        {
+        case 'b':
+            valid = parseList(optarg, &bauds) == 0;
+            break;
+        case 'e':
+            valid = parseList(optarg, &bers) == 0;
+            break;
+        case 'p':
+            valid = parseList(optarg, &props) == 0;
+            break;
+        case 'f':
+            valid = parseList(optarg, &frames) == 0;
+            break;
+        case 's':
+            lineSeconds = atof(optarg);
+            valid = lineSeconds > 0;
+            break;
+        case 'n':
+            bytes = atol(optarg);
+            valid = bytes > 0;
+            break;
+        case 'r':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 'j':
+            jobs = atoi(optarg);
+            valid = jobs >= 1 && jobs <= MAX_JOBS;
+            break;
+        case 'o':
+            out = fopen(optarg, "w");
+            if (out == NULL)
+            {
+                perror(optarg);
+                return 1;
+            }
+            break;
+        default:
+            valid = FALSE;
+        }
+        if (!valid)
+        {
+            fprintf(stderr,
+                    "Usage: %s [-b bauds] [-e bers] [-p prop_usecs] [-f frames] "
+                    "[-s line_seconds | -n bytes] [-r seed] [-j jobs (1-%d)] [-o file.csv]\n",
+                    argv[0], MAX_JOBS);
+            return 1;
+        }
+    }
+    for (int i = 0; i < frames.count; i++)
+    {
+        if (frames.values[i] < 0 || frames.values[i] > MAX_PAYLOAD_SIZE)
+        {
+            fprintf(stderr, "Frame sizes must be between 1 and %d bytes, or 0 to adapt them\n",
+                    MAX_PAYLOAD_SIZE);
+            return 1;
+        }
+    }
+
+    LinkOptions options;
+    if (llenvoptions(&options) < 0)
+        return 1;
+
+    // Every point of the grid, in order
+    int total = bauds.count * bers.count * props.count * frames.count;
+    TrialSetup *setups = calloc(total, sizeof(TrialSetup));
+    TrialResult *results = calloc(total, sizeof(TrialResult));
+    if (setups == NULL || results == NULL)
+    {
+        perror("calloc");
+        return 1;
+    }
+    int n = 0;
+    for (int b = 0; b < bauds.count; b++)
+        for (int e = 0; e < bers.count; e++)
+            for (int p = 0; p < props.count; p++)
+                for (int f = 0; f < frames.count; f++)
+                {
+                    TrialSetup *setup = &setups[n++];
+                    setup->baud = bauds.values[b];
+                    setup->ber = bers.values[e];
+                    setup->prop = props.values[p] / 1e6;
+                    setup->payload = frames.values[f];
+                    setup->bytes = bytes > 0 ? bytes : (long)(setup->baud / 10 * lineSeconds);
+                    setup->seed = pointSeed(seed, setup);
+                }
+
+    printHeader(out);
+    int failures = 0;
+    for (int i = 0; i < total; i += jobs)
+    {
+        int count = total - i < jobs ? total - i : jobs;
+        runJobs(&options, setups + i, results + i, count);
+        for (int k = i; k < i + count; k++)
+        {
+            printRow(out, &options, &setups[k], &results[k]);
+            failures += results[k].status != TrialOk;
+        }
+    }
+    if (failures > 0)
+        fprintf(stderr, "%d of %d transfers failed\n", failures, total);
+
+    free(setups);
+    free(results);
+    if (out != stdout)
+        fclose(out);
+    return failures > 0;
+}
@@ -0,0 +1,244 @@
+// Loopback link harness implementation.
+// The parent pumps bytes between the two master ends, holding each one in
+// the channel until the emulated UART and propagation delay would deliver
+// it. Each child sends its LinkStats back through a pipe after llclose.
+
+#define _DEFAULT_SOURCE
+#include "loopback.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <pty.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHANNEL_SIZE (1 << 20)
+
+typedef struct
+{
+    unsigned char bytes[CHANNEL_SIZE];
+    double due[CHANNEL_SIZE]; // Time at which each byte reaches the far end
+    size_t head, tail;
+    double lineFree; // Time at which the sending UART finishes its last byte
+} Channel;
+
+Channel tx2rx, rx2tx;
+unsigned long long rngState;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, uniform in [0, 1)
+static double uniform()
+{
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return (double)((rngState * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+// Deterministic test payload shared by both ends.
+static unsigned char payloadByte(long i)
+{
+    return (unsigned char)((i * 2654435761UL) >> 13);
+}
+
+// Move bytes from "in" into the channel, then deliver whatever is due to "out".
+static void pump(Channel *ch, int in, int out, double byteTime, double prop, double ber)
+{
+    unsigned char buf[4096];
+    int n = read(in, buf, sizeof(buf));
+    double t = now();
+
+    for (int i = 0; i < n && (ch->tail + 1) % CHANNEL_SIZE != ch->head; i++)
+    {
+        unsigned char byte = buf[i];
+        for (int bit = 0; ber > 0 && bit < 8; bit++)
+        {
+            if (uniform() < ber)
+                byte ^= 1 << bit;
+        }
+        ch->lineFree = (ch->lineFree > t ? ch->lineFree : t) + byteTime;
+        ch->bytes[ch->tail] = byte;
+        ch->due[ch->tail] = ch->lineFree + prop;
+        ch->tail = (ch->tail + 1) % CHANNEL_SIZE;
+    }
+
+    while (ch->head != ch->tail && ch->due[ch->head] <= t)
+    {
+        size_t end = ch->head;
+        while (end != ch->tail && end < CHANNEL_SIZE && ch->due[end] <= t)
+            end++;
+        int written = write(out, ch->bytes + ch->head, end - ch->head);
+        if (written <= 0)
+            break;
+        ch->head = (ch->head + written) % CHANNEL_SIZE;
+    }
+}
+
+static double nextDue(const Channel *ch)
+{
+    return ch->head != ch->tail ? ch->due[ch->head] : -1;
+}
+
+// Send the counters of the connection just closed to the parent.
+static void reportStats(int statsFd)
+{
+    LinkStats stats;
+    llstats(&stats);
+    if (write(statsFd, &stats, sizeof(stats)) != sizeof(stats))
+        exit(1);
+}
+
+static void runTransmitter(LinkLayer ll, const TrialSetup *setup, int statsFd)
+{
+    unsigned char buf[MAX_PAYLOAD_SIZE];
+    if (llopen(ll) < 0)
+        exit(1);
+
+    for (long sent = 0, size; sent < setup->bytes; sent += size)
+    {
+        size = setup->payload != 0 ? setup->payload : llpayloadsize();
+        if (size > setup->bytes - sent)
+            size = setup->bytes - sent;
+        for (int i = 0; i < size; i++)
+            buf[i] = payloadByte(sent + i);
+        if (llwrite(buf, size) < 0)
+            exit(1);
+    }
+    int status = llclose(ll);
+    reportStats(statsFd);
+    exit(status < 0);
+}
+
+static void runReceiver(LinkLayer ll, const TrialSetup *setup, int statsFd)
+{
+    unsigned char buf[MAX_PAYLOAD_SIZE];
+    long received = 0;
+    int ok = TRUE, n;
+    if (llopen(ll) < 0)
+        exit(1);
+
+    while ((n = llread(buf)) > 0)
+    {
+        for (int i = 0; i < n; i++)
+            ok &= buf[i] == payloadByte(received + i);
+        received += n;
+    }
+    llclose(ll);
+    reportStats(statsFd);
+    if (!ok)
+        exit(2);
+    exit(!(n == 0 && received == setup->bytes));
+}
+
+// Fork one end of the link on the slave "name".
+static pid_t startEnd(LinkLayerRole role, LinkLayer ll, const char *name, const LinkOptions *options,
+                      const TrialSetup *setup, int statsPipe[2])
+{
+    pid_t pid = fork();
+    if (pid != 0)
+        return pid;
+
+    freopen("/dev/null", "w", stdout);
+    close(statsPipe[0]);
+    llsetoptions(options);
+    strcpy(ll.serialPort, name);
+    ll.role = role;
+    if (role == LlTx)
+        runTransmitter(ll, setup, statsPipe[1]);
+    runReceiver(ll, setup, statsPipe[1]);
+    return -1;
+}
+
+void runTrial(const LinkOptions *options, const TrialSetup *setup, TrialResult *result)
+{
+    int masterTx, slaveTx, masterRx, slaveRx, txStats[2], rxStats[2];
+    char nameTx[64], nameRx[64];
+    struct termios raw;
+    cfmakeraw(&raw);
+    if (openpty(&masterTx, &slaveTx, nameTx, &raw, NULL) < 0 ||
+        openpty(&masterRx, &slaveRx, nameRx, &raw, NULL) < 0)
+    {
+        perror("openpty");
+        exit(1);
+    }
+    if (pipe(txStats) < 0 || pipe(rxStats) < 0)
+    {
+        perror("pipe");
+        exit(1);
+    }
+    fcntl(masterTx, F_SETFL, O_NONBLOCK);
+    fcntl(masterRx, F_SETFL, O_NONBLOCK);
+    memset(&tx2rx, 0, sizeof(tx2rx));
+    memset(&rx2tx, 0, sizeof(rx2tx));
+    memset(result, 0, sizeof(*result));
+    rngState = setup->seed != 0 ? setup->seed : 0x9E3779B97F4A7C15ULL;
+
+    LinkLayer ll = {.baudRate = setup->baud, .nRetransmissions = 10, .timeout = 1};
+    double start = now();
+    fflush(stdout);
+    pid_t rx = startEnd(LlRx, ll, nameRx, options, setup, rxStats);
+    pid_t tx = startEnd(LlTx, ll, nameTx, options, setup, txStats);
+    close(txStats[1]);
+    close(rxStats[1]);
+
+    double byteTime = 10.0 / setup->baud;
+    int status, done = 0, ok = TRUE, corrupt = FALSE;
+    while (done < 2)
+    {
+        pump(&tx2rx, masterTx, masterRx, byteTime, setup->prop, setup->ber);
+        pump(&rx2tx, masterRx, masterTx, byteTime, setup->prop, setup->ber);
+
+        pid_t pid;
+        while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+        {
+            done++;
+            ok &= WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            if (pid == rx)
+            {
+                result->seconds = now() - start;
+                corrupt = WIFEXITED(status) && WEXITSTATUS(status) == 2;
+            }
+        }
+
+        if (now() - start > TRIAL_LIMIT)
+        {
+            kill(tx, SIGKILL);
+            kill(rx, SIGKILL);
+            ok = FALSE;
+        }
+
+        // Sleep until the next byte is due or either end writes something
+        double due = nextDue(&tx2rx), due2 = nextDue(&rx2tx);
+        if (due < 0 || (due2 >= 0 && due2 < due))
+            due = due2;
+        int wait = due < 0 ? 10 : (int)((due - now()) * 1000) + 1;
+        struct pollfd pfd[2] = {{.fd = masterTx, .events = POLLIN}, {.fd = masterRx, .events = POLLIN}};
+        poll(pfd, 2, wait < 10 ? wait : 10);
+    }
+
+    // Ends killed before llclose leave their counters at zero
+    if (read(txStats[0], &result->tx, sizeof(LinkStats)) != sizeof(LinkStats))
+        memset(&result->tx, 0, sizeof(LinkStats));
+    if (read(rxStats[0], &result->rx, sizeof(LinkStats)) != sizeof(LinkStats))
+        memset(&result->rx, 0, sizeof(LinkStats));
+    result->status = corrupt ? TrialCorrupt : ok ? TrialOk : TrialFailed;
+
+    close(txStats[0]);
+    close(rxStats[0]);
+    close(masterTx);
+    close(slaveTx);
+    close(masterRx);
+    close(slaveRx);
+}
@@ -0,0 +1,45 @@
+// Loopback link harness header.
+// Runs the link layer transmitter and receiver as two child processes over two
+// pseudo-terminal pairs (openpty) joined by an in-process channel that
+// emulates the baud rate, the propagation delay and independent bit errors.
+// No socat or root privileges are needed.
+
+#ifndef _LOOPBACK_H_
+#define _LOOPBACK_H_
+
+#include "../src/link_layer.h"
+#include "../src/link_options.h"
+
+#define TRIAL_LIMIT 300.0 // Seconds before a trial is declared failed
+
+typedef enum
+{
+    TrialOk,
+    TrialFailed,  // The link gave up, or the trial ran out of time
+    TrialCorrupt, // The receiver delivered wrong bytes
+} TrialStatus;
+
+// One transfer over the emulated channel
+typedef struct
+{
+    int baud;
+    double prop; // One-way propagation delay in seconds
+    double ber;  // Independent bit error rate, both directions
+    long bytes;  // Payload to move
+    int payload; // llwrite block size, or 0 to let the link layer adapt it
+    unsigned long long seed; // Bit error pattern (same seed, same errors)
+} TrialSetup;
+
+typedef struct
+{
+    TrialStatus status;
+    double seconds; // Until the receiver closed
+    LinkStats tx;   // Counters of each end, read after llclose
+    LinkStats rx;
+} TrialResult;
+
+// Run one transfer with "options" on both ends and fill "result".
+// Exits the program if the pseudo-terminals cannot be created.
+void runTrial(const LinkOptions *options, const TrialSetup *setup, TrialResult *result);
+
+#endif // _LOOPBACK_H_
@@ -0,0 +1,246 @@
+// Receive path check.
+// Drives a receiver over a pseudo-terminal with hand-built frames: an I frame
+// whose payload is longer than MAX_PAYLOAD_SIZE but carries a valid BCC2
+// (as two frames merged by a corrupted flag can) must be dropped as a frame
+// error, never copied into the caller's packet buffer or the Selective Repeat
+// reorder buffer. Build with -fsanitize=address to catch any overrun.
+//
+// Usage: ./bin/rx_check (exit status 0 if every check passed)
+
+#define _DEFAULT_SOURCE
+#include <poll.h>
+#include <pty.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/link_layer.h"
+#include "../src/link_options.h"
+#include "../src/log.h"
+
+#define FLAG 0x7E
+#define ESC 0x7D
+#define ADDRESS_TR 0x03
+#define CONTROL_SET 0x03
+#define CONTROL_DISC 0x0B
+#define OVERSIZED (MAX_PAYLOAD_SIZE + 64)
+#define WAIT_LIMIT 1.0 // Seconds to wait for the receiver
+
+int master = -1;
+int failures = 0;
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void check(int ok, const char *what)
+{
+    printf("%-60s %s\n", what, ok ? "ok" : "FAILED");
+    failures += !ok;
+}
+
+// Drop whatever the receiver has written back (UA, RR, REJ, SREJ).
+static void drainMaster()
+{
+    unsigned char buf[256];
+    struct pollfd pfd = {.fd = master, .events = POLLIN};
+    while (poll(&pfd, 1, 0) > 0 && read(master, buf, sizeof(buf)) > 0)
+        ;
+}
+
+// Write an I frame with control field "control" and a stuffed payload and
+// XOR BCC2, as the transmitter would.
+static void sendIFrame(unsigned char control, const unsigned char *payload, int size)
+{
+    static unsigned char frame[4 + 2 * (OVERSIZED + 1) + 1];
+    int n = 0;
+    unsigned char bcc2 = 0;
+    frame[n++] = FLAG;
+    frame[n++] = ADDRESS_TR;
+    frame[n++] = control;
+    frame[n++] = ADDRESS_TR ^ control;
+    for (int i = 0; i <= size; i++)
+    {
+        unsigned char byte = i < size ? payload[i] : bcc2;
+        if (i < size)
+            bcc2 ^= byte;
+        if (byte == FLAG || byte == ESC)
+        {
+            frame[n++] = ESC;
+            byte ^= 0x20;
+        }
+        frame[n++] = byte;
+    }
+    frame[n++] = FLAG;
+    for (int done = 0; done < n;)
+    {
+        int written = write(master, frame + done, n - done);
+        if (written < 0)
+        {
+            perror("write");
+            return;
+        }
+        done += written;
+        drainMaster();
+    }
+}
+
+// Read the next packet from "connection", polling until it arrives.
+// Return its size, LL_WOULDBLOCK if none came in time, or -1 on error.
+static int readPacket(LinkConnection *connection, unsigned char *packet)
+{
+    double deadline = now() + WAIT_LIMIT;
+    int result;
+    while ((result = llreadh(connection, packet)) == LL_WOULDBLOCK && now() < deadline)
+    {
+        struct pollfd fds[2];
+        llpollfds(connection, fds);
+        poll(fds, 2, 50);
+        drainMaster();
+    }
+    return result;
+}
+
+// Open a non-blocking receiver on the slave side and answer its SET wait.
+static LinkConnection *openReceiver(const char *port, const LinkOptions *options)
+{
+    LinkLayer parameters = {.role = LlRx, .baudRate = 115200, .nRetransmissions = 3, .timeout = 1};
+    snprintf(parameters.serialPort, sizeof(parameters.serialPort), "%s", port);
+    LinkConnection *connection = llopenh(parameters, options);
+    if (connection == NULL)
+        return NULL;
+
+    unsigned char set[] = {FLAG, ADDRESS_TR, CONTROL_SET, ADDRESS_TR ^ CONTROL_SET, FLAG};
+    if (write(master, set, sizeof(set)) != sizeof(set))
+        perror("write");
+    double deadline = now() + WAIT_LIMIT;
+    int status;
+    while ((status = llconnecth(connection)) == LL_WOULDBLOCK && now() < deadline)
+    {
+        struct pollfd fds[2];
+        llpollfds(connection, fds);
+        poll(fds, 2, 50);
+    }
+    drainMaster();
+    if (status != 0)
+    {
+        llcloseh(connection);
+        return NULL;
+    }
+    return connection;
+}
+
+// The oversized frame is sent as Ns "oversizedNs", then the frames "0"
+// and (when Ns 1 was the oversized one) "1" follow with valid payloads.
+static void runCase(const char *name, const char *port, LinkArqMode arqMode, int oversizedNs)
+{
+    LinkOptions options;
+    lldefaultoptions(&options);
+    options.nonBlocking = TRUE;
+    if (arqMode != ArqStopAndWait)
+    {
+        options.arqMode = arqMode;
+        options.windowSize = 4;
+    }
+
+    LinkConnection *connection = openReceiver(port, &options);
+    char what[128];
+    snprintf(what, sizeof(what), "%s: open", name);
+    check(connection != NULL, what);
+    if (connection == NULL)
+        return;
+
+    int extended = arqMode != ArqStopAndWait;
+    static unsigned char big[OVERSIZED];
+    for (int i = 0; i < OVERSIZED; i++)
+        big[i] = (unsigned char)(i * 7 + 1);
+    unsigned char small[3][16];
+    for (int k = 0; k < 3; k++)
+        memset(small[k], 'a' + k, sizeof(small[k]));
+
+    // Sentinels past the end of the packet buffer catch a copy that overran it
+    struct
+    {
+        unsigned char packet[MAX_PAYLOAD_SIZE];
+        unsigned char guard[OVERSIZED];
+    } rx;
+    memset(rx.guard, 0xA5, sizeof(rx.guard));
+
+    sendIFrame(extended ? oversizedNs << 3 : oversizedNs << 6, big, OVERSIZED);
+    int size = readPacket(connection, rx.packet);
+    snprintf(what, sizeof(what), "%s: oversized frame not delivered", name);
+    check(size == LL_WOULDBLOCK, what);
+
+    sendIFrame(0x00, small[0], sizeof(small[0]));
+    size = readPacket(connection, rx.packet);
+    snprintf(what, sizeof(what), "%s: next valid frame delivered", name);
+    check(size == sizeof(small[0]) && memcmp(rx.packet, small[0], size) == 0, what);
+
+    if (oversizedNs == 1)
+    {
+        // Ns 1 must not have been buffered: its valid copy is what comes next
+        sendIFrame(1 << 3, small[1], sizeof(small[1]));
+        size = readPacket(connection, rx.packet);
+        snprintf(what, sizeof(what), "%s: valid copy of the dropped frame delivered", name);
+        check(size == sizeof(small[1]) && memcmp(rx.packet, small[1], size) == 0, what);
+    }
+
+    int intact = TRUE;
+    for (int i = 0; i < OVERSIZED; i++)
+        intact &= rx.guard[i] == 0xA5;
+    snprintf(what, sizeof(what), "%s: nothing written past the packet buffer", name);
+    check(intact, what);
+
+    LinkStats stats;
+    llstatsh(connection, &stats);
+    snprintf(what, sizeof(what), "%s: counted as a frame error", name);
+    check(stats.frameErrors == 1, what);
+
+    // Close as the transmitter would, so the next case can open the port
+    unsigned char disc[] = {FLAG, ADDRESS_TR, CONTROL_DISC, ADDRESS_TR ^ CONTROL_DISC, FLAG};
+    if (write(master, disc, sizeof(disc)) != sizeof(disc))
+        perror("write");
+    double deadline = now() + WAIT_LIMIT;
+    int status;
+    while ((status = llcloseh(connection)) == LL_WOULDBLOCK && now() < deadline)
+    {
+        struct pollfd fds[2];
+        llpollfds(connection, fds);
+        poll(fds, 2, 50);
+    }
+    drainMaster();
+    snprintf(what, sizeof(what), "%s: closed", name);
+    check(status == 0, what);
+}
+
+int main()
+{
+    int slave;
+    char port[64];
+    if (openpty(&master, &slave, port, NULL, NULL) < 0)
+    {
+        perror("openpty");
+        return 1;
+    }
+    struct termios tio;
+    tcgetattr(master, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(master, TCSANOW, &tio);
+
+    // The receiver's logs would drown the report
+    logSetLevel("error");
+
+    runCase("stop-and-wait", port, ArqStopAndWait, 0);
+    runCase("go-back-n", port, ArqGoBackN, 0);
+    runCase("selective repeat, in sequence", port, ArqSelectiveRepeat, 0);
+    runCase("selective repeat, out of sequence", port, ArqSelectiveRepeat, 1);
+
+    close(slave);
+    close(master);
+    printf("%s\n", failures == 0 ? "All checks passed" : "Some checks FAILED");
+    return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,115 @@
+// Byte stuffing microbenchmark.
+// Reports MB/s (of unstuffed data) for the byte-by-byte loops the link layer
+// used to run and for the vectorized stuffBytes/destuffBytes kernels.
+//
+// Usage: ./bin/stuffing_bench [frame_bytes] [total_MB]
+
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/stuffing.h"
+
+volatile size_t sink; // Keeps results alive under optimization
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static size_t stuffLoop(const unsigned char *src, size_t len, unsigned char *dst)
+{
+    size_t out = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (src[i] == STUFF_FLAG || src[i] == STUFF_ESC)
+        {
+            dst[out++] = STUFF_ESC;
+            dst[out++] = src[i] ^ 0x20;
+        }
+        else
+            dst[out++] = src[i];
+    }
+    return out;
+}
+
+static size_t destuffLoop(const unsigned char *src, size_t len, unsigned char *dst)
+{
+    size_t out = 0;
+    int escaped = 0;
+    for (size_t i = 0; i < len; i++)
+    {
+        if (escaped)
+        {
+            dst[out++] = src[i] ^ 0x20;
+            escaped = 0;
+        }
+        else if (src[i] == STUFF_ESC)
+            escaped = 1;
+        else
+            dst[out++] = src[i];
+    }
+    return out;
+}
+
+static size_t destuffKernel(const unsigned char *src, size_t len, unsigned char *dst)
+{
+    int escaped = 0;
+    return destuffBytes(src, len, dst, &escaped);
+}
+
+// Time "rounds" calls of a stuff or destuff function; returns MB/s of raw data.
+static double measure(size_t (*fn)(const unsigned char *, size_t, unsigned char *),
+                      const unsigned char *in, size_t inLen, unsigned char *out,
+                      size_t rawLen, long rounds)
+{
+    double start = now();
+    for (long r = 0; r < rounds; r++)
+        sink += fn(in, inLen, out);
+    return rounds * rawLen / (now() - start) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+    size_t frame = argc > 1 ? atol(argv[1]) : 1000;
+    double totalMB = argc > 2 ? atof(argv[2]) : 256;
+    long rounds = (long)(totalMB * 1e6 / frame);
+
+    unsigned char *raw = malloc(frame);
+    unsigned char *stuffed = malloc(2 * frame);
+    unsigned char *back = malloc(2 * frame);
+
+    const char *inputs[] = {"text", "random", "all-flags"};
+    printf("kernel=%s frame=%zu bytes, %.0f MB per run\n", stuffingKernel(), frame, totalMB);
+    printf("%-10s %12s %12s %12s %12s\n", "input", "stuff-loop", "stuff-simd", "destuff-loop", "destuff-simd");
+
+    for (int k = 0; k < 3; k++)
+    {
+        for (size_t i = 0; i < frame; i++)
+            raw[i] = k == 0 ? 'a' + i % 26 : k == 1 ? rand() : STUFF_FLAG;
+
+        size_t stuffedLen = stuffBytes(raw, frame, stuffed);
+        int escaped = 0;
+        if (stuffedLen != stuffLoop(raw, frame, back) || memcmp(stuffed, back, stuffedLen) != 0 ||
+            destuffBytes(stuffed, stuffedLen, back, &escaped) != frame || memcmp(raw, back, frame) != 0)
+        {
+            printf("Round-trip check failed on %s input\n", inputs[k]);
+            return 1;
+        }
+
+        printf("%-10s %12.0f %12.0f %12.0f %12.0f\n", inputs[k],
+               measure(stuffLoop, raw, frame, stuffed, frame, rounds),
+               measure(stuffBytes, raw, frame, stuffed, frame, rounds),
+               measure(destuffLoop, stuffed, stuffedLen, back, frame, rounds),
+               measure(destuffKernel, stuffed, stuffedLen, back, frame, rounds));
+    }
+
+    free(raw);
+    free(stuffed);
+    free(back);
+    return 0;
+}
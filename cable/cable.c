@@ -1,13 +1,42 @@
 // Virtual cable program to test serial port.
 // Creates a pair of virtual Tx / Rx serial ports using "socat".
 //
+// Each direction of the cable is a queue of timestamped bytes. Bytes are read
+// in bulk, but only as fast as an 8-N-1 UART at the current baud rate would
+// send them (a token bucket a couple of milliseconds deep, so the sender
+// still sees back pressure), and each one is delivered once its last bit
+// has crossed the line and the propagation delay has passed. The loop
+// sleeps in ppoll until the next delivery or the next byte the UART can
+// take, so the rate stays exact at any baud rate while the program is idle
+// most of the time.
+//
+// Bit errors follow a channel model chosen per direction: independent errors
+// at an exact per-bit rate, a Gilbert-Elliott two-state channel, or bursts of
+// random length. Every model counts down the bits to its next event (an
+// error, a change of state, the start of a burst), drawn from the matching
+// geometric distribution, so a clean byte costs one comparison. Random numbers
+// come from xoshiro256**, one generator per direction.
+//
+// Each direction can also lose bytes, gain spurious ones, delay them by a
+// random amount (without reordering them, as on a real line), run at its own
+// baud rate, and drop what the far end leaves unread once its buffer is full.
+//
+// Besides the interactive commands, a timeline of commands can be given on
+// the command line (see usage()) so that a fault scenario replays the same
+// way against different builds of the protocol.
+//
 // Author: Manuel Ricardo [mricardo@fe.up.pt]
 // Modified by: Eduardo Nuno Almeida [enalmeida@fe.up.pt]
 // Modified by: Rui Prior [rcprior@fc.up.pt]
 
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
-#include <math.h>
+#include <limits.h>
+#include <poll.h>
 #include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -17,6 +46,8 @@
 #include <time.h>
 #include <unistd.h>
 
+#include "capture.h"
+
 #define TXDEV "/dev/ttyS10"
 #define RXDEV "/dev/ttyS11"
 #define TX_EMULATOR "/dev/emulatorTx"
@@ -26,37 +57,126 @@
 // included by <termios.h>
 #define BAUDRATE B9600         // For struct termios
 #define DEFAULT_BAUDRATE 9600  // For the delaying transmissions
+#define MAX_BAUDRATE 10000000
 #define _POSIX_SOURCE 1        // POSIX compliant source
 #define FALSE 0
 #define TRUE 1
 
 #define BUF_SIZE 2048
+#define IO_SIZE 4096             // Most bytes moved by one read or write
+#define HORIZON_NS 2000000LL     // How far ahead of the line the UART takes bytes
+#define MIN_SLEEP_NS 500000LL    // Shortest sleep: deliveries this close share a wakeup
+#define LATE_WARNING_NS 100000000LL // Delivery lateness reported as an unreliable rate
+#define MIN_QUEUE 4096
+#define MAX_EVENTS 1024
+#define COMMAND_SIZE 256
+#define DEFAULT_SEED 1
+#define NEVER LLONG_MAX          // Bits until an event that cannot happen
+#define MAX_DELAY_US 1000000     // Largest propagation delay and jitter
+#define LOG_BUFFER_SIZE (1 << 20)  // Capture records gathered per write
+#define LOG_FLUSH_NS 1000000000LL  // An idle line flushes records older than this
+
+// Marks of a byte in the queue
+#define BYTE_INSERTED 1          // Spurious byte made by the line (or a duplicate)
+#define BYTE_DELETED 2           // Lost on the line: takes its time, never delivered
+
+enum ChannelModel { CHANNEL_CLEAN, CHANNEL_BER, CHANNEL_GE, CHANNEL_BURST };
+enum BurstLength { BURST_FIXED, BURST_GEOMETRIC, BURST_UNIFORM };
+
+// Bit error process of one direction
+struct Channel {
+    enum ChannelModel model;
+    double ber;            // BER: probability of each bit being wrong
+    double pGoodBad;       // GE: per-bit probability of going bad...
+    double pBadGood;       // ...and of recovering
+    double berGood;        // GE: bit error rate in each state
+    double berBad;
+    int bad;               // GE: in the bad state
+    double burstStart;     // BURST: per-bit probability that a burst starts
+    enum BurstLength burstLength;
+    double lengthA;        // BURST: fixed length, mean, or minimum (bits)
+    double lengthB;        // BURST: maximum (uniform)
+    long long burstSize;   // BURST: length of the current burst
+    long long burstLeft;   // BURST: bits of it still to come
+    long long untilError;  // BER, GE: correct bits before the next error
+    long long untilEvent;  // GE: bits before the state changes; BURST: before one starts
+    uint64_t rng[4];       // xoshiro256** state
+    long long bits;        // Bits carried
+    long long errors;      // Bits flipped
+};
+
+// One direction of the cable
+struct Direction {
+    const char *name;
+    int in;                // Read from this end...
+    int out;               // ...and delivered to the other
+    unsigned char *sent;   // Bytes as read
+    unsigned char *bytes;  // Bytes as delivered (with errors)
+    unsigned char *flags;  // BYTE_* marks
+    long long *due;        // Delivery time of each byte (ns), never decreasing
+    long capacity;
+    long head;             // Oldest byte
+    long count;            // Bytes in the queue
+    long long lineFree;    // Time at which the UART finishes its last byte (ns)
+    int blocked;           // The far end is not reading: wait for POLLOUT
+    unsigned long baudRate;
+    long long byteTime;    // 10 bit times (8-N-1), in ns
+    struct Channel channel;
+    double pDelete;        // Probability that a byte is lost...
+    double pInsert;        // ...that a spurious byte follows it...
+    double pDuplicate;     // ...and that it arrives twice
+    long long untilDelete; // Bytes before the next deletion
+    long long untilInsert; // Bytes before the next insertion
+    long long untilDuplicate; // Bytes before the next duplicate
+    long long jitter;      // Most extra propagation delay of a byte (ns)
+    long long lastDue;     // Delivery time of the newest byte queued (ns)
+    long buffer;           // Due bytes the far end can leave unread, 0 for no limit
+    long long deleted;
+    long long inserted;
+    long long duplicated;
+    long long overflowed;  // Bytes lost to a full buffer
+};
+
+// Timeline entry: a command run at a given time
+struct Event {
+    long long at;          // Since the first byte on the cable (ns); 0 runs at start
+    char command[COMMAND_SIZE];
+};
 
 // Current running parameters
 struct Parameters {
     int cableOn;
-    double byteER;   // Byte error rate
-    struct timespec byteDelay;
-    unsigned long propDelay;   // Desired propagation delay in usec
-    int bufSize;  // Dimensioned to enforce the propagation delay
-    char *tx2rx;
-    char *tx2rxValid;  // TRUE if corresponding entry holds a byte
-    long tx2rxIdx;     // Input index for the tx2rx buffer
-    char *rx2tx;
-    char *rx2txValid;  // TRUE if corresponding entry holds a byte
-    long rx2txIdx;     // Input index for the tx2rx buffer
-    FILE *logfile;
+    unsigned long propDelay;   // Propagation delay in usec
+    struct Direction tx2rx;
+    struct Direction rx2tx;
+    int logFd;             // Binary capture (see capture.h), -1 when not logging
+    unsigned char *logBuffer;
+    long logLength;        // Bytes of records not written yet
+    long long logStart;    // Time of the capture header (ns)
+    long long logFlushed;  // Time of the last write to the capture (ns)
+    int logIdle;           // The last thing logged was the idle marker
+    int unreliableRate;    // The lateness warning was already printed
+    int stop;
+    struct Event *events;  // Timeline, in time order
+    int eventCount;
+    int nextEvent;         // First event not run yet
+    long long start;       // Time of the first byte on the cable (ns), -1 before
+    long long lastActivity;    // Time a byte last entered or left the cable (ns)
+    long long exitIdle;    // Quit after the timeline once idle this long (ns), -1 never
 };
 
 struct Parameters par = {
     .cableOn = TRUE,
-    .byteER = 0.0,
     .propDelay = 0,
-    .tx2rx = NULL,
-    .tx2rxValid = NULL,
-    .rx2tx = NULL,
-    .rx2txValid = NULL,
-    .logfile = NULL};
+    .tx2rx = {.name = "Tx->Rx", .in = -1, .out = -1, .untilDelete = NEVER, .untilInsert = NEVER,
+              .untilDuplicate = NEVER},
+    .rx2tx = {.name = "Rx->Tx", .in = -1, .out = -1, .untilDelete = NEVER, .untilInsert = NEVER,
+              .untilDuplicate = NEVER},
+    .logFd = -1,
+    .logIdle = TRUE,
+    .events = NULL,
+    .start = -1,
+    .exitIdle = -1};
 
 // Returns: serial port file descriptor (fd).
 int openSerialPort(const char *serialPort, struct termios *oldtio, struct termios *newtio)
@@ -86,52 +206,308 @@ int openSerialPort(const char *serialPort, struct termios *oldtio, struct termio
 }
 
 
-// Add noise to a buffer, by flipping the byte in the "errorIndex" position.
-void addNoiseToBuffer(unsigned char *buf, size_t errorIndex)
+// Monotonic clock in nanoseconds
+long long now_ns(void)
 {
-    buf[errorIndex] ^= 0xFF;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 
-// Initialize the ring buffers that implement the propagation delay
-// Returns 0 on success, -1 on failure
-int init_ring_buffers(void)
+// splitmix64, to expand a seed into generator states
+uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+
+uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+
+// xoshiro256**: next 64 random bits
+uint64_t next_random(uint64_t *s)
+{
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return result;
+}
+
+
+// Uniform in (0, 1]
+double next_uniform(uint64_t *s)
+{
+    return ((next_random(s) >> 11) + 1) * (1.0 / 9007199254740992.0);
+}
+
+
+// Natural logarithm of x > 0, without libm: x = m * 2^e with m near 1, then
+// ln(m) = 2 atanh((m - 1) / (m + 1)) as a series
+double natural_log(double x)
 {
-    long nsecPropDelay = 1000 * par.propDelay;
-    long bytesInFlight = nsecPropDelay / par.byteDelay.tv_nsec;
-    // Round instead of truncating
-    if (nsecPropDelay % par.byteDelay.tv_nsec > par.byteDelay.tv_nsec / 2)
+    uint64_t bits;
+    memcpy(&bits, &x, sizeof(bits));
+    int exponent = (int) ((bits >> 52) & 0x7FF) - 1023;
+    bits = (bits & 0x000FFFFFFFFFFFFFULL) | 0x3FF0000000000000ULL;
+    double m;
+    memcpy(&m, &bits, sizeof(m));
+    if (m > 1.4142135623730951)
     {
-        ++bytesInFlight;
+        m /= 2;
+        exponent++;
     }
-    long actualPropDelay = bytesInFlight * par.byteDelay.tv_nsec / 1000; // usec
-    par.bufSize = bytesInFlight + 1;
-    par.tx2rx = realloc(par.tx2rx, par.bufSize);
-    par.tx2rxValid = realloc(par.tx2rxValid, par.bufSize);
-    par.rx2tx = realloc(par.rx2tx, par.bufSize);
-    par.rx2txValid = realloc(par.rx2txValid, par.bufSize);
-    if (par.tx2rx == NULL || par.tx2rxValid == NULL || par.rx2tx == NULL || par.rx2txValid == NULL)
+
+    double z = (m - 1) / (m + 1), z2 = z * z, term = z, sum = 0;
+    for (int k = 1; k < 40; k += 2)
+    {
+        sum += term / k;
+        term *= z2;
+    }
+    return 2 * sum + exponent * 0.6931471805599453;
+}
+
+
+// ln(1 - p), accurate for small p
+double log_keep(double p)
+{
+    if (p >= 0.01)
+        return natural_log(1 - p);
+    double sum = 0, term = p;
+    for (int k = 1; k < 12; k++)
     {
+        sum -= term / k;
+        term *= p;
+    }
+    return sum;
+}
+
+
+// Bits before the first success of independent trials with probability p
+long long geometric(uint64_t *s, double p)
+{
+    if (p <= 0)
+        return NEVER;
+    if (p >= 1)
+        return 0;
+    double n = natural_log(next_uniform(s)) / log_keep(p);
+    return n < 4e18 ? (long long) n : NEVER;
+}
+
+
+// Length of a new burst, at least 1 bit
+long long burst_length(struct Channel *c)
+{
+    long long length;
+    if (c->burstLength == BURST_GEOMETRIC)
+        length = 1 + geometric(c->rng, 1 / c->lengthA);
+    else if (c->burstLength == BURST_UNIFORM)
+        length = (long long) c->lengthA +
+                 (long long) (next_random(c->rng) % (uint64_t) (c->lengthB - c->lengthA + 1));
+    else
+        length = (long long) c->lengthA;
+    return length > 0 ? length : 1;
+}
+
+
+// Restart the countdowns of a channel after its settings change
+void reset_channel(struct Channel *c)
+{
+    c->bad = FALSE;
+    c->burstLeft = 0;
+    c->untilError = geometric(c->rng, c->model == CHANNEL_GE ? c->berGood : c->ber);
+    c->untilEvent = c->model == CHANNEL_GE      ? geometric(c->rng, c->pGoodBad)
+                    : c->model == CHANNEL_BURST ? geometric(c->rng, c->burstStart)
+                                                : NEVER;
+}
+
+
+// Flip the independent errors at rate "ber" among bits [from, from + count)
+void flip_errors(struct Channel *c, unsigned char *byte, int from, int count, double ber)
+{
+    while (c->untilError < count)
+    {
+        from += c->untilError;
+        count -= c->untilError + 1;
+        *byte ^= 1 << from++;
+        c->errors++;
+        c->untilError = geometric(c->rng, ber);
+    }
+    c->untilError -= count;
+}
+
+
+// Pass one byte (8 bits, LSB first) through the channel of a direction
+unsigned char corrupt(struct Channel *c, unsigned char byte)
+{
+    if (c->model == CHANNEL_BER)
+    {
+        flip_errors(c, &byte, 0, 8, c->ber);
+    }
+    else if (c->model == CHANNEL_GE)
+    {
+        for (int bit = 0; bit < 8;)
+        {
+            int n = c->untilEvent < 8 - bit ? (int) c->untilEvent + 1 : 8 - bit;
+            flip_errors(c, &byte, bit, n, c->bad ? c->berBad : c->berGood);
+            bit += n;
+            if (c->untilEvent != NEVER)
+                c->untilEvent -= n;
+            if (c->untilEvent < 0)
+            {
+                // The state changes after this bit
+                c->bad = !c->bad;
+                c->untilEvent = geometric(c->rng, c->bad ? c->pBadGood : c->pGoodBad);
+                c->untilError = geometric(c->rng, c->bad ? c->berBad : c->berGood);
+            }
+        }
+    }
+    else if (c->model == CHANNEL_BURST)
+    {
+        for (int bit = 0; bit < 8;)
+        {
+            if (c->burstLeft == 0)
+            {
+                if (c->untilEvent >= 8 - bit)
+                {
+                    if (c->untilEvent != NEVER)
+                        c->untilEvent -= 8 - bit;
+                    break;
+                }
+                bit += c->untilEvent;
+                c->burstSize = c->burstLeft = burst_length(c);
+            }
+
+            // A burst starts and ends with a wrong bit; the bits between are random
+            for (; bit < 8 && c->burstLeft > 0; bit++, c->burstLeft--)
+            {
+                int edge = c->burstLeft == c->burstSize || c->burstLeft == 1;
+                if (edge || (next_random(c->rng) >> 63))
+                {
+                    byte ^= 1 << bit;
+                    c->errors++;
+                }
+            }
+            if (c->burstLeft == 0)
+                c->untilEvent = geometric(c->rng, c->burstStart);
+        }
+    }
+    return byte;
+}
+
+
+// Print the model of a direction and the error rate it produced
+void print_channel(const struct Direction *d)
+{
+    const struct Channel *c = &d->channel;
+    const char *LENGTHS[] = {"fixed", "geometric", "uniform"};
+    printf("%s: ", d->name);
+    if (c->model == CHANNEL_BER)
+        printf("independent errors, BER %g", c->ber);
+    else if (c->model == CHANNEL_GE)
+        printf("Gilbert-Elliott, good->bad %g, bad->good %g, BER good %g, bad %g (average %g)",
+               c->pGoodBad, c->pBadGood, c->berGood, c->berBad,
+               (c->pBadGood * c->berGood + c->pGoodBad * c->berBad) / (c->pGoodBad + c->pBadGood));
+    else if (c->model == CHANNEL_BURST)
+        printf("bursts starting at %g per bit, %s length %g%s%.0f bits", c->burstStart,
+               LENGTHS[c->burstLength], c->lengthA,
+               c->burstLength == BURST_UNIFORM ? " to " : "", c->burstLength == BURST_UNIFORM ? c->lengthB : 0);
+    else
+        printf("no errors");
+    printf("; %lld bits carried, %lld flipped (BER %.3g)\n", c->bits, c->errors,
+           c->bits > 0 ? (double) c->errors / c->bits : 0.0);
+    printf("    %lu baud, jitter %lld usec, %lld bytes deleted (p=%g), %lld inserted (p=%g), "
+           "%lld duplicated (p=%g), ", d->baudRate, d->jitter / 1000, d->deleted, d->pDelete,
+           d->inserted, d->pInsert, d->duplicated, d->pDuplicate);
+    if (d->buffer > 0)
+        printf("%lld lost to a full %ld byte buffer\n", d->overflowed, d->buffer);
+    else
+        printf("unlimited buffer\n");
+}
+
+
+// Give a direction room for "capacity" bytes, keeping the bytes in flight.
+// Returns 0 on success, -1 on failure
+int resize_queue(struct Direction *d, long capacity)
+{
+    unsigned char *sent = malloc(capacity);
+    unsigned char *bytes = malloc(capacity);
+    unsigned char *flags = malloc(capacity);
+    long long *due = malloc(capacity * sizeof(long long));
+    if (sent == NULL || bytes == NULL || flags == NULL || due == NULL)
+    {
+        free(sent);
+        free(bytes);
+        free(flags);
+        free(due);
         return -1;
     }
-    bzero(par.tx2rxValid, par.bufSize);
-    bzero(par.rx2txValid, par.bufSize);
-    par.tx2rxIdx = 0;
-    par.rx2txIdx = 0;
-    printf("PROPAGATION DELAY SET TO %ld usec (DESIRED = %lu usec)\n", actualPropDelay, par.propDelay);
+
+    for (long i = 0; i < d->count; i++)
+    {
+        long k = (d->head + i) % d->capacity;
+        sent[i] = d->sent[k];
+        bytes[i] = d->bytes[k];
+        flags[i] = d->flags[k];
+        due[i] = d->due[k];
+    }
+    free(d->sent);
+    free(d->bytes);
+    free(d->flags);
+    free(d->due);
+    d->sent = sent;
+    d->bytes = bytes;
+    d->flags = flags;
+    d->due = due;
+    d->capacity = capacity;
+    d->head = 0;
+    return 0;
+}
+
+
+// Size the queues for the bytes in flight at the current baud rates,
+// propagation delay and jitter. Bytes already on the line are kept.
+// Returns 0 on success, -1 on failure
+int init_queues(void)
+{
+    struct Direction *dirs[] = {&par.tx2rx, &par.rx2tx};
+    for (int i = 0; i < 2; i++)
+    {
+        long long delay = 1000LL * par.propDelay + dirs[i]->jitter + HORIZON_NS;
+        long inFlight = delay / dirs[i]->byteTime + 2;
+        long capacity = MIN_QUEUE;
+        while (capacity < 2 * inFlight)
+            capacity *= 2;
+
+        long size = capacity > dirs[i]->count ? capacity : dirs[i]->count;
+        if (size != dirs[i]->capacity && resize_queue(dirs[i], size) < 0)
+        {
+            printf("OUT OF MEMORY FOR %ld BYTES IN FLIGHT\n", size);
+            return -1;
+        }
+    }
+    printf("PROPAGATION DELAY SET TO %lu usec\n", par.propDelay);
     return 0;
 }
 
 
 // Set the byte delay corresponding to the selected baud rate
-void set_baud_rate(unsigned long baud)
+void set_baud_rate(struct Direction *d, unsigned long baud)
 {
     // 10 bit times per byte; delay in nanoseconds
-    double delay = 1.0e10 / baud;
-    par.byteDelay.tv_sec = 0;
-    par.byteDelay.tv_nsec = (long) delay;
-    printf("BAUD RATE: %lu\n", baud);
-    init_ring_buffers();
+    d->baudRate = baud;
+    d->byteTime = 10000000000LL / baud;
 }
 
 
@@ -144,88 +520,299 @@ void set_rt_priority(void) {
 }
 
 
-// Compute the difference between two timespecs
-struct timespec timespec_diff(const struct timespec *t2, const struct timespec *t1)
+// Write the buffered capture records
+void flush_log(void)
 {
-    struct timespec diff = { .tv_sec = t2->tv_sec - t1->tv_sec,
-                             .tv_nsec = t2->tv_nsec - t1->tv_nsec };
-    if (diff.tv_nsec < 0) {
-        diff.tv_nsec += 1000000000;
-        --diff.tv_sec;
+    long done = 0;
+    while (done < par.logLength)
+    {
+        long n = write(par.logFd, par.logBuffer + done, par.logLength - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            printf("ERROR WRITING THE LOG, %ld BYTES LOST\n", par.logLength - done);
+            break;
+        }
+        done += n;
     }
-    return diff;
+    par.logLength = 0;
+    par.logFlushed = now_ns();
 }
 
 
-// Compute the sum of two timespecs
-struct timespec timespec_sum(const struct timespec *t1, const struct timespec *t2)
+void endlog(void)
 {
-    struct timespec sum = { .tv_sec = t1->tv_sec + t2->tv_sec,
-                             .tv_nsec = t1->tv_nsec + t2->tv_nsec };
-    if (sum.tv_nsec >= 1000000000) {
-        sum.tv_nsec -= 1000000000;
-        ++sum.tv_sec;
+    if (par.logFd >= 0)
+    {
+        flush_log();
+        close(par.logFd);
+        par.logFd = -1;
     }
-    return sum;
 }
 
 
-// Compare two timespecs returning -1, 0 or 1 if t1 is less than, equal or
-// greater than t2, respectively
-int timespec_comp(const struct timespec *t1, const struct timespec *t2)
+void startlog(const char *filename)
 {
-    if (t1->tv_sec < t2->tv_sec) {
-        return -1;
-    }
-    else if (t1->tv_sec > t2->tv_sec) {
-        return 1;
-    }
-    else if (t1->tv_nsec < t2->tv_nsec) {
-        return -1;
+    endlog();
+    if (par.logBuffer == NULL)
+        par.logBuffer = malloc(LOG_BUFFER_SIZE);
+    par.logFd = par.logBuffer != NULL ? open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+    if (par.logFd >= 0)
+    {
+        struct timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        par.logStart = now_ns();
+        memcpy(par.logBuffer, CAPTURE_MAGIC, 8);
+        put_le(par.logBuffer + 8, CAPTURE_VERSION, 4);
+        put_le(par.logBuffer + 12, CAPTURE_RECORD_SIZE, 4);
+        put_le(par.logBuffer + 16, wall.tv_sec * 1000000000ULL + wall.tv_nsec, 8);
+        par.logLength = CAPTURE_HEADER_SIZE;
+        par.logIdle = TRUE;
+        printf("LOGGING TO FILE %s\n", filename);
     }
-    else if (t1->tv_nsec > t2->tv_nsec) {
-        return 1;
+    else
+    {
+        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
     }
-    return 0;
 }
 
 
-int timespec_is_negative(const struct timespec *t)
+// Add a capture record: a byte of direction "d" at time "at" (ns), or an
+// event (with "d" NULL) when "flags" has CAP_EVENT
+void log_record(const struct Direction *d, long long at, int flags, unsigned char sent,
+                unsigned char received)
 {
-    if (t->tv_sec < 0 || t->tv_nsec < 0)
+    if (par.logLength + CAPTURE_RECORD_SIZE > LOG_BUFFER_SIZE)
+        flush_log();
+    unsigned char *record = par.logBuffer + par.logLength;
+    put_le(record, at > par.logStart ? at - par.logStart : 0, 8);
+    record[8] = flags | (d == &par.rx2tx ? CAP_RX2TX : 0);
+    record[9] = sent;
+    record[10] = received;
+    record[11] = 0;
+    par.logLength += CAPTURE_RECORD_SIZE;
+    if (!(flags & CAP_EVENT))
+        par.logIdle = FALSE;
+    else if (sent == CAP_EVENT_IDLE)
+        par.logIdle = TRUE;
+}
+
+
+// Bytes the UART of a direction can take now without running more than
+// HORIZON_NS ahead of the line
+long tokens(const struct Direction *d, long long now)
+{
+    long long lineFree = d->lineFree > now ? d->lineFree : now;
+    long n = (now + HORIZON_NS - lineFree) / d->byteTime;
+    long room = d->capacity - d->count;
+    // Leave space for a duplicate and a spurious byte after each one
+    room /= 1 + (d->pInsert > 0) + (d->pDuplicate > 0);
+    if (n > room)
+        n = room;
+    return n < IO_SIZE ? n : IO_SIZE;
+}
+
+
+// Queue a byte that will take the line for one byte time
+void queue_byte(struct Direction *d, unsigned char sent, unsigned char byte, unsigned char flags)
+{
+    d->lineFree += d->byteTime;
+    long long due = d->lineFree + 1000LL * par.propDelay;
+    if (d->jitter > 0)
+        due += next_random(d->channel.rng) % (d->jitter + 1);
+    if (due < d->lastDue)
+        due = d->lastDue;  // Bytes never overtake each other
+    d->lastDue = due;
+
+    long k = (d->head + d->count++) % d->capacity;
+    d->sent[k] = sent;
+    d->bytes[k] = byte;
+    d->flags[k] = flags;
+    d->due[k] = due;
+}
+
+
+// Read what the UART can send from "in" and queue it with its delivery time
+void accept_bytes(struct Direction *d, long long now)
+{
+    unsigned char buf[IO_SIZE];
+    long n = tokens(d, now);
+    if (n <= 0)
+        return;
+    n = read(d->in, buf, n);
+    if (n <= 0)
+        return;
+    if (par.start < 0)
+        par.start = now;  // The timeline starts with the first byte
+    par.lastActivity = now;
+
+    // An idle line starts sending now
+    if (d->lineFree < now)
+        d->lineFree = now;
+
+    for (long i = 0; i < n; i++)
     {
-        return TRUE;
+        if (!par.cableOn)
+        {
+            d->lineFree += d->byteTime;
+            continue;  // Lost on the unplugged cable
+        }
+
+        unsigned char byte = buf[i];
+        d->channel.bits += 8;
+        if (d->channel.model != CHANNEL_CLEAN)
+            byte = corrupt(&d->channel, byte);
+
+        unsigned char flags = 0;
+        if (d->untilDelete-- == 0)
+        {
+            flags = BYTE_DELETED;
+            d->deleted++;
+            d->untilDelete = geometric(d->channel.rng, d->pDelete);
+        }
+        queue_byte(d, buf[i], byte, flags);
+
+        // The same byte again, through the channel on its own
+        if (d->untilDuplicate-- == 0)
+        {
+            d->channel.bits += 8;
+            byte = d->channel.model != CHANNEL_CLEAN ? corrupt(&d->channel, buf[i]) : buf[i];
+            queue_byte(d, byte, byte, BYTE_INSERTED);
+            d->duplicated++;
+            d->untilDuplicate = geometric(d->channel.rng, d->pDuplicate);
+        }
+
+        if (d->untilInsert-- == 0)
+        {
+            byte = next_random(d->channel.rng);
+            queue_byte(d, byte, byte, BYTE_INSERTED);
+            d->inserted++;
+            d->untilInsert = geometric(d->channel.rng, d->pInsert);
+        }
     }
-    return FALSE;
 }
 
 
-void endlog(void)
+// The far end is not reading: once more bytes are due than its buffer
+// holds, the newest of them are lost, as in a UART overrun
+void overflow(struct Direction *d, long long now)
 {
-    if (par.logfile != NULL)
+    long end = 0, held = 0;
+    while (end < d->count && d->due[(d->head + end) % d->capacity] <= now)
     {
-        fclose(par.logfile);
-        par.logfile = NULL;
+        held += !(d->flags[(d->head + end) % d->capacity] & BYTE_DELETED);
+        end++;
     }
+    if (held <= d->buffer)
+        return;
+
+    // Walk back from the newest due byte, moving the ones kept to the end
+    long lost = held - d->buffer, kept = end;
+    for (long i = end - 1; i >= 0; i--)
+    {
+        long k = (d->head + i) % d->capacity;
+        if (lost > 0 && !(d->flags[k] & BYTE_DELETED))
+        {
+            if (par.logFd >= 0)
+                log_record(d, d->due[k], CAP_OVERFLOW, d->sent[k], 0);
+            lost--;
+            d->overflowed++;
+            continue;
+        }
+        long to = (d->head + --kept) % d->capacity;
+        d->sent[to] = d->sent[k];
+        d->bytes[to] = d->bytes[k];
+        d->flags[to] = d->flags[k];
+        d->due[to] = d->due[k];
+    }
+    d->head = (d->head + kept) % d->capacity;
+    d->count -= kept;
 }
 
 
-void startlog(const char *filename)
+// Write every byte that is due to "out", in as few writes as possible
+void deliver_bytes(struct Direction *d, long long now)
 {
-    endlog();
-    par.logfile = fopen(filename, "w");
-    if (par.logfile != NULL)
+    // Bytes held up by a far end that is not reading are not late
+    if (d->count > 0 && now - d->due[d->head] > LATE_WARNING_NS && !d->blocked &&
+        !par.unreliableRate)
     {
-        fprintf(par.logfile, "Tx->Rx | Rx->Tx\n");
-        printf("LOGGING TO FILE %s\n", filename);
+        printf("UNRELIABLE RATE: Could not keep up, delivery %.1f ms late\n"
+               "No further warnings will be issued\n", (now - d->due[d->head]) / 1e6);
+        par.unreliableRate = TRUE;
     }
-    else
+
+    d->blocked = FALSE;
+    while (d->count > 0 && d->due[d->head] <= now)
     {
-        printf("ERROR OPENING FILE %s, NOT LOGGING\n", filename);
+        if (d->flags[d->head] & BYTE_DELETED)
+        {
+            if (par.logFd >= 0)
+                log_record(d, d->due[d->head], CAP_DELETED, d->sent[d->head], 0);
+            d->head = (d->head + 1) % d->capacity;
+            d->count--;
+            continue;
+        }
+
+        // Due bytes up to the end of the ring or the next deleted one
+        long n = 0;
+        while (n < d->count && d->head + n < d->capacity && d->due[d->head + n] <= now &&
+               !(d->flags[d->head + n] & BYTE_DELETED))
+            n++;
+
+        long written = write(d->out, d->bytes + d->head, n);
+        if (written <= 0)
+        {
+            d->blocked = written < 0 && errno == EAGAIN;
+            if (d->blocked && d->buffer > 0)
+                overflow(d, now);
+            break;
+        }
+        if (par.logFd >= 0)
+        {
+            for (long i = 0, k = d->head; i < written; i++, k++)
+            {
+                int flags = d->flags[k] & BYTE_INSERTED ? CAP_INSERTED
+                            : d->sent[k] != d->bytes[k] ? CAP_CORRUPT
+                                                        : 0;
+                log_record(d, d->due[k], flags, d->sent[k], d->bytes[k]);
+            }
+        }
+        d->head = (d->head + written) % d->capacity;
+        d->count -= written;
+        par.lastActivity = now;
+    }
+
+    if (par.logFd >= 0 && !par.logIdle && par.tx2rx.count == 0 && par.rx2tx.count == 0)
+    {
+        log_record(NULL, now, CAP_EVENT, CAP_EVENT_IDLE, 0);
+        if (now - par.logFlushed > LOG_FLUSH_NS)
+            flush_log();
     }
 }
 
 
+// Earliest time (ns) at which a direction has something to do, or -1 if it
+// only waits for its input
+long long next_event(const struct Direction *d, long long now)
+{
+    long long next = -1;
+    if (d->count > 0 && !d->blocked)
+        next = d->due[d->head];
+    else if (d->count > d->buffer && d->buffer > 0 && d->due[(d->head + d->buffer) % d->capacity] > now)
+        next = d->due[(d->head + d->buffer) % d->capacity];  // When the buffer overflows
+    if (tokens(d, now) <= 0 && d->count < d->capacity)
+    {
+        // Refill once the line has sent half of what it was given
+        long long ready = d->lineFree - HORIZON_NS / 2;
+        if (next < 0 || ready < next)
+            next = ready;
+    }
+    return next;
+}
+
+
 // Show help
 void help()
 {
@@ -237,23 +824,453 @@ void help()
            "--- help         : show this help\n"
            "--- on           : connect the cable and data is exchanged (default state)\n"
            "--- off          : disconnect the cable disabling data to be exchanged\n"
-           "--- ber <ber>    : add noise to data bits at a specified BER (default=0)\n"
-           "--- baud <rate>  : set baud rate, between 1200 and 115200 (default=9600)\n"
-           "                   note that 10 bits are sent per byte (8-N-1)\n"
+           "--- ber <ber>    : flip each data bit independently with probability <ber>\n"
+           "                   (default=0, no errors)\n"
+           "--- ge <pgb> <pbg> <ber_good> <ber_bad>\n"
+           "                 : Gilbert-Elliott channel: each bit moves from the good to\n"
+           "                   the bad state with probability <pgb> and back with <pbg>,\n"
+           "                   and is wrong with the error rate of its state\n"
+           "--- burst <p> fixed <len> | geom <mean> | uniform <min> <max>\n"
+           "                 : a burst of <len> bits starts at each bit with probability\n"
+           "                   <p>; its first and last bits are wrong, and the others\n"
+           "                   are wrong with probability 1/2\n"
+           "--- drop <p>     : lose each byte with probability <p> (default=0)\n"
+           "--- insert <p>   : add a spurious random byte after each byte with\n"
+           "                   probability <p> (default=0)\n"
+           "--- dup <p>      : deliver each byte twice with probability <p> (default=0)\n"
+           "--- jitter <max> : delay each byte by up to <max> usec more, at random;\n"
+           "                   bytes stay in order (0-1000000, default=0)\n"
+           "--- buffer <n>   : the far end holds <n> unread bytes beyond its serial\n"
+           "                   port's buffer and loses newer ones (default=0, no limit)\n"
+           "--- baud <rate>  : set baud rate, between 1 and %d (default=9600)\n"
+           "                   note that 10 bits are sent per byte (8-N-1); rates other\n"
+           "                   than the standard ones are emulated exactly\n"
+           "--- channel      : show the settings of each direction and the errors so far\n"
+           "    Prefix any of the commands above with tx2rx or rx2tx to apply it to one\n"
+           "    direction only, e.g. \"rx2tx ber 1e-5\" or \"rx2tx baud 1200\"\n"
            "--- prop <delay> : set the propagation delay in usec (0-1000000, default=0)\n"
-           "                   will be approximated to an integer multiple of the byte\n"
-           "                   delay (10 / baud_rate)\n"
-           "--- log <file>   : log transmitted data to file\n"
-           "--- endlog       : stop logging transmitted data\n"
+           "--- log <file>   : capture the bytes on the line to file, in binary; see\n"
+           "                   bin/cable_log to view it as text or convert it to pcap\n"
+           "--- endlog       : stop capturing\n"
            "--- quit         : terminate the program\n"
            "\n"
-           "IMPORTANT: Changing the baud rate or propagation delay while a transmission is\n"
-           "           ongoing will result in losses.\n"
-           "\n");
+           "Bytes already on the line keep the timing they were sent with when the baud\n"
+           "rate or propagation delay changes.\n"
+           "\n", MAX_BAUDRATE);
+}
+
+
+// Parse a channel command ("ber", "ge" or "burst") into "c".
+// Returns FALSE if the command is not one, or its parameters are bad.
+int parse_channel(const char *command, struct Channel *c)
+{
+    char length[16];
+    int n = 0;
+    if (sscanf(command, "ber %lf %n", &c->ber, &n) == 1 && command[n] == '\0')
+    {
+        c->model = c->ber > 0 ? CHANNEL_BER : CHANNEL_CLEAN;
+        return c->ber >= 0 && c->ber < 1;
+    }
+    if (sscanf(command, "ge %lf %lf %lf %lf %n", &c->pGoodBad, &c->pBadGood, &c->berGood,
+               &c->berBad, &n) == 4 && command[n] == '\0')
+    {
+        c->model = CHANNEL_GE;
+        return c->pGoodBad >= 0 && c->pGoodBad <= 1 && c->pBadGood > 0 && c->pBadGood <= 1 &&
+               c->berGood >= 0 && c->berGood < 1 && c->berBad >= 0 && c->berBad < 1;
+    }
+    if (sscanf(command, "burst %lf %15s %lf %n", &c->burstStart, length, &c->lengthA, &n) == 3)
+    {
+        c->model = CHANNEL_BURST;
+        c->lengthB = c->lengthA;
+        if (strcmp(length, "fixed") == 0)
+            c->burstLength = BURST_FIXED;
+        else if (strcmp(length, "geom") == 0)
+            c->burstLength = BURST_GEOMETRIC;
+        else if (strcmp(length, "uniform") == 0)
+            c->burstLength = BURST_UNIFORM;
+        else
+            return FALSE;
+
+        int more = 0;
+        if (c->burstLength == BURST_UNIFORM &&
+            sscanf(command + n, "%lf %n", &c->lengthB, &more) < 1)
+            return FALSE;
+        return command[n + more] == '\0' && c->burstStart >= 0 && c->burstStart < 1 &&
+               c->lengthA >= 1 && c->lengthB >= c->lengthA && c->lengthB <= 1000000;
+    }
+    return FALSE;
 }
 
+
+// Run one command (a line without its newline)
+void run_command(const char *command)
+{
+    // Line commands may name the direction they apply to
+    struct Direction *dirs[] = {&par.tx2rx, &par.rx2tx};
+    int first = 0, last = 1;
+    if (strncmp(command, "tx2rx ", 6) == 0 || strncmp(command, "rx2tx ", 6) == 0)
+    {
+        first = last = command[0] == 'r';
+        command += 6;
+    }
+
+    struct Channel channel = dirs[first]->channel;
+    if (strncmp(command, "ber ", 4) == 0 || strncmp(command, "ge ", 3) == 0 ||
+        strncmp(command, "burst ", 6) == 0)
+    {
+        if (!parse_channel(command, &channel))
+        {
+            printf("BAD CHANNEL PARAMETERS (SEE help)\n");
+            return;
+        }
+        for (int i = first; i <= last; i++)
+        {
+            struct Channel *c = &dirs[i]->channel;
+            uint64_t rng[4];
+            memcpy(rng, c->rng, sizeof(rng));
+            long long bits = c->bits, errors = c->errors;
+            *c = channel;
+            memcpy(c->rng, rng, sizeof(rng));
+            c->bits = bits;
+            c->errors = errors;
+            reset_channel(c);
+            print_channel(dirs[i]);
+        }
+    }
+    else if (strcmp(command, "channel") == 0)
+    {
+        for (int i = first; i <= last; i++)
+            print_channel(dirs[i]);
+    }
+    else if (strncmp(command, "baud ", 5) == 0)
+    {
+        unsigned long baud = 0;
+        if (sscanf(command + 5, "%lu", &baud) < 1 || baud < 1 || baud > MAX_BAUDRATE)
+        {
+            printf("BAD OR OUT OF RANGE BAUD RATE (1-%d)\n", MAX_BAUDRATE);
+            return;
+        }
+        for (int i = first; i <= last; i++)
+        {
+            set_baud_rate(dirs[i], baud);
+        }
+        if (first == last)
+            printf("%s BAUD RATE: %lu\n", dirs[first]->name, baud);
+        else
+            printf("BAUD RATE: %lu\n", baud);
+        init_queues();
+    }
+    else if (strncmp(command, "drop ", 5) == 0 || strncmp(command, "insert ", 7) == 0 ||
+             strncmp(command, "dup ", 4) == 0)
+    {
+        int drop = command[1] == 'r', dup = command[1] == 'u';
+        double p = -1;
+        sscanf(strchr(command, ' '), "%lf", &p);
+        if (p < 0 || p >= 1)
+        {
+            printf("BAD PROBABILITY %lf (MUST BE 0 <= P < 1.0)\n", p);
+            return;
+        }
+        for (int i = first; i <= last; i++)
+        {
+            struct Direction *d = dirs[i];
+            if (drop)
+            {
+                d->pDelete = p;
+                d->untilDelete = geometric(d->channel.rng, p);
+            }
+            else if (dup)
+            {
+                d->pDuplicate = p;
+                d->untilDuplicate = geometric(d->channel.rng, p);
+            }
+            else
+            {
+                d->pInsert = p;
+                d->untilInsert = geometric(d->channel.rng, p);
+            }
+            printf("%s BYTE %s PROBABILITY SET TO %g\n", d->name,
+                   drop ? "DELETION" : dup ? "DUPLICATION" : "INSERTION", p);
+        }
+    }
+    else if (strncmp(command, "jitter ", 7) == 0)
+    {
+        unsigned long jitter;
+        if (sscanf(command + 7, "%lu", &jitter) < 1 || jitter > MAX_DELAY_US)
+        {
+            printf("BAD OR OUT OF RANGE JITTER\n");
+            return;
+        }
+        for (int i = first; i <= last; i++)
+        {
+            dirs[i]->jitter = 1000LL * jitter;
+            printf("%s JITTER SET TO %lu usec\n", dirs[i]->name, jitter);
+        }
+        init_queues();
+    }
+    else if (strncmp(command, "buffer ", 7) == 0)
+    {
+        long buffer = -1;
+        sscanf(command + 7, "%ld", &buffer);
+        if (buffer < 0)
+        {
+            printf("BAD BUFFER SIZE\n");
+            return;
+        }
+        for (int i = first; i <= last; i++)
+        {
+            dirs[i]->buffer = buffer;
+            printf("%s BUFFER SET TO %ld BYTES%s\n", dirs[i]->name, buffer, buffer == 0 ? " (NO LIMIT)" : "");
+        }
+    }
+    else if (first != 0 || last != 1)
+    {
+        printf("COMMAND TAKES NO DIRECTION\n");
+    }
+    else if (strcmp(command, "off") == 0)
+    {
+        printf("CONNECTION OFF\n");
+        if (par.cableOn && par.logFd >= 0)
+        {
+            log_record(NULL, now_ns(), CAP_EVENT, CAP_EVENT_OFF, 0);
+        }
+        par.cableOn = FALSE;
+    }
+    else if (strcmp(command, "on") == 0)
+    {
+        printf("CONNECTION ON\n");
+        par.cableOn = TRUE;
+    }
+    else if (strncmp(command, "prop ", 5) == 0)
+    {
+        unsigned long propDelay;
+        if (sscanf(command + 5, "%lu", &propDelay) < 1 || propDelay > MAX_DELAY_US)
+        {
+            printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
+        }
+        else
+        {
+            par.propDelay = propDelay;
+            init_queues();
+        }
+    }
+    else if (strncmp(command, "log ", 4) == 0)
+    {
+        startlog(command + 4);
+    }
+    else if (strcmp(command, "endlog") == 0)
+    {
+        endlog();
+        printf("NOT LOGGING\n");
+    }
+    else if (strcmp(command, "quit") == 0)
+    {
+        printf("END OF THE PROGRAM\n");
+        par.stop = TRUE;
+    }
+    else if (strcmp(command, "help") == 0) {
+        help();
+    }
+    else if (command[0] != '\0') {
+        printf("BAD COMMAND OR MISSING PARAMETERS\n");
+    }
+}
+
+
+// Run every complete line read from stdin so far.
+// Returns FALSE once stdin is closed.
+int read_commands(char *pending, int *length)
+{
+    int n = read(STDIN_FILENO, pending + *length, BUF_SIZE - 1 - *length);
+    if (n == 0 || (n < 0 && errno != EAGAIN))
+        return FALSE;
+    if (n < 0)
+        return TRUE;
+    *length += n;
+
+    char *line = pending, *newline;
+    while ((newline = memchr(line, '\n', pending + *length - line)) != NULL)
+    {
+        *newline = '\0';
+        run_command(line);
+        line = newline + 1;
+    }
+
+    // Keep a partial line; drop a line too long to ever be a command
+    *length -= line - pending;
+    memmove(pending, line, *length);
+    if (*length == BUF_SIZE - 1)
+        *length = 0;
+    return TRUE;
+}
+
+
+// Add the entries of a timeline ("t=<seconds> <command>", separated by
+// newlines or ';', '#' starting a comment) in time order.
+// Returns 0 on success, -1 on a malformed entry
+int parse_timeline(char *text)
+{
+    char *saveptr;
+    for (char *entry = strtok_r(text, ";\n", &saveptr); entry != NULL;
+         entry = strtok_r(NULL, ";\n", &saveptr))
+    {
+        while (isspace((unsigned char) *entry))
+            entry++;
+        char *end = entry + strlen(entry);
+        while (end > entry && isspace((unsigned char) end[-1]))
+            *--end = '\0';
+        if (*entry == '\0' || *entry == '#')
+            continue;
+
+        char *command;
+        double seconds = entry[0] == 't' && entry[1] == '=' ? strtod(entry + 2, &command) : -1;
+        if (seconds < 0 || command == entry + 2 || !isspace((unsigned char) *command))
+        {
+            printf("BAD TIMELINE ENTRY \"%s\" (MUST BE t=<seconds> <command>)\n", entry);
+            return -1;
+        }
+        while (isspace((unsigned char) *command))
+            command++;
+        if (strlen(command) >= COMMAND_SIZE || par.eventCount == MAX_EVENTS)
+        {
+            printf("TIMELINE ENTRY TOO LONG OR TOO MANY ENTRIES (MAX %d)\n", MAX_EVENTS);
+            return -1;
+        }
+
+        // Insert after every entry at the same time or earlier
+        long long at = (long long) (seconds * 1e9);
+        int i = par.eventCount++;
+        for (; i > 0 && par.events[i - 1].at > at; i--)
+            par.events[i] = par.events[i - 1];
+        par.events[i].at = at;
+        strcpy(par.events[i].command, command);
+    }
+    return 0;
+}
+
+
+// Add the timeline in "filename".
+// Returns 0 on success, -1 on failure
+int load_timeline(const char *filename)
+{
+    FILE *file = fopen(filename, "r");
+    if (file == NULL)
+    {
+        perror(filename);
+        return -1;
+    }
+    char *text = NULL;
+    size_t size = 0;
+    ssize_t length = getdelim(&text, &size, '\0', file);
+    fclose(file);
+    int status = length < 0 ? 0 : parse_timeline(text);
+    free(text);
+    return status;
+}
+
+
+// Run the timeline commands that are due. Times count from the first byte on
+// the cable; entries at t=0 run when the cable starts.
+void run_timeline(long long now)
+{
+    while (par.nextEvent < par.eventCount && !par.stop)
+    {
+        struct Event *e = &par.events[par.nextEvent];
+        if (e->at > 0 && (par.start < 0 || now < par.start + e->at))
+            break;
+        printf("t=%.3f: %s\n", par.start < 0 ? 0 : (now - par.start) / 1e9, e->command);
+        run_command(e->command);
+        par.nextEvent++;
+    }
+
+    // Exit on completion: the timeline is over and the line went quiet
+    if (par.exitIdle >= 0 && par.nextEvent == par.eventCount && par.start >= 0 &&
+        par.tx2rx.count == 0 && par.rx2tx.count == 0 && now - par.lastActivity >= par.exitIdle)
+    {
+        printf("TIMELINE DONE AND CABLE IDLE FOR %.1f s, EXITING\n", par.exitIdle / 1e9);
+        par.stop = TRUE;
+    }
+}
+
+
+// Earliest time (ns) at which the timeline has something to do, or -1
+long long timeline_wake(void)
+{
+    if (par.start < 0)
+        return -1;
+    if (par.nextEvent < par.eventCount)
+        return par.start + par.events[par.nextEvent].at;
+    if (par.exitIdle >= 0)
+        return par.lastActivity + par.exitIdle;
+    return -1;
+}
+
+
+void usage(const char *program)
+{
+    printf("Usage: %s [-f timeline_file] [-c timeline] [-s seed] [-x idle_seconds]\n"
+           "  -f, -c : run commands at given times, from a file or the command line,\n"
+           "           e.g. -c \"t=0 baud 115200; t=2.0 off; t=3.5 on; t=5 ber 1e-4\".\n"
+           "           Times are seconds since the first byte crossed the cable;\n"
+           "           t=0 entries run at start. Entries are separated by ';' or\n"
+           "           newlines, and '#' starts a comment line\n"
+           "  -s     : seed of the bit error generators (default %d), so errors repeat\n"
+           "  -x     : once the timeline is over, exit when no byte has crossed the\n"
+           "           cable for this many seconds\n", program, DEFAULT_SEED);
+}
+
+
 int main(int argc, char *argv[])
 {
+    unsigned int seed = DEFAULT_SEED;
+    int opt;
+    par.events = calloc(MAX_EVENTS, sizeof(struct Event));
+    if (par.events == NULL)
+    {
+        perror("calloc");
+        exit(-1);
+    }
+    while ((opt = getopt(argc, argv, "f:c:s:x:h")) != -1)
+    {
+        int status = 0;
+        switch (opt)
+        {
+        case 'f':
+            status = load_timeline(optarg);
+            break;
+        case 'c':
+            status = parse_timeline(optarg);
+            break;
+        case 's':
+            seed = strtoul(optarg, NULL, 0);
+            break;
+        case 'x':
+            par.exitIdle = (long long) (atof(optarg) * 1e9);
+            status = par.exitIdle >= 0 ? 0 : -1;
+            break;
+        default:
+            status = -1;
+        }
+        if (status < 0)
+        {
+            usage(argv[0]);
+            exit(-1);
+        }
+    }
+    if (optind < argc)
+    {
+        usage(argv[0]);
+        exit(-1);
+    }
+
+    // Independent generators for the two directions
+    uint64_t state = seed;
+    for (int k = 0; k < 4; k++)
+    {
+        par.tx2rx.channel.rng[k] = splitmix64(&state);
+        par.rx2tx.channel.rng[k] = splitmix64(&state);
+    }
+
     printf("\n");
 
     system("socat -dd PTY,link=" TXDEV ",mode=777,raw,echo=0 PTY,link=" TX_EMULATOR ",mode=777,raw,echo=0 &");
@@ -288,255 +1305,80 @@ int main(int argc, char *argv[])
         exit(-1);
     }
 
+    par.tx2rx.in = par.rx2tx.out = fdTx;
+    par.rx2tx.in = par.tx2rx.out = fdRx;
+
     // Configure stdin to receive commands to this program
     int oldf = fcntl(STDIN_FILENO, F_GETFL, 0);
     fcntl(STDIN_FILENO, F_SETFL, oldf | O_NONBLOCK);
 
-    char rxStdin[BUF_SIZE] = {0};
+    char pending[BUF_SIZE];
+    int pendingLength = 0;
+    int stdinOpen = TRUE;
 
-    int STOP = FALSE;
-
-    set_baud_rate(DEFAULT_BAUDRATE);
+    set_baud_rate(&par.tx2rx, DEFAULT_BAUDRATE);
+    set_baud_rate(&par.rx2tx, DEFAULT_BAUDRATE);
+    init_queues();
 
     set_rt_priority();
 
-    // For logging
-    char tx2rxTx[3], tx2rxRx[3], rx2txTx[3], rx2txRx[3];
-    int cableIdle = FALSE;
-
-    printf("\nCable ready\n\n");
+    printf("\nCable ready (RNG seed %u", seed);
+    if (par.eventCount > 0)
+        printf(", timeline of %d commands", par.eventCount);
+    printf(")\n\n");
+    run_timeline(now_ns());
 
-    // To compensate for deviations in byte transmission time
-    struct timespec currentTime, nextTxTime, timeDiff, nextWait;
-    int skipWait = FALSE;
-    int unreliableRate = FALSE;
-    clock_gettime(CLOCK_MONOTONIC, &nextTxTime);
-
-    while (STOP == FALSE)
+    struct Direction *dirs[] = {&par.tx2rx, &par.rx2tx};
+    while (par.stop == FALSE)
     {
-        // Check how much waiting time we should have (if any)
-        clock_gettime(CLOCK_MONOTONIC, &currentTime);
-        timeDiff = timespec_diff(&currentTime, &nextTxTime);
-        nextTxTime = timespec_sum(&nextTxTime, &par.byteDelay);
-        if (timeDiff.tv_sec >= 1)
-        {
-            if (unreliableRate == FALSE)
-            {
-                printf("UNRELIABLE RATE: Could not keep up, timeDiff exceeded 1s\n"
-                       "No further warnings will be issued\n");
-                unreliableRate = TRUE;
-            }
-        }
-        nextWait = timespec_diff(&nextTxTime, &currentTime);
-        if (timespec_is_negative(&nextWait))
-        {
-            skipWait = TRUE;
-        }
-        else
-        {
-            skipWait = FALSE;
-        }
-
-        // Read from Tx
-        int bytesFromTx = read(fdTx, par.tx2rx + par.tx2rxIdx, 1);
-        par.tx2rxValid[par.tx2rxIdx] = bytesFromTx > 0;
-
-        // Read from Rx
-        int bytesFromRx = read(fdRx, par.rx2tx + par.rx2txIdx, 1);
-        par.rx2txValid[par.rx2txIdx] = bytesFromRx > 0;
-
-        if (!par.cableOn)
+        long long now = now_ns();
+        for (int i = 0; i < 2; i++)
         {
-            // Ignore what was read
-            par.tx2rxValid[par.tx2rxIdx] = 0;
-            par.rx2txValid[par.rx2txIdx] = 0;
+            deliver_bytes(dirs[i], now);
+            accept_bytes(dirs[i], now);
         }
-
-        if (par.logfile != NULL)  // Currently logging
+        run_timeline(now);
+        if (par.stop)
+            break;
+
+        // Wait for input the UARTs can take, a far end that can take more,
+        // a command, or the next byte that is due
+        struct pollfd fds[5];
+        int nfds = 0;
+        long long wake = timeline_wake();
+        for (int i = 0; i < 2; i++)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxTx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxTx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txTx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txTx, "  ", 3);
-            }
+            struct Direction *d = dirs[i];
+            if (tokens(d, now) > 0)
+                fds[nfds++] = (struct pollfd){.fd = d->in, .events = POLLIN};
+            if (d->blocked)
+                fds[nfds++] = (struct pollfd){.fd = d->out, .events = POLLOUT};
+            long long next = next_event(d, now);
+            if (next >= 0 && (wake < 0 || next < wake))
+                wake = next;
         }
+        if (stdinOpen)
+            fds[nfds++] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
 
-        // Advance indices to next position
-        par.tx2rxIdx = (par.tx2rxIdx + 1) % par.bufSize;
-        par.rx2txIdx = (par.rx2txIdx + 1) % par.bufSize;
-
-        if (par.cableOn)
+        struct timespec timeout, *timeoutp = NULL;
+        if (wake >= 0)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.tx2rx[par.tx2rxIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdRx, par.tx2rx + par.tx2rxIdx, 1);
-            }
-
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                // Add error, if applicable
-                if (par.byteER != 0.0 && (double) rand() / (double) RAND_MAX < par.byteER)
-                {
-                    // At most one wrong bit per byte, good enough if ber < 0.02
-                    par.rx2tx[par.rx2txIdx] ^= (char) 1 << rand() % 8;
-                }
-                write(fdTx, par.rx2tx + par.rx2txIdx, 1);
-            }
+            long long wait = wake - now_ns();
+            if (wait < MIN_SLEEP_NS)
+                wait = MIN_SLEEP_NS;
+            timeout.tv_sec = wait / 1000000000LL;
+            timeout.tv_nsec = wait % 1000000000LL;
+            timeoutp = &timeout;
         }
-
-        if (par.logfile != NULL)  // Currently logging
+        if (ppoll(fds, nfds, timeoutp, NULL) < 0 && errno != EINTR)
         {
-            if (par.tx2rxValid[par.tx2rxIdx])
-            {
-                sprintf(tx2rxRx, "%02hhX", par.tx2rx[par.tx2rxIdx]);
-            }
-            else
-            {
-                memcpy(tx2rxRx, "  ", 3);
-            }
-            if (par.rx2txValid[par.rx2txIdx])
-            {
-                sprintf(rx2txRx, "%02hhX", par.rx2tx[par.rx2txIdx]);
-            }
-            else
-            {
-                memcpy(rx2txRx, "  ", 3);
-            }
-
-            if (*tx2rxTx == ' ' && *rx2txTx == ' ' && *tx2rxRx == ' ' && *rx2txRx == ' ')
-            {
-                if (cableIdle == FALSE)
-                {
-                    fputs("---------------\n", par.logfile);
-                    cableIdle = TRUE;
-                }
-            }
-            else
-            {
-                fprintf(par.logfile, "%s  %s | %s  %s\n", tx2rxTx, tx2rxRx, rx2txTx, rx2txRx);
-                cableIdle = FALSE;
-            }
+            perror("ppoll");
+            break;
         }
 
         // Read commands from STDIN to control the cable mode
-        int fromStdin = read(STDIN_FILENO, rxStdin, BUF_SIZE);
-        if (fromStdin > 0)
-        {
-            rxStdin[fromStdin - 1] = '\0';
-
-            if (strcmp(rxStdin, "off") == 0)
-            {
-                printf("CONNECTION OFF\n");
-                if (par.cableOn && par.logfile != NULL)
-                {
-                    fputs("CABLE OFF\n", par.logfile);
-                }
-                par.cableOn = FALSE;
-            }
-            else if (strcmp(rxStdin, "on") == 0)
-            {
-                printf("CONNECTION ON\n");
-                par.cableOn = TRUE;
-            }
-            else if (strncmp(rxStdin, "ber ", 4) == 0)
-            {
-                double ber;
-                sscanf(rxStdin + 4, "%lf", &ber);
-                // Compute pow(1 - ber, 8) without libm
-                double acc = 1 - ber;
-                acc *= acc;   // Squared
-                acc *= acc;   // To the fourth
-                acc *= acc;   // To the eighth
-                par.byteER = 1.0 - acc;
-                //printf("Byte Error Rate is %lf\n", par.byteER);
-                if (ber >= 0.0 && ber < 1.0)
-                {
-                    printf("BER SET TO %lf\n", ber);
-                    if (ber > 0.01)
-                    {
-                        printf("   ACTUAL BER WILL BE LOWER THAN DEFINED FOR VALUES ABOVE 0.01\n");
-                    }
-                }
-                else
-                {
-                    printf("BAD BER VALUE %lf (MUST BE 0 <= BER < 1.0)", ber);
-                }
-            }
-            else if (strncmp(rxStdin, "baud ", 5) == 0)
-            {
-                unsigned long baud = 0;
-                sscanf(rxStdin + 5, "%lu", &baud);
-                switch (baud) {
-                    case 1200:
-                    case 1800:
-                    case 2400:
-                    case 4800:
-                    case 9600:
-                    case 19200:
-                    case 38400:
-                    case 57600:
-                    case 115200:
-                        set_baud_rate(baud);
-                        break;
-                    default:
-                        printf("UNSUPPORTED BAUD RATE: must be one of 1200, 1800, 2400, 4800, 9600, 19200, 38400, 57600 or 115200\n");
-                }
-            }
-            else if (strncmp(rxStdin, "prop ", 5) == 0)
-            {
-                unsigned long propDelay;
-                if (sscanf(rxStdin + 5, "%lu", &propDelay) < 1 || propDelay > 1000000)
-                {
-                    printf("BAD OR OUT OF RANGE PROPAGATION DELAY\n");
-                }
-                else
-                {
-                    par.propDelay = propDelay;
-                    init_ring_buffers();
-                }
-            }
-            else if (strncmp(rxStdin, "log ", 4) == 0)
-            {
-                startlog(rxStdin + 4);
-            }
-            else if (strcmp(rxStdin, "endlog") == 0)
-            {
-                endlog();
-                printf("NOT LOGGING\n");
-            }
-            else if (strcmp(rxStdin, "quit") == 0)
-            {
-                printf("END OF THE PROGRAM\n");
-                STOP = TRUE;
-            }
-            else if (strcmp(rxStdin, "help") == 0) {
-                help();
-            }
-            else {
-                printf("BAD COMMAND OR MISSING PARAMETERS\n");
-            }
-        }
-
-        if (skipWait == FALSE) {
-            nanosleep(&nextWait, NULL);
-        }
+        if (stdinOpen && fds[nfds - 1].revents != 0)
+            stdinOpen = read_commands(pending, &pendingLength);
     }
 
     // Restore the old port settings
@@ -554,6 +1396,7 @@ int main(int argc, char *argv[])
 
     close(fdTx);
     close(fdRx);
+    endlog();
 
     system("killall socat");
 
@@ -0,0 +1,270 @@
+// Capture converter for the virtual cable.
+// Reads a binary capture written by the cable's "log" command (see
+// capture.h) and prints the text view the cable used to write itself, or
+// writes a pcap file with one packet per frame for Wireshark or tcpdump.
+//
+// Usage: cable_log [-t] text <capture> [output]
+//        cable_log pcap <capture> <output.pcap>
+//   -t: start each text line with its time in seconds since the capture began
+//
+// In the text view each line is a byte as sent and as received, in the
+// column of its direction; "--" stands for a byte that was not sent (a
+// spurious one) or not received (deleted, or lost to a full buffer).
+//
+// The pcap link type is LINKTYPE_USER0: each packet starts with one byte
+// giving its direction (0 for Tx->Rx, 1 for Rx->Tx), followed by the bytes
+// received from the first flag (0x7E) to the next one. Bytes outside a
+// frame form a packet of their own. Packets carry the time of their last byte.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+
+#define FALSE 0
+#define TRUE 1
+
+#define FLAG 0x7E
+#define LINKTYPE_USER0 147
+#define MAX_PACKET 65536
+#define RECORDS_PER_READ 4096
+
+// Frame being gathered for one direction
+struct Packet {
+    unsigned char data[MAX_PACKET];   // Direction byte, then the frame
+    int length;
+    uint64_t time;         // Of the last byte (ns since the epoch)
+};
+
+struct Packet packets[2];
+
+
+// Check the capture header.
+// Returns the record size, or -1 if "in" is not a capture
+int read_header(FILE *in, uint64_t *start)
+{
+    unsigned char header[CAPTURE_HEADER_SIZE];
+    if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+        memcmp(header, CAPTURE_MAGIC, 8) != 0)
+    {
+        fprintf(stderr, "Not a cable capture\n");
+        return -1;
+    }
+    if (get_le(header + 8, 4) != CAPTURE_VERSION || get_le(header + 12, 4) < CAPTURE_RECORD_SIZE ||
+        get_le(header + 12, 4) > 256)
+    {
+        fprintf(stderr, "Unsupported capture version %u\n", (unsigned) get_le(header + 8, 4));
+        return -1;
+    }
+    *start = get_le(header + 16, 8);
+    return get_le(header + 12, 4);
+}
+
+
+void print_text(FILE *out, const unsigned char *record, int timed)
+{
+    const char *HEX = "0123456789ABCDEF";
+    int flags = record[8];
+    if (timed)
+        fprintf(out, "%12.6f ", get_le(record, 8) / 1e9);
+
+    if (flags & CAP_EVENT)
+    {
+        if (record[9] == CAP_EVENT_IDLE)
+            fputs("---------------\n", out);
+        else if (record[9] == CAP_EVENT_OFF)
+            fputs("CABLE OFF\n", out);
+        else
+            fprintf(out, "EVENT %d\n", record[9]);
+        return;
+    }
+
+    char text[] = "--  --";
+    if (!(flags & CAP_INSERTED))
+    {
+        text[0] = HEX[record[9] >> 4];
+        text[1] = HEX[record[9] & 15];
+    }
+    if (!(flags & (CAP_DELETED | CAP_OVERFLOW)))
+    {
+        text[4] = HEX[record[10] >> 4];
+        text[5] = HEX[record[10] & 15];
+    }
+    if (flags & CAP_RX2TX)
+        fprintf(out, "       | %s\n", text);
+    else
+        fprintf(out, "%s |       \n", text);
+}
+
+
+void write_pcap_header(FILE *out)
+{
+    // Nanosecond timestamps, written in host byte order as pcap allows
+    uint32_t header[6] = {0xA1B23C4D, 2 | 4 << 16, 0, 0, MAX_PACKET, LINKTYPE_USER0};
+    fwrite(header, sizeof(header), 1, out);
+}
+
+
+// Write the packet of a direction, if it has any bytes, and empty it
+void emit_packet(FILE *out, struct Packet *p)
+{
+    if (p->length <= 1)
+    {
+        p->length = 1;
+        return;
+    }
+    uint32_t header[4] = {p->time / 1000000000, p->time % 1000000000, p->length, p->length};
+    fwrite(header, sizeof(header), 1, out);
+    fwrite(p->data, 1, p->length, out);
+    p->length = 1;
+}
+
+
+// Add a received byte to the frame of its direction
+void add_to_packet(FILE *out, struct Packet *p, unsigned char byte, uint64_t time)
+{
+    if (byte == FLAG && p->length > 1)
+    {
+        if (p->data[1] != FLAG)
+        {
+            emit_packet(out, p);  // Noise between frames
+        }
+        else if (p->length > 2)
+        {
+            // Closing flag, kept with its frame unless the frame filled the packet
+            if (p->length == MAX_PACKET)
+                emit_packet(out, p);
+            p->data[p->length++] = byte;
+            p->time = time;
+            emit_packet(out, p);
+            return;
+        }
+        else
+        {
+            return;  // Repeated opening flag
+        }
+    }
+    if (p->length == MAX_PACKET)
+        emit_packet(out, p);
+    p->data[p->length++] = byte;
+    p->time = time;
+}
+
+
+void add_to_pcap(FILE *out, const unsigned char *record, uint64_t start)
+{
+    int flags = record[8];
+    if (flags & CAP_EVENT)
+    {
+        // The line can go idle inside a frame for a moment; unplugging ends it
+        if (record[9] != CAP_EVENT_OFF)
+            return;
+        emit_packet(out, &packets[0]);
+        emit_packet(out, &packets[1]);
+    }
+    else if (!(flags & (CAP_DELETED | CAP_OVERFLOW)))
+    {
+        add_to_packet(out, &packets[flags & CAP_RX2TX ? 1 : 0], record[10], start + get_le(record, 8));
+    }
+}
+
+
+void usage(const char *program)
+{
+    fprintf(stderr,
+            "Usage: %s [-t] text <capture> [output]\n"
+            "       %s pcap <capture> <output.pcap>\n"
+            "  -t: prefix each text line with its time in seconds\n", program, program);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int timed = FALSE, opt;
+    while ((opt = getopt(argc, argv, "t")) != -1)
+    {
+        if (opt != 't')
+        {
+            usage(argv[0]);
+            return 1;
+        }
+        timed = TRUE;
+    }
+
+    int pcap = optind < argc && strcmp(argv[optind], "pcap") == 0;
+    if (optind + 2 > argc || (!pcap && strcmp(argv[optind], "text") != 0) ||
+        (pcap && optind + 3 != argc) || optind + 3 < argc)
+    {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(argv[optind + 1], "rb");
+    if (in == NULL)
+    {
+        perror(argv[optind + 1]);
+        return 1;
+    }
+    FILE *out = stdout;
+    if (optind + 2 < argc && (out = fopen(argv[optind + 2], "wb")) == NULL)
+    {
+        perror(argv[optind + 2]);
+        return 1;
+    }
+
+    uint64_t start;
+    int recordSize = read_header(in, &start);
+    if (recordSize < 0)
+        return 1;
+
+    if (pcap)
+    {
+        write_pcap_header(out);
+        packets[0].data[0] = 0;
+        packets[1].data[0] = 1;
+        packets[0].length = packets[1].length = 1;
+    }
+    else
+    {
+        fprintf(out, "Tx->Rx | Rx->Tx\n");
+    }
+
+    unsigned char *records = malloc((size_t) recordSize * RECORDS_PER_READ);
+    if (records == NULL)
+    {
+        perror("malloc");
+        return 1;
+    }
+    size_t n;
+    long long count = 0;
+    while ((n = fread(records, recordSize, RECORDS_PER_READ, in)) > 0)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (pcap)
+                add_to_pcap(out, records + i * recordSize, start);
+            else
+                print_text(out, records + i * recordSize, timed);
+        }
+        count += n;
+    }
+    if (pcap)
+    {
+        emit_packet(out, &packets[0]);
+        emit_packet(out, &packets[1]);
+    }
+
+    free(records);
+    fclose(in);
+    if (fclose(out) != 0)
+    {
+        perror("Writing the output");
+        return 1;
+    }
+    if (out != stdout)
+        fprintf(stderr, "%lld records converted\n", count);
+    return 0;
+}
@@ -0,0 +1,49 @@
+// Binary capture log of the virtual cable.
+// "log <file>" in the cable writes one fixed-size record per byte on the
+// line instead of formatting text, so logging can stay on at high baud
+// rates; cable_log turns a capture into the text view or into pcap.
+//
+// Layout, little endian:
+//   header: "CABLECAP", version (4 bytes), record size (4 bytes),
+//           start of the capture (8 bytes, ns since the epoch)
+//   record: time (8 bytes, ns since the start), flags, byte as sent,
+//           byte as received, 1 spare byte
+// Bytes are recorded at the time they reach (or would reach) the far end.
+
+#ifndef _CAPTURE_H_
+#define _CAPTURE_H_
+
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "CABLECAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 24
+#define CAPTURE_RECORD_SIZE 12
+
+// Record flags
+#define CAP_RX2TX 0x01      // Rx->Tx direction (Tx->Rx otherwise)
+#define CAP_CORRUPT 0x02    // Received with bit errors
+#define CAP_INSERTED 0x04   // Spurious byte: nothing was sent
+#define CAP_DELETED 0x08    // Lost on the line: nothing was received
+#define CAP_OVERFLOW 0x10   // Lost to the far end's full buffer
+#define CAP_EVENT 0x80      // Not a byte: "sent" holds a CAP_EVENT_* code
+
+// Events
+#define CAP_EVENT_IDLE 1    // Nothing left on the line in either direction
+#define CAP_EVENT_OFF 2     // Cable unplugged
+
+static inline void put_le(unsigned char *p, uint64_t value, int size)
+{
+    for (int i = 0; i < size; i++)
+        p[i] = value >> (8 * i);
+}
+
+static inline uint64_t get_le(const unsigned char *p, int size)
+{
+    uint64_t value = 0;
+    for (int i = size - 1; i >= 0; i--)
+        value = value << 8 | p[i];
+    return value;
+}
+
+#endif // _CAPTURE_H_
@@ -1,9 +1,781 @@
+#define _GNU_SOURCE
 #include "application_layer.h"
+#include "checkpoint.h"
+#include "compress.h"
+#include "digest.h"
+#include "file_reader.h"
+#include "file_writer.h"
 #include "link_layer.h" 
+#include "link_options.h"
+#include "log.h"
+#include "packet.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-#define BLOCK_SIZE 512 // Size of each data block to send/receive
+#define MAX_BATCH_FILES (1 << 20)
+
+LzStream lzStream;
+unsigned char fileData[LZ_MAX_BLOCK]; // Decompressed block (receiver)
+
+// Files of a batch (a directory): where each is read from or written to,
+// and the name and size announced in the MANIFEST
+BatchFile *batchFiles = NULL;
+FileInfo *batchEntries = NULL;
+int batchCount = 0;
+int batchCapacity = 0;
+int batchRootLength = 0; // Length of the directory sent (transmitter)
+
+// Resumable transfers (APP_RESUME=on)
+int resumeEnabled = FALSE;
+FileInfo checkpoint;           // Receiver: what it offered to resume
+int haveCheckpoint = FALSE;
+int checkpointFile = -1;       // Receiver: checkpoint being kept up to date
+
+// Read APP_COMPRESS: off | lz (default off). Only the transmitter needs it;
+// the receiver follows the codec announced in the START packet.
+// Return 1 to compress, 0 not to, or -1 if the value is invalid.
+static int loadCompression()
+{
+    const char *compress = getenv("APP_COMPRESS");
+    if (compress == NULL || strcmp(compress, "off") == 0)
+        return 0;
+    if (strcmp(compress, "lz") == 0)
+        return 1;
+    logError("ERROR: APP_COMPRESS must be \"off\" or \"lz\"\n");
+    return -1;
+}
+
+// Read APP_DIGEST: off | sha256 | xxh64 (default sha256). Only the transmitter
+// needs it; START tells the receiver which digest END will carry.
+// Return the DIGEST_* algorithm or -1 if the value is invalid.
+static int loadDigest()
+{
+    const char *digest = getenv("APP_DIGEST");
+    if (digest == NULL || strcmp(digest, "sha256") == 0)
+        return DIGEST_SHA256;
+    if (strcmp(digest, "xxh64") == 0)
+        return DIGEST_XXH64;
+    if (strcmp(digest, "off") == 0)
+        return DIGEST_NONE;
+    logError("ERROR: APP_DIGEST must be \"off\", \"sha256\" or \"xxh64\"\n");
+    return -1;
+}
+
+// Read APP_RESUME: off | on (default off), on both ends.
+// Return 1 to resume interrupted transfers, 0 not to, or -1 if the value is invalid.
+static int loadResume()
+{
+    const char *resume = getenv("APP_RESUME");
+    if (resume == NULL || strcmp(resume, "off") == 0)
+        return 0;
+    if (strcmp(resume, "on") == 0)
+        return 1;
+    logError("ERROR: APP_RESUME must be \"off\" or \"on\"\n");
+    return -1;
+}
+
+static double secondsSince(const struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Print the file bytes against the payload bytes that crossed the link, and
+// the resulting effective (file) and wire (payload) throughputs.
+static void printTransferReport(long fileBytes, long linkBytes, int blocks, int compressedBlocks,
+                                double seconds)
+{
+    logInfo("Transfer: %ld file bytes as %ld payload bytes in %d blocks (%d compressed), %.2f s\n",
+            fileBytes, linkBytes, blocks, compressedBlocks, seconds);
+    if (fileBytes > 0 && seconds > 0)
+        logInfo("Throughput: effective %.0f bit/s, wire %.0f bit/s (compression ratio %.2f)\n",
+                fileBytes * 8 / seconds, linkBytes * 8 / seconds, (double)fileBytes / linkBytes);
+}
+
+// Print a digest in hex after "label".
+static void printDigest(const char *label, int algorithm, const unsigned char *digest, int size)
+{
+    char hex[2 * DIGEST_MAX_SIZE + 1];
+    for (int i = 0; i < size; i++)
+        sprintf(hex + 2 * i, "%02x", digest[i]);
+    hex[2 * size] = '\0';
+    logInfo("%s: %s %s\n", label, digestName(algorithm), hex);
+}
+
+////////////////////////////////////////////////
+// TRANSMITTER
+////////////////////////////////////////////////
+
+// Send one DATA packet of "size" bytes already placed after its header.
+// Return 0 on success or -1 on error.
+static int sendData(unsigned char *packet, int control, int sequence, int size)
+{
+    packet[0] = control;
+    packet[1] = sequence & 0xFF;
+    packet[2] = size >> 8;
+    packet[3] = size & 0xFF;
+    if (llwrite(packet, DATA_HEADER_SIZE + size) < 0)
+    {
+        logError("ERROR: Failed to send data\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Add a regular file found under the directory being sent (nftw callback).
+static int addBatchFile(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+    if (type != FTW_F || !S_ISREG(st->st_mode))
+        return 0;
+
+    const char *name = path + batchRootLength;
+    while (*name == '/')
+        name++;
+    if (strlen(name) >= sizeof(batchEntries->name)) {
+        logError("ERROR: Path too long to send: %s\n", name);
+        return -1;
+    }
+    if (batchCount == MAX_BATCH_FILES) {
+        logError("ERROR: More than %d files to send\n", MAX_BATCH_FILES);
+        return -1;
+    }
+
+    if (batchCount == batchCapacity) {
+        int capacity = batchCapacity == 0 ? 64 : 2 * batchCapacity;
+        BatchFile *files = realloc(batchFiles, capacity * sizeof(BatchFile));
+        if (files != NULL)
+            batchFiles = files;
+        FileInfo *entries = realloc(batchEntries, capacity * sizeof(FileInfo));
+        if (entries != NULL)
+            batchEntries = entries;
+        if (files == NULL || entries == NULL) {
+            perror("realloc");
+            return -1;
+        }
+        batchCapacity = capacity;
+    }
+
+    BatchFile *file = &batchFiles[batchCount];
+    FileInfo *entry = &batchEntries[batchCount];
+    file->path = strdup(path);
+    file->size = entry->size = st->st_size;
+    snprintf(entry->name, sizeof(entry->name), "%s", name);
+    batchCount++;
+    return file->path != NULL ? 0 : -1;
+}
+
+static void freeBatch()
+{
+    for (int i = 0; i < batchCount; i++)
+        free((char *)batchFiles[i].path);
+    free(batchFiles);
+    free(batchEntries);
+    batchFiles = NULL;
+    batchEntries = NULL;
+    batchCount = batchCapacity = 0;
+}
+
+// List the regular files under "dirname" (symbolic links are not followed)
+// into batchFiles and batchEntries. Return the total size or -1 on error.
+static long listBatch(const char *dirname)
+{
+    batchRootLength = strlen(dirname);
+    if (nftw(dirname, addBatchFile, 16, FTW_PHYS) != 0) {
+        logError("ERROR: Could not list %s\n", dirname);
+        return -1;
+    }
+    if (batchCount == 0) {
+        logError("ERROR: No files to send in %s\n", dirname);
+        return -1;
+    }
+
+    long total = 0;
+    for (int i = 0; i < batchCount; i++)
+        total += batchFiles[i].size;
+    return total;
+}
+
+// Send the file list of a batch in as few MANIFEST packets as fit.
+// Return 0 on success or -1 on error.
+static int sendManifest(unsigned char *packet)
+{
+    for (int listed = 0, packets = 0; listed < batchCount; packets++) {
+        int used, capacity = llpayloadsize();
+        int size = buildManifestPacket(packet, capacity, batchEntries + listed, batchCount - listed,
+                                       &used);
+        if (llwrite(packet, size) < 0) {
+            logError("ERROR: Failed to send the MANIFEST packet\n");
+            return -1;
+        }
+        logDebug("Sent MANIFEST %d: %d files\n", packets, used);
+        listed += used;
+    }
+    return 0;
+}
+
+// Send the START packet, the MANIFEST of a batch, the bytes of "file" (or of
+// the batch) and the END packet.
+// Return 0 on success or -1 on error.
+static int sendStream(const char *filename, const FileInfo *info, FILE *file, int compress)
+{
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int packetSize = buildControlPacket(packet, CTRL_START, info);
+    if (llwrite(packet, packetSize) < 0) {
+        logError("ERROR: Failed to send the START packet\n");
+        return -1;
+    }
+    if (info->fileCount > 0) {
+        logInfo("Sent START: %s, %d files, %ld bytes\n", info->name, info->fileCount, info->size);
+        if (sendManifest(packet) < 0)
+            return -1;
+    } else if (info->offset > 0) {
+        logInfo("Sent START: %s, %ld bytes, resuming at %ld\n", info->name, info->size, info->offset);
+    } else {
+        logInfo("Sent START: %s, %ld bytes\n", info->name, info->size);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    long fileBytes = 0, linkBytes = 0;
+    int blocks = 0, compressedBlocks = 0, sequence = 0, failed = FALSE;
+    unsigned char *data = packet + DATA_HEADER_SIZE;
+    lzInit(&lzStream);
+    Digest digest;
+    digestInit(&digest, info->digestAlgorithm);
+
+    if ((file != NULL ? startFileReader(file) : startBatchReader(batchFiles, batchCount)) < 0)
+        return -1;
+
+    // Fill each packet with as much input as compresses into it, or send the
+    // input raw when that does not save anything. A packet never spans two
+    // file blocks.
+    FileBlock *block = NULL;
+    int blockPos = 0;
+    while (!failed) {
+        if (block == NULL || blockPos == block->size) {
+            if (block != NULL)
+                releaseFileBlock(block);
+            block = nextFileBlock();
+            blockPos = 0;
+            if (block->size == 0)
+                break;
+            digestUpdate(&digest, block->data, block->size);
+        }
+        const unsigned char *input = block->data + blockPos;
+        int available = block->size - blockPos;
+
+        int capacity = llpayloadsize() - DATA_HEADER_SIZE, consumed, size = -1;
+        if (capacity < 1)
+            capacity = 1;
+        if (compress)
+            size = lzCompressBlock(&lzStream, input, available, data, capacity, &consumed);
+
+        if (size >= 0) {
+            failed = sendData(packet, CTRL_DATA_LZ, sequence, size) < 0;
+            compressedBlocks++;
+        } else {
+            consumed = available < capacity ? available : capacity;
+            size = consumed;
+            memcpy(data, input, consumed);
+            if (compress)
+                lzAppendRaw(&lzStream, input, consumed);
+            failed = sendData(packet, CTRL_DATA, sequence, size) < 0;
+        }
+
+        if (!failed)
+            logDebug("Sent DATA %d: %d bytes (%d file bytes)\n", sequence, size, consumed);
+        blockPos += consumed;
+        fileBytes += consumed;
+        linkBytes += DATA_HEADER_SIZE + size;
+        blocks++;
+        sequence++;
+    }
+
+    if (block->error) {
+        for (int i = 0; i < batchCount; i++) {
+            if (batchFiles[i].failed)
+                filename = batchFiles[i].path;
+        }
+        logError("ERROR: Could not read %s\n", filename);
+        failed = TRUE;
+    }
+    releaseFileBlock(block);
+    int stalls = stopFileReader();
+    if (failed)
+        return -1;
+
+    // END repeats START with the digest of every byte sent
+    FileInfo end = *info;
+    end.digestSize = digestFinal(&digest, end.digest);
+    packetSize = buildControlPacket(packet, CTRL_END, &end);
+    if (llwrite(packet, packetSize) < 0) {
+        logError("ERROR: Failed to send the END packet\n");
+        return -1;
+    }
+    if (info->fileCount > 0)
+        logInfo("Batch transmission finished: %d files\n", info->fileCount);
+    else
+        logInfo("File transmission finished\n");
+    printTransferReport(fileBytes, linkBytes, blocks, compressedBlocks, secondsSince(&start));
+    if (end.digestSize > 0)
+        printDigest("Digest sent", end.digestAlgorithm, end.digest, end.digestSize);
+    logInfo("Reader stalls: %d\n", stalls);
+    return 0;
+}
+
+// Check the resume offer the receiver sent with its UA against the file to
+// send, and set the tail CRC the START packet repeats.
+// Return the offset to resume from, or 0 to send the whole file.
+static long resumeOffset(FILE *file, FileInfo *info)
+{
+    unsigned char data[LL_OPEN_DATA_MAX];
+    FileInfo offer;
+    int size = llopendata(data);
+    if (size == 0 || data[0] != CTRL_RESUME || parseControlPacket(data, size, &offer) < 0 ||
+        offer.offset == 0)
+        return 0;
+
+    uint32_t crc;
+    if (strcmp(offer.name, info->name) != 0 || offer.size != info->size ||
+        offer.mtime != info->mtime || tailChecksum(fileno(file), offer.offset, &crc) < 0 ||
+        crc != offer.tailCrc) {
+        logInfo("The receiver has part of another version of %s - sending all of it\n", offer.name);
+        return 0;
+    }
+    info->tailCrc = crc;
+    return offer.offset;
+}
+
+// Send "filename" as START, DATA... and END packets. A directory is sent
+// as a batch: START, MANIFEST..., then the files back to back as one stream
+// of DATA packets (small files share packets), and END.
+// Return 0 on success or -1 on error.
+static int sendFile(const char *filename, int compress, int digest)
+{
+    struct stat st;
+    if (stat(filename, &st) < 0) {
+        logError("ERROR: Could not open file %s\n", filename);
+        return -1;
+    }
+
+    FileInfo info;
+    memset(&info, 0, sizeof(info));
+    const char *name = strrchr(filename, '/');
+    info.codec = compress;
+    info.digestAlgorithm = digest;
+    snprintf(info.name, sizeof(info.name), "%s", name != NULL ? name + 1 : filename);
+
+    FILE *file = NULL;
+    if (S_ISDIR(st.st_mode)) {
+        info.size = listBatch(filename);
+        info.fileCount = batchCount;
+        if (info.size < 0) {
+            freeBatch();
+            return -1;
+        }
+    } else {
+        file = fopen(filename, "rb");
+        if (!file) {
+            logError("ERROR: Could not open file %s\n", filename);
+            return -1;
+        }
+        info.size = st.st_size;
+        info.mtime = st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+        if (resumeEnabled)
+            info.offset = resumeOffset(file, &info);
+        if (info.offset > 0 && fseeko(file, info.offset, SEEK_SET) < 0) {
+            perror("fseeko");
+            fclose(file);
+            return -1;
+        }
+    }
+
+    int status = sendStream(filename, &info, file, compress);
+    if (file != NULL)
+        fclose(file);
+    freeBatch();
+    return status;
+}
+
+////////////////////////////////////////////////
+// RECEIVER
+////////////////////////////////////////////////
+
+// Load the checkpoint of "filename" and build the resume offer sent back
+// with the UA. Return the offer's size, or 0 if there is nothing to resume.
+static int buildResumeOffer(const char *filename, unsigned char *offer)
+{
+    if (loadCheckpoint(filename, &checkpoint) < 0 || checkpoint.offset == 0)
+        return 0;
+
+    // The bytes before the offset must still be there
+    uint32_t crc;
+    int fd = open(filename, O_RDONLY);
+    int intact = fd >= 0 && tailChecksum(fd, checkpoint.offset, &crc) == 0;
+    if (fd >= 0)
+        close(fd);
+    if (!intact)
+        return 0;
+
+    checkpoint.tailCrc = crc;
+    haveCheckpoint = TRUE;
+    logInfo("Offering to resume %s at %ld of %ld bytes\n", checkpoint.name, checkpoint.offset,
+            checkpoint.size);
+    return buildControlPacket(offer, CTRL_RESUME, &checkpoint);
+}
+
+// Check that a START resuming at info->offset continues what was offered.
+static int matchesCheckpoint(const FileInfo *info)
+{
+    return haveCheckpoint && info->offset == checkpoint.offset && info->size == checkpoint.size &&
+           info->mtime == checkpoint.mtime && info->tailCrc == checkpoint.tailCrc &&
+           info->fileCount == 0 && strcmp(info->name, checkpoint.name) == 0;
+}
+
+// Create "filename" with room for the file in "info" and start writing it
+// at info->offset, keeping a checkpoint if resuming is enabled.
+// Return the file descriptor or -1 on error.
+static int createOutput(const char *filename, const FileInfo *info)
+{
+    // A resumed transfer keeps the bytes already received
+    long size = info->size;
+    int fd = open(filename, O_WRONLY | O_CREAT | (info->offset > 0 ? 0 : O_TRUNC), 0644);
+    if (fd < 0) {
+        logError("ERROR: Could not create file %s\n", filename);
+        return -1;
+    }
+
+    // Reserve the blocks up front; not every file system supports it
+    int error = size > 0 ? posix_fallocate(fd, 0, size) : 0;
+    if (error == ENOSPC || error == EFBIG) {
+        logError("ERROR: Could not allocate %ld bytes: %s\n", size, strerror(error));
+        close(fd);
+        return -1;
+    }
+
+    if (resumeEnabled && info->mtime != 0) {
+        checkpointFile = createCheckpoint(filename, info, info->offset);
+        setWriterCheckpoint(checkpointFile, CHECKPOINT_OFFSET_POSITION);
+    }
+    if (startFileWriter(fd, info->offset) < 0) {
+        // Nothing will be written: drop the checkpoint along with the file
+        if (checkpointFile >= 0) {
+            setWriterCheckpoint(-1, 0);
+            close(checkpointFile);
+            checkpointFile = -1;
+            removeCheckpoint(filename);
+        }
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Append "size" bytes to the file, handing each block to the writer once full.
+// Return 0 on success or -1 if writing the file failed.
+static int storeData(FileBlock **block, const unsigned char *data, int size)
+{
+    while (size > 0) {
+        if (*block == NULL && (*block = nextWriteBlock()) == NULL)
+            return -1;
+
+        int n = FILE_BLOCK_SIZE - (*block)->size;
+        if (n > size)
+            n = size;
+        memcpy((*block)->data + (*block)->size, data, n);
+        (*block)->size += n;
+        data += n;
+        size -= n;
+
+        if ((*block)->size == FILE_BLOCK_SIZE) {
+            queueWriteBlock(*block);
+            *block = NULL;
+        }
+    }
+    return 0;
+}
+
+// A batch file name must stay inside the output directory: relative, with
+// no empty, "." or ".." component.
+static int safeName(const char *name)
+{
+    if (name[0] == '/')
+        return FALSE;
+    for (const char *part = name;;) {
+        const char *slash = strchr(part, '/');
+        int length = slash != NULL ? slash - part : (int)strlen(part);
+        if (length == 0 || (length == 1 && part[0] == '.') ||
+            (length == 2 && part[0] == '.' && part[1] == '.'))
+            return FALSE;
+        if (slash == NULL)
+            return TRUE;
+        part = slash + 1;
+    }
+}
+
+// Create the directory "dirname" for a batch whose MANIFEST is complete and
+// start writing the files into it.
+// Return the directory's descriptor or -1 on error.
+static int createBatchOutput(const char *dirname, long size)
+{
+    long total = 0;
+    for (int i = 0; i < batchCount; i++) {
+        if (!safeName(batchEntries[i].name)) {
+            logError("ERROR: Unsafe file name in MANIFEST: %s\n", batchEntries[i].name);
+            return -1;
+        }
+        batchFiles[i].path = batchEntries[i].name;
+        batchFiles[i].size = batchEntries[i].size;
+        total += batchEntries[i].size;
+    }
+    if (total != size) {
+        logError("ERROR: MANIFEST lists %ld bytes, START announced %ld\n", total, size);
+        return -1;
+    }
+
+    if (mkdir(dirname, 0755) < 0 && errno != EEXIST) {
+        logError("ERROR: Could not create directory %s\n", dirname);
+        return -1;
+    }
+    int dirFd = open(dirname, O_RDONLY | O_DIRECTORY);
+    if (dirFd < 0) {
+        logError("ERROR: Could not open directory %s\n", dirname);
+        return -1;
+    }
+    if (startBatchWriter(dirFd, batchFiles, batchCount) < 0) {
+        close(dirFd);
+        return -1;
+    }
+    return dirFd;
+}
+
+// Print how each file of a batch ended up.
+static void printBatchReport()
+{
+    int failures = 0;
+    for (int i = 0; i < batchCount; i++) {
+        logInfo("  %s: %ld of %ld bytes%s\n", batchEntries[i].name, batchFiles[i].done,
+                batchFiles[i].size, batchFiles[i].failed ? ", FAILED" : "");
+        failures += batchFiles[i].failed;
+    }
+    logInfo("Batch: %d of %d files received\n", batchCount - failures, batchCount);
+}
+
+// Receive START, DATA... and END packets into "filename" (a directory for
+// a batch, whose START is followed by MANIFEST packets).
+// Return 0 if the whole file arrived or -1 otherwise.
+static int receiveFile(const char *filename)
+{
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    FileBlock *block = NULL;
+    FileInfo info, end;
+    int fd = -1, dirFd = -1, readResult, started = FALSE, ended = FALSE, sequence = 0, status = 0;
+    int blocks = 0, compressedBlocks = 0, listed = 0, corrupt = FALSE;
+    long fileBytes = 0, linkBytes = 0;
+    Digest digest;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while ((readResult = llread(packet)) > 0 && status == 0) {
+        if (packet[0] == CTRL_START && !started) {
+            if (parseControlPacket(packet, readResult, &info) < 0) {
+                logError("ERROR: Malformed START packet\n");
+                status = -1;
+                break;
+            }
+            if (info.fileCount > MAX_BATCH_FILES) {
+                logError("ERROR: Batch of %d files is too large\n", info.fileCount);
+                status = -1;
+                break;
+            }
+            if (info.digestAlgorithm > DIGEST_XXH64) {
+                logError("ERROR: Unknown digest %d in START\n", info.digestAlgorithm);
+                status = -1;
+                break;
+            }
+            if (info.fileCount > 0) {
+                logInfo("Received START: %s, %d files, %ld bytes, saving into %s\n", info.name,
+                        info.fileCount, info.size, filename);
+                batchEntries = calloc(info.fileCount, sizeof(FileInfo));
+                batchFiles = calloc(info.fileCount, sizeof(BatchFile));
+                if (batchEntries == NULL || batchFiles == NULL) {
+                    perror("calloc");
+                    status = -1;
+                    break;
+                }
+                batchCount = info.fileCount;
+            } else {
+                if (info.offset > 0 && !matchesCheckpoint(&info)) {
+                    logError("ERROR: START resumes at %ld, which was not offered\n", info.offset);
+                    status = -1;
+                    break;
+                }
+                logInfo("Received START: %s, %ld bytes, saving as %s", info.name, info.size, filename);
+                if (info.offset > 0)
+                    logInfo(" from byte %ld", info.offset);
+                logInfo("\n");
+                fd = createOutput(filename, &info);
+                if (fd < 0) {
+                    status = -1;
+                    break;
+                }
+                fileBytes = info.offset;
+            }
+            lzInit(&lzStream);
+            digestInit(&digest, info.digestAlgorithm);
+            started = TRUE;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            continue;
+        }
+
+        if (packet[0] == CTRL_MANIFEST && started && listed < batchCount) {
+            int n = parseManifestPacket(packet, readResult, batchEntries + listed, batchCount - listed);
+            if (n < 0) {
+                logError("ERROR: Malformed MANIFEST packet\n");
+                status = -1;
+                break;
+            }
+            logDebug("Received MANIFEST: %d files\n", n);
+            listed += n;
+            if (listed == batchCount && (dirFd = createBatchOutput(filename, info.size)) < 0) {
+                status = -1;
+                break;
+            }
+            continue;
+        }
+
+        if (packet[0] == CTRL_END && started) {
+            ended = TRUE;
+            if (parseControlPacket(packet, readResult, &end) < 0 || end.size != info.size ||
+                end.fileCount != info.fileCount || strcmp(end.name, info.name) != 0) {
+                logError("ERROR: END packet does not match START\n");
+                status = -1;
+            } else if (info.digestAlgorithm != DIGEST_NONE && fileBytes == info.size) {
+                // Every byte is in: check it against the transmitter's digest
+                unsigned char received[DIGEST_MAX_SIZE];
+                int size = digestFinal(&digest, received);
+                if (end.digestSize != size || memcmp(end.digest, received, size) != 0) {
+                    logError("ERROR: %s digest mismatch - %s is corrupt\n",
+                             digestName(info.digestAlgorithm), filename);
+                    printDigest("Digest received", info.digestAlgorithm, received, size);
+                    corrupt = TRUE;
+                    status = -1;
+                }
+            }
+            continue;
+        }
+
+        if ((packet[0] != CTRL_DATA && packet[0] != CTRL_DATA_LZ) || (fd < 0 && dirFd < 0) || ended ||
+            readResult < DATA_HEADER_SIZE) {
+            logError("ERROR: Unexpected packet (type %d)\n", packet[0]);
+            status = -1;
+            break;
+        }
+
+        int size = packet[2] << 8 | packet[3];
+        if (packet[1] != (sequence & 0xFF) || size != readResult - DATA_HEADER_SIZE) {
+            logError("ERROR: DATA packet %d out of sequence or truncated\n", packet[1]);
+            status = -1;
+            break;
+        }
+
+        const unsigned char *data = packet + DATA_HEADER_SIZE;
+        if (packet[0] == CTRL_DATA_LZ) {
+            size = lzDecompressBlock(&lzStream, data, size, fileData);
+            data = fileData;
+            compressedBlocks++;
+        } else if (info.codec != 0) {
+            lzAppendRaw(&lzStream, data, size);
+        }
+        if (size < 0 || size > info.size - fileBytes) {
+            logError("ERROR: DATA packet %d does not fit the file\n", sequence);
+            status = -1;
+            break;
+        }
+
+        digestUpdate(&digest, data, size);
+        if (storeData(&block, data, size) < 0) {
+            logError("ERROR: Could not write %s\n", filename);
+            status = -1;
+            break;
+        }
+        logDebug("Received DATA %d: %d bytes\n", sequence, size);
+        fileBytes += size;
+        linkBytes += readResult;
+        blocks++;
+        sequence++;
+    }
+
+    // Check that the transfer is complete before trusting the file
+    if (readResult < 0) {
+        logError("ERROR: Failed to receive data\n");
+        status = -1;
+    } else if (!started || !ended) {
+        logError("ERROR: Link closed before the %s packet\n", started ? "END" : "START");
+        status = -1;
+    } else if (fileBytes != info.size) {
+        logError("ERROR: Received %ld of %ld bytes\n", fileBytes, info.size);
+        status = -1;
+    }
+
+    int stalls = 0;
+    long written = 0;
+    if (fd >= 0 || dirFd >= 0) {
+        if (block != NULL)
+            queueWriteBlock(block);
+        stalls = stopFileWriter(&written);
+        if (stalls < 0 || written != fileBytes) {
+            logError("ERROR: Wrote %ld of %ld bytes to %s\n", written, fileBytes, filename);
+            status = -1;
+        }
+    }
+    if (fd >= 0) {
+        if (status < 0 && ftruncate(fd, written) < 0)
+            perror("ftruncate");
+        if (status == 0 && fdatasync(fd) < 0)
+            perror("fdatasync");
+        close(fd);
+    }
+    if (checkpointFile >= 0) {
+        // A failed transfer keeps its checkpoint to resume from, unless the
+        // bytes it would resume after are known to be wrong
+        close(checkpointFile);
+        checkpointFile = -1;
+        if (status == 0 || corrupt)
+            removeCheckpoint(filename);
+    }
+    if (dirFd >= 0) {
+        // One sync for the whole batch instead of one per file
+        if (status == 0 && syncfs(dirFd) < 0)
+            perror("syncfs");
+        close(dirFd);
+        printBatchReport();
+    }
+    free(batchFiles);
+    free(batchEntries);
+    batchFiles = NULL;
+    batchEntries = NULL;
+    batchCount = 0;
+
+    if (status == 0) {
+        logInfo("%s reception finished\n", info.fileCount > 0 ? "Batch" : "File");
+        printTransferReport(fileBytes - info.offset, linkBytes, blocks, compressedBlocks,
+                            secondsSince(&start));
+        if (info.digestAlgorithm != DIGEST_NONE)
+            printDigest("Digest verified", info.digestAlgorithm, end.digest, end.digestSize);
+        logInfo("Writer stalls: %d\n", stalls);
+    }
+    return status;
+}
 
 void applicationLayer(const char *serialPort, const char *role, int baudRate,
                       int nTries, int timeout, const char *filename)
@@ -16,78 +788,60 @@ void applicationLayer(const char *serialPort, const char *role, int baudRate,
     connectionParameters.nRetransmissions = nTries;
     connectionParameters.timeout = timeout;
     
+    // Console verbosity (error, info, debug or trace)
+    const char *level = getenv("LL_LOG");
+    if (level != NULL && logSetLevel(level) < 0) {
+        logError("ERROR: LL_LOG must be \"error\", \"info\", \"debug\" or \"trace\"\n");
+        return;
+    }
+
     // Define application role: transmitter or receiver
     if (strcmp(role, "tx") == 0) {
         connectionParameters.role = LlTx;
     } else if (strcmp(role, "rx") == 0) {
         connectionParameters.role = LlRx;
     } else {
-        printf("ERROR: Invalid role\n");
+        logError("ERROR: Invalid role\n");
         return;
     }
     
+    int compress = loadCompression();
+    int digest = loadDigest();
+    resumeEnabled = loadResume();
+    if (compress < 0 || digest < 0 || resumeEnabled < 0)
+        return;
+
+    // The receiver offers to resume with its UA
+    LinkOptions options;
+    unsigned char offer[LL_OPEN_DATA_MAX];
+    if (llenvoptions(&options) < 0) {
+        logError("ERROR: Invalid link options\n");
+        return;
+    }
+    if (connectionParameters.role == LlRx && resumeEnabled) {
+        options.openData = offer;
+        options.openDataSize = buildResumeOffer(filename, offer);
+    }
+    if (llsetoptions(&options) < 0) {
+        logError("ERROR: Invalid link options\n");
+        return;
+    }
+
     // Establish connection using link layer
     int result = llopen(connectionParameters);
     if (result < 0) {
-        printf("ERROR: Could not establish connection\n");
+        logError("ERROR: Could not establish connection\n");
         return;
     }
     
-    printf("Connection established successfully\n");
+    logInfo("Connection established successfully\n");
     
-    // --- TRANSMITTER MODE ---
-    if (strcmp(role, "tx") == 0) {
-        FILE *file = fopen(filename, "rb");
-        if (!file) {
-            printf("ERROR: Could not open file %s\n", filename);
-            llclose(connectionParameters);
-            return;
-        }
-
-        unsigned char buffer[BLOCK_SIZE];
-        int bytesRead;
-
-        // Read file and send data blocks through llwrite
-        while ((bytesRead = fread(buffer, 1, BLOCK_SIZE, file)) > 0) {
-            int writeResult = llwrite(buffer, bytesRead);
-            if (writeResult < 0) {
-                printf("ERROR: Failed to send data\n");
-                break;
-            }
-            printf("Sent %d bytes\n", writeResult);
-        }
-
-        fclose(file);
-        printf("File transmission finished\n");
-    
-    // --- RECEIVER MODE ---
-    } else {
-        FILE *file = fopen(filename, "wb");
-        if (!file) {
-            printf("ERROR: Could not create file %s\n", filename);
-            llclose(connectionParameters);
-            return;
-        }
-
-        unsigned char buffer[BLOCK_SIZE];
-        int readResult;
-
-        // Receive data blocks through llread and write to file
-        while ((readResult = llread(buffer)) > 0) {
-            fwrite(buffer, 1, readResult, file);
-            printf("Received %d bytes\n", readResult);
-        }
-
-        // Check if transmission ended successfully
-        if (readResult < 0) {
-            printf("ERROR: Failed to receive data\n");
-        } else {
-            printf("File reception finished\n");
-        }
-
-        fclose(file);
-    }
+    if (connectionParameters.role == LlTx)
+        sendFile(filename, compress, digest);
+    else
+        receiveFile(filename);
     
     // Close link layer connection
     llclose(connectionParameters);
-}
\ No newline at end of file
+    logFlush();
+}
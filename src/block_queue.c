@@ -0,0 +1,36 @@
+// Block queue implementation.
+
+#include "block_queue.h"
+
+#include <stddef.h>
+
+void initBlockQueue(BlockQueue *queue)
+{
+    queue->head = queue->tail = 0;
+    sem_init(&queue->count, 0, 0);
+}
+
+void destroyBlockQueue(BlockQueue *queue)
+{
+    sem_destroy(&queue->count);
+}
+
+void pushBlock(BlockQueue *queue, FileBlock *block)
+{
+    queue->slots[queue->tail++ % FILE_POOL_BLOCKS] = block;
+    sem_post(&queue->count);
+}
+
+FileBlock *popBlock(BlockQueue *queue)
+{
+    while (sem_wait(&queue->count) < 0)
+        ; // EINTR
+    return queue->slots[queue->head++ % FILE_POOL_BLOCKS];
+}
+
+FileBlock *tryPopBlock(BlockQueue *queue)
+{
+    if (sem_trywait(&queue->count) < 0)
+        return NULL;
+    return queue->slots[queue->head++ % FILE_POOL_BLOCKS];
+}
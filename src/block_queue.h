@@ -0,0 +1,55 @@
+// Block queue header.
+// Fixed-size file blocks passed between the link thread and a disk thread
+// through single-producer single-consumer rings. Blocks come from a pool
+// owned by the caller and are never allocated or freed while in use.
+
+#ifndef _BLOCK_QUEUE_H_
+#define _BLOCK_QUEUE_H_
+
+#include <semaphore.h>
+
+#define FILE_BLOCK_SIZE (64 * 1024)
+#define FILE_POOL_BLOCKS 8
+
+typedef struct
+{
+    unsigned char data[FILE_BLOCK_SIZE];
+    int size;  // Bytes in data
+    int error; // TRUE if the disk thread could not fill the block
+} FileBlock;
+
+// One file of a batch. A batch is read or written as a single stream of
+// blocks holding its files back to back, so small files share blocks.
+typedef struct
+{
+    const char *path;
+    long size;
+    long done;  // Bytes read or written so far
+    int failed; // TRUE if the file could not be read or written
+} BatchFile;
+
+// Each index is only touched by one side, so neither needs a lock. The
+// semaphore counts the blocks in the ring: its post/wait order the slot
+// accesses, and an empty queue sleeps instead of spinning. While blocks are
+// available a semaphore operation is a userspace atomic, not a system call.
+typedef struct
+{
+    FileBlock *slots[FILE_POOL_BLOCKS];
+    unsigned int head; // Next slot to pop (consumer only)
+    unsigned int tail; // Next slot to push (producer only)
+    sem_t count;
+} BlockQueue;
+
+void initBlockQueue(BlockQueue *queue);
+void destroyBlockQueue(BlockQueue *queue);
+
+// Every block is in at most one queue, so a queue can never overflow.
+void pushBlock(BlockQueue *queue, FileBlock *block);
+
+// Wait for the next block.
+FileBlock *popBlock(BlockQueue *queue);
+
+// Return the next block, or NULL instead of waiting if the queue is empty.
+FileBlock *tryPopBlock(BlockQueue *queue);
+
+#endif // _BLOCK_QUEUE_H_
@@ -0,0 +1,86 @@
+// Transfer checkpoint implementation.
+
+#include "checkpoint.h"
+#include "crc.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC "RCOMCKP1"
+#define CHECKPOINT_HEADER_SIZE 16
+#define MAX_CHECKPOINT_SIZE (CHECKPOINT_HEADER_SIZE + 512)
+
+static void checkpointName(const char *output, char *name, size_t size)
+{
+    snprintf(name, size, "%s.resume", output);
+}
+
+int createCheckpoint(const char *output, const FileInfo *info, long offset)
+{
+    unsigned char record[MAX_CHECKPOINT_SIZE];
+    memcpy(record, CHECKPOINT_MAGIC, 8);
+    for (int i = 0; i < 8; i++)
+        record[CHECKPOINT_OFFSET_POSITION + i] = ((uint64_t)offset >> (8 * (7 - i))) & 0xFF;
+
+    FileInfo source = *info;
+    source.offset = 0;
+    int size = CHECKPOINT_HEADER_SIZE + buildControlPacket(record + CHECKPOINT_HEADER_SIZE, CTRL_START, &source);
+
+    char name[4096];
+    checkpointName(output, name, sizeof(name));
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+    {
+        perror(name);
+        return -1;
+    }
+    if (write(fd, record, size) != size)
+    {
+        perror(name);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int loadCheckpoint(const char *output, FileInfo *info)
+{
+    char name[4096];
+    checkpointName(output, name, sizeof(name));
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return -1;
+
+    unsigned char record[MAX_CHECKPOINT_SIZE];
+    int size = read(fd, record, sizeof(record));
+    close(fd);
+    if (size <= CHECKPOINT_HEADER_SIZE || memcmp(record, CHECKPOINT_MAGIC, 8) != 0 ||
+        parseControlPacket(record + CHECKPOINT_HEADER_SIZE, size - CHECKPOINT_HEADER_SIZE, info) < 0)
+        return -1;
+
+    uint64_t offset = 0;
+    for (int i = 0; i < 8; i++)
+        offset = offset << 8 | record[CHECKPOINT_OFFSET_POSITION + i];
+    info->offset = offset;
+    return (long)offset >= 0 && info->offset <= info->size ? 0 : -1;
+}
+
+void removeCheckpoint(const char *output)
+{
+    char name[4096];
+    checkpointName(output, name, sizeof(name));
+    unlink(name);
+}
+
+int tailChecksum(int fd, long offset, uint32_t *crc)
+{
+    unsigned char tail[TAIL_CHECK_SIZE];
+    int size = offset < TAIL_CHECK_SIZE ? offset : TAIL_CHECK_SIZE;
+    if (pread(fd, tail, size, offset - size) != size)
+        return -1;
+    *crc = crc32Final(crc32Update(CRC32_INIT, tail, size));
+    return 0;
+}
@@ -0,0 +1,37 @@
+// Transfer checkpoint header.
+// A receiver that may resume keeps "<output>.resume" next to the file it
+// writes: the source file as announced by START, and how many bytes of the
+// output are known to be on disk. On the next run it offers these to the
+// transmitter, which resumes from there if its file is still the same.
+//
+// Layout: "RCOMCKP1", the offset (8 bytes, big endian), then the START
+// packet that described the source.
+
+#ifndef _CHECKPOINT_H_
+#define _CHECKPOINT_H_
+
+#include "packet.h"
+
+#include <stdint.h>
+
+#define CHECKPOINT_OFFSET_POSITION 8 // Where the offset is rewritten as data lands
+#define TAIL_CHECK_SIZE 4096         // Bytes before the offset compared by both ends
+
+// Create (or replace) the checkpoint of "output" for the file "info" at
+// "offset" bytes.
+// Return its descriptor, for updating the offset, or -1 on error.
+int createCheckpoint(const char *output, const FileInfo *info, long offset);
+
+// Load the checkpoint of "output" into "info", with its offset in
+// info->offset.
+// Return 0 on success or -1 if there is none or it cannot be used.
+int loadCheckpoint(const char *output, FileInfo *info);
+
+// Delete the checkpoint of "output" once the file is complete.
+void removeCheckpoint(const char *output);
+
+// CRC-32 of the (up to) TAIL_CHECK_SIZE bytes of "fd" just before "offset".
+// Return 0 on success or -1 on error.
+int tailChecksum(int fd, long offset, uint32_t *crc);
+
+#endif // _CHECKPOINT_H_
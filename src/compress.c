@@ -0,0 +1,209 @@
+// Streaming compression implementation.
+// Greedy LZ77: a hash of the next 4 bytes gives the last position where they
+// were seen; a candidate is verified before use, so stale entries are
+// harmless. Input is compressed in chunks small enough that the output can
+// never overflow the block, which lets a block fill up to its capacity.
+
+#include "compress.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define MIN_MATCH 4
+#define CHUNK_SIZE 256 // Output of a chunk is at most CHUNK_SIZE + 3 bytes
+
+void lzInit(LzStream *stream)
+{
+    stream->length = 0;
+    stream->base = 0;
+    for (int i = 0; i < (1 << LZ_HASH_BITS); i++)
+        stream->hash[i] = -1;
+}
+
+static unsigned int hash4(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Make room for "size" more bytes, keeping the last LZ_WINDOW of history.
+static void makeRoom(LzStream *stream, int size)
+{
+    if (stream->length + size <= (int)sizeof(stream->history))
+        return;
+
+    int drop = stream->length - LZ_WINDOW;
+    memmove(stream->history, stream->history + drop, LZ_WINDOW);
+    stream->base += drop;
+    stream->length = LZ_WINDOW;
+}
+
+static int putLength(unsigned char *out, int value)
+{
+    int n = 0;
+    for (; value >= 255; value -= 255)
+        out[n++] = 255;
+    out[n++] = value;
+    return n;
+}
+
+// Read a length extension. Return 0 on success or -1 past the end of input.
+static int readLength(const unsigned char *in, int size, int *index, int *value)
+{
+    unsigned char byte;
+    do
+    {
+        if (*index >= size)
+            return -1;
+        byte = in[(*index)++];
+        *value += byte;
+    } while (byte == 255);
+    return 0;
+}
+
+// Write one token: "literalCount" literals, then a match (0 length for none).
+static int emitSequence(unsigned char *out, const unsigned char *literals, int literalCount,
+                        int offset, int matchLength)
+{
+    int n = 0;
+    int literalCode = literalCount < 15 ? literalCount : 15;
+    int matchCode = matchLength == 0 ? 0 : matchLength - 3 < 15 ? matchLength - 3 : 15;
+
+    out[n++] = literalCode << 4 | matchCode;
+    if (literalCode == 15)
+        n += putLength(out + n, literalCount - 15);
+    memcpy(out + n, literals, literalCount);
+    n += literalCount;
+
+    if (matchLength > 0)
+    {
+        out[n++] = offset & 0xFF;
+        out[n++] = offset >> 8;
+        if (matchCode == 15)
+            n += putLength(out + n, matchLength - 18);
+    }
+    return n;
+}
+
+// Compress history[start, end) into "out". Return the compressed size.
+static int compressRange(LzStream *stream, int start, int end, unsigned char *out)
+{
+    const unsigned char *h = stream->history;
+    int n = 0, i = start, literals = start;
+
+    while (i + MIN_MATCH <= end)
+    {
+        unsigned int key = hash4(h + i);
+        long position = stream->base + i;
+        long candidate = stream->hash[key];
+        stream->hash[key] = position;
+
+        if (candidate < stream->base || candidate >= position || position - candidate >= LZ_WINDOW ||
+            memcmp(h + i, h + (candidate - stream->base), MIN_MATCH) != 0)
+        {
+            i++;
+            continue;
+        }
+
+        int from = candidate - stream->base, length = MIN_MATCH;
+        while (i + length < end && h[from + length] == h[i + length])
+            length++;
+        n += emitSequence(out + n, h + literals, i - literals, position - candidate, length);
+
+        // Index the positions covered by the match too
+        for (int k = i + 1; k < i + length && k + MIN_MATCH <= end; k++)
+            stream->hash[hash4(h + k)] = stream->base + k;
+        i += length;
+        literals = i;
+    }
+
+    if (literals < end)
+        n += emitSequence(out + n, h + literals, end - literals, 0, 0);
+    return n;
+}
+
+int lzCompressBlock(LzStream *stream, const unsigned char *in, int inSize,
+                    unsigned char *out, int capacity, int *consumed)
+{
+    if (inSize > LZ_MAX_BLOCK)
+        inSize = LZ_MAX_BLOCK;
+    makeRoom(stream, inSize);
+
+    int mark = stream->length, n = 0, used = 0;
+    while (used < inSize)
+    {
+        int chunk = capacity - n - 3;
+        if (chunk > CHUNK_SIZE)
+            chunk = CHUNK_SIZE;
+        if (chunk > inSize - used)
+            chunk = inSize - used;
+        if (chunk <= 0)
+            break;
+
+        memcpy(stream->history + stream->length, in + used, chunk);
+        stream->length += chunk;
+        n += compressRange(stream, stream->length - chunk, stream->length, out + n);
+        used += chunk;
+    }
+
+    // Not worth it: forget the input, the caller sends it raw
+    if (n >= used)
+    {
+        stream->length = mark;
+        return -1;
+    }
+    *consumed = used;
+    return n;
+}
+
+void lzAppendRaw(LzStream *stream, const unsigned char *data, int size)
+{
+    makeRoom(stream, size);
+    memcpy(stream->history + stream->length, data, size);
+    stream->length += size;
+}
+
+int lzDecompressBlock(LzStream *stream, const unsigned char *in, int size, unsigned char *out)
+{
+    makeRoom(stream, LZ_MAX_BLOCK);
+
+    unsigned char *h = stream->history;
+    int start = stream->length, limit = start + LZ_MAX_BLOCK;
+    int pos = start, i = 0;
+
+    while (i < size)
+    {
+        int token = in[i++];
+        int literals = token >> 4, match = token & 0x0F;
+
+        if (literals == 15 && readLength(in, size, &i, &literals) < 0)
+            return -1;
+        if (literals > size - i || literals > limit - pos)
+            return -1;
+        memcpy(h + pos, in + i, literals);
+        pos += literals;
+        i += literals;
+
+        if (match == 0)
+            continue;
+
+        if (size - i < 2)
+            return -1;
+        int offset = in[i] | in[i + 1] << 8;
+        int length = match + 3;
+        i += 2;
+        if (match == 15 && readLength(in, size, &i, &length) < 0)
+            return -1;
+        if (offset == 0 || offset > pos || offset >= LZ_WINDOW || length > limit - pos)
+            return -1;
+
+        // Byte by byte: the source may overlap the bytes being written
+        for (int k = 0; k < length; k++, pos++)
+            h[pos] = h[pos - offset];
+    }
+
+    stream->length = pos;
+    memcpy(out, h + start, pos - start);
+    return pos - start;
+}
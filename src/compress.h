@@ -0,0 +1,44 @@
+// Streaming compression header.
+// LZ77 with a bounded window shared across blocks: a block may copy from
+// any of the last LZ_WINDOW bytes of the stream, whether they were sent
+// compressed or raw, so both ends must see the same blocks in order.
+//
+// A compressed block is a sequence of tokens. Each token holds a literal
+// count (high nibble) and a match code (low nibble, 0 for no match, else
+// length - 3); a nibble of 15 is extended by bytes that are added until one
+// is below 255. The literals follow, then, for a match, a 2-byte offset
+// (LSB first) and the match length extension.
+
+#ifndef _COMPRESS_H_
+#define _COMPRESS_H_
+
+#define LZ_WINDOW (32 * 1024)   // Farthest a match may reach back
+#define LZ_MAX_BLOCK (16 * 1024) // Most input bytes carried by one block
+#define LZ_HASH_BITS 13
+
+typedef struct
+{
+    unsigned char history[2 * LZ_WINDOW + LZ_MAX_BLOCK];
+    int length;                   // Bytes of stream kept in history
+    long base;                    // Stream position of history[0]
+    long hash[1 << LZ_HASH_BITS]; // Last stream position of each 4-byte hash
+} LzStream;
+
+// Start a new stream (one per direction).
+void lzInit(LzStream *stream);
+
+// Compress as much of "in" (up to "inSize" bytes) as fits in "capacity"
+// bytes of "out", setting "consumed" to the input used.
+// Return the compressed size, or -1 if that would not be smaller than the
+// input; the stream is then left unchanged and the caller sends raw data.
+int lzCompressBlock(LzStream *stream, const unsigned char *in, int inSize,
+                    unsigned char *out, int capacity, int *consumed);
+
+// Record a block sent uncompressed (both ends), so later matches can use it.
+void lzAppendRaw(LzStream *stream, const unsigned char *data, int size);
+
+// Decompress a block into "out" (at least LZ_MAX_BLOCK bytes).
+// Return the decompressed size or -1 if the block is malformed.
+int lzDecompressBlock(LzStream *stream, const unsigned char *in, int size, unsigned char *out);
+
+#endif // _COMPRESS_H_
@@ -0,0 +1,101 @@
+// Frame check sequence implementation.
+// Table k holds the CRC of a byte followed by k zero bytes, so eight input
+// bytes are folded into the register with eight independent lookups.
+
+#include "crc.h"
+
+#include <string.h>
+
+#define CRC16_POLY 0x8408     // 0x1021 reflected
+#define CRC32_POLY 0xEDB88320 // 0x04C11DB7 reflected
+
+uint16_t crc16Table[8][256];
+uint32_t crc32Table[8][256];
+int crcTablesReady = 0;
+
+static void buildTables()
+{
+    for (int i = 0; i < 256; i++)
+    {
+        uint16_t c16 = i;
+        uint32_t c32 = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            c16 = (c16 & 1) ? (c16 >> 1) ^ CRC16_POLY : c16 >> 1;
+            c32 = (c32 & 1) ? (c32 >> 1) ^ CRC32_POLY : c32 >> 1;
+        }
+        crc16Table[0][i] = c16;
+        crc32Table[0][i] = c32;
+    }
+
+    for (int k = 1; k < 8; k++)
+    {
+        for (int i = 0; i < 256; i++)
+        {
+            uint16_t c16 = crc16Table[k - 1][i];
+            uint32_t c32 = crc32Table[k - 1][i];
+            crc16Table[k][i] = (c16 >> 8) ^ crc16Table[0][c16 & 0xFF];
+            crc32Table[k][i] = (c32 >> 8) ^ crc32Table[0][c32 & 0xFF];
+        }
+    }
+    crcTablesReady = 1;
+}
+
+uint16_t crc16UpdateBytewise(uint16_t crc, const unsigned char *buf, size_t len)
+{
+    if (!crcTablesReady)
+        buildTables();
+
+    for (size_t i = 0; i < len; i++)
+        crc = (crc >> 8) ^ crc16Table[0][(crc ^ buf[i]) & 0xFF];
+    return crc;
+}
+
+uint32_t crc32UpdateBytewise(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    if (!crcTablesReady)
+        buildTables();
+
+    for (size_t i = 0; i < len; i++)
+        crc = (crc >> 8) ^ crc32Table[0][(crc ^ buf[i]) & 0xFF];
+    return crc;
+}
+
+uint16_t crc16Update(uint16_t crc, const unsigned char *buf, size_t len)
+{
+    if (!crcTablesReady)
+        buildTables();
+
+    while (len >= 8)
+    {
+        uint32_t x = crc ^ (buf[0] | (buf[1] << 8));
+        crc = crc16Table[7][x & 0xFF] ^ crc16Table[6][x >> 8] ^
+              crc16Table[5][buf[2]] ^ crc16Table[4][buf[3]] ^
+              crc16Table[3][buf[4]] ^ crc16Table[2][buf[5]] ^
+              crc16Table[1][buf[6]] ^ crc16Table[0][buf[7]];
+        buf += 8;
+        len -= 8;
+    }
+    return crc16UpdateBytewise(crc, buf, len);
+}
+
+uint32_t crc32Update(uint32_t crc, const unsigned char *buf, size_t len)
+{
+    if (!crcTablesReady)
+        buildTables();
+
+    while (len >= 8)
+    {
+        uint32_t lo, hi;
+        memcpy(&lo, buf, 4); // Assumes a little-endian host
+        memcpy(&hi, buf + 4, 4);
+        lo ^= crc;
+        crc = crc32Table[7][lo & 0xFF] ^ crc32Table[6][(lo >> 8) & 0xFF] ^
+              crc32Table[5][(lo >> 16) & 0xFF] ^ crc32Table[4][lo >> 24] ^
+              crc32Table[3][hi & 0xFF] ^ crc32Table[2][(hi >> 8) & 0xFF] ^
+              crc32Table[1][(hi >> 16) & 0xFF] ^ crc32Table[0][hi >> 24];
+        buf += 8;
+        len -= 8;
+    }
+    return crc32UpdateBytewise(crc, buf, len);
+}
@@ -0,0 +1,26 @@
+// Frame check sequence header.
+// HDLC FCS-16 (CRC-16-CCITT, X.25 variant) and FCS-32 (CRC-32), both
+// reflected, computed eight bytes per step with slicing-by-8 tables.
+
+#ifndef _CRC_H_
+#define _CRC_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CRC16_INIT 0xFFFF
+#define CRC32_INIT 0xFFFFFFFF
+
+// Continue a CRC over "len" more bytes. Start from CRC16_INIT / CRC32_INIT,
+// and finish with crc16Final / crc32Final.
+uint16_t crc16Update(uint16_t crc, const unsigned char *buf, size_t len);
+uint32_t crc32Update(uint32_t crc, const unsigned char *buf, size_t len);
+
+// Reference byte-at-a-time versions (Sarwate), same results.
+uint16_t crc16UpdateBytewise(uint16_t crc, const unsigned char *buf, size_t len);
+uint32_t crc32UpdateBytewise(uint32_t crc, const unsigned char *buf, size_t len);
+
+#define crc16Final(crc) ((uint16_t)~(crc))
+#define crc32Final(crc) ((uint32_t)~(crc))
+
+#endif // _CRC_H_
@@ -0,0 +1,248 @@
+// File digest implementation.
+// Both algorithms consume fixed-size blocks (64 bytes for SHA-256, 32-byte
+// stripes for XXH64); whatever is left of an update waits in the buffer.
+
+#include "digest.h"
+
+#include <string.h>
+
+#define XXH_P1 0x9E3779B185EBCA87ULL
+#define XXH_P2 0xC2B2AE3D27D4EB4FULL
+#define XXH_P3 0x165667B19E3779F9ULL
+#define XXH_P4 0x85EBCA77C2B2AE63ULL
+#define XXH_P5 0x27D4EB2F165667C5ULL
+#define XXH_STRIPE 32
+
+static const uint32_t SHA_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+static uint32_t rotr32(uint32_t x, int n)
+{
+    return x >> n | x << (32 - n);
+}
+
+static uint64_t rotl64(uint64_t x, int n)
+{
+    return x << n | x >> (64 - n);
+}
+
+static uint64_t read64le(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--)
+        v = v << 8 | p[i];
+    return v;
+}
+
+static uint32_t read32le(const unsigned char *p)
+{
+    return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+////////////////////////////////////////////////
+// SHA-256
+////////////////////////////////////////////////
+
+static void shaBlock(uint32_t *state, const unsigned char *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 |
+               (uint32_t)block[4 * i + 2] << 8 | block[4 * i + 3];
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) +
+                      SHA_K[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static int shaFinal(Digest *digest, unsigned char *out)
+{
+    // Padding: 0x80, zeros, then the length in bits (8 bytes, big endian)
+    int used = digest->length % 64;
+    uint64_t bits = digest->length * 8;
+    digest->buffer[used++] = 0x80;
+    if (used > 56)
+    {
+        memset(digest->buffer + used, 0, 64 - used);
+        shaBlock(digest->sha, digest->buffer);
+        used = 0;
+    }
+    memset(digest->buffer + used, 0, 56 - used);
+    for (int i = 0; i < 8; i++)
+        digest->buffer[56 + i] = bits >> (56 - 8 * i);
+    shaBlock(digest->sha, digest->buffer);
+
+    for (int i = 0; i < 32; i++)
+        out[i] = digest->sha[i / 4] >> (24 - 8 * (i % 4));
+    return 32;
+}
+
+////////////////////////////////////////////////
+// XXH64
+////////////////////////////////////////////////
+
+static uint64_t xxhRound(uint64_t acc, uint64_t input)
+{
+    acc += input * XXH_P2;
+    return rotl64(acc, 31) * XXH_P1;
+}
+
+static uint64_t xxhMerge(uint64_t acc, uint64_t value)
+{
+    acc ^= xxhRound(0, value);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static void xxhStripe(uint64_t *acc, const unsigned char *stripe)
+{
+    for (int i = 0; i < 4; i++)
+        acc[i] = xxhRound(acc[i], read64le(stripe + 8 * i));
+}
+
+static int xxhFinal(Digest *digest, unsigned char *out)
+{
+    uint64_t *v = digest->xxh;
+    uint64_t h;
+    if (digest->length >= XXH_STRIPE)
+    {
+        h = rotl64(v[0], 1) + rotl64(v[1], 7) + rotl64(v[2], 12) + rotl64(v[3], 18);
+        for (int i = 0; i < 4; i++)
+            h = xxhMerge(h, v[i]);
+    }
+    else
+        h = XXH_P5; // Seed 0
+    h += digest->length;
+
+    // The last (length % 32) bytes: 8, then 4, then 1 at a time
+    const unsigned char *p = digest->buffer;
+    int left = digest->length % XXH_STRIPE;
+    for (; left >= 8; p += 8, left -= 8)
+        h = rotl64(h ^ xxhRound(0, read64le(p)), 27) * XXH_P1 + XXH_P4;
+    if (left >= 4)
+    {
+        h = rotl64(h ^ read32le(p) * XXH_P1, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+        left -= 4;
+    }
+    for (; left > 0; p++, left--)
+        h = rotl64(h ^ *p * XXH_P5, 11) * XXH_P1;
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+
+    // Canonical form: big endian
+    for (int i = 0; i < 8; i++)
+        out[i] = h >> (56 - 8 * i);
+    return 8;
+}
+
+////////////////////////////////////////////////
+// API
+////////////////////////////////////////////////
+
+void digestInit(Digest *digest, int algorithm)
+{
+    static const uint32_t SHA_INIT[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                         0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    digest->algorithm = algorithm;
+    digest->length = 0;
+    memcpy(digest->sha, SHA_INIT, sizeof(SHA_INIT));
+    digest->xxh[0] = XXH_P1 + XXH_P2;
+    digest->xxh[1] = XXH_P2;
+    digest->xxh[2] = 0;
+    digest->xxh[3] = -XXH_P1;
+}
+
+void digestUpdate(Digest *digest, const unsigned char *data, size_t size)
+{
+    if (digest->algorithm == DIGEST_NONE)
+        return;
+
+    int blockSize = digest->algorithm == DIGEST_SHA256 ? 64 : XXH_STRIPE;
+    int used = digest->length % blockSize;
+    digest->length += size;
+
+    // Complete the buffered block first
+    if (used > 0)
+    {
+        size_t n = blockSize - used;
+        if (n > size)
+        {
+            memcpy(digest->buffer + used, data, size);
+            return;
+        }
+        memcpy(digest->buffer + used, data, n);
+        data += n;
+        size -= n;
+        if (digest->algorithm == DIGEST_SHA256)
+            shaBlock(digest->sha, digest->buffer);
+        else
+            xxhStripe(digest->xxh, digest->buffer);
+    }
+
+    // Whole blocks straight from the input
+    for (; size >= (size_t)blockSize; data += blockSize, size -= blockSize)
+    {
+        if (digest->algorithm == DIGEST_SHA256)
+            shaBlock(digest->sha, data);
+        else
+            xxhStripe(digest->xxh, data);
+    }
+    memcpy(digest->buffer, data, size);
+}
+
+int digestFinal(Digest *digest, unsigned char *out)
+{
+    if (digest->algorithm == DIGEST_SHA256)
+        return shaFinal(digest, out);
+    if (digest->algorithm == DIGEST_XXH64)
+        return xxhFinal(digest, out);
+    return 0;
+}
+
+const char *digestName(int algorithm)
+{
+    if (algorithm == DIGEST_SHA256)
+        return "SHA-256";
+    if (algorithm == DIGEST_XXH64)
+        return "XXH64";
+    return "none";
+}
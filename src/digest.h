@@ -0,0 +1,41 @@
+// File digest header.
+// Streaming digests of the file bytes, updated as blocks go by so the
+// transmitter and the receiver never read the file a second time:
+// SHA-256 (FIPS 180-4) for a cryptographic check, or XXH64 when speed
+// matters more than resistance to deliberate tampering.
+
+#ifndef _DIGEST_H_
+#define _DIGEST_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_NONE 0
+#define DIGEST_SHA256 1
+#define DIGEST_XXH64 2
+
+#define DIGEST_MAX_SIZE 32
+
+typedef struct
+{
+    int algorithm;
+    uint64_t length;          // Bytes digested so far
+    unsigned char buffer[64]; // Input not yet processed (length % block size bytes)
+    uint32_t sha[8];
+    uint64_t xxh[4];
+} Digest;
+
+// Start a digest with one of the DIGEST_* algorithms.
+void digestInit(Digest *digest, int algorithm);
+
+// Add "size" more bytes. Does nothing for DIGEST_NONE.
+void digestUpdate(Digest *digest, const unsigned char *data, size_t size);
+
+// Write the digest to "out" (DIGEST_MAX_SIZE bytes of room).
+// Return its size: 32 for SHA-256, 8 for XXH64, 0 for none.
+int digestFinal(Digest *digest, unsigned char *out);
+
+// Name of an algorithm, for messages.
+const char *digestName(int algorithm);
+
+#endif // _DIGEST_H_
@@ -0,0 +1,243 @@
+// Forward error correction implementation.
+// Systematic Reed-Solomon over GF(2^8) with the primitive polynomial 0x11D,
+// generator roots alpha^0 .. alpha^(parity-1). Decoding uses Berlekamp-Massey
+// for the error locator, a Chien search for the positions and Forney's
+// formula for the values.
+
+#include "fec.h"
+
+#include <string.h>
+
+#define GF_POLY 0x11D
+
+unsigned char gfExp[2 * FEC_CODEWORD_SIZE];
+unsigned char gfLog[256];
+unsigned char generator[FEC_MAX_PARITY + 1][FEC_MAX_PARITY + 1]; // Lowest degree first
+int gfTablesReady = 0;
+
+static void buildTables()
+{
+    int x = 1;
+    for (int i = 0; i < FEC_CODEWORD_SIZE; i++)
+    {
+        gfExp[i] = gfExp[i + FEC_CODEWORD_SIZE] = x;
+        gfLog[x] = i;
+        x <<= 1;
+        if (x & 0x100)
+            x ^= GF_POLY;
+    }
+    gfTablesReady = 1;
+}
+
+static unsigned char gfMul(unsigned char a, unsigned char b)
+{
+    return a && b ? gfExp[gfLog[a] + gfLog[b]] : 0;
+}
+
+static unsigned char gfDiv(unsigned char a, unsigned char b)
+{
+    return a ? gfExp[gfLog[a] + FEC_CODEWORD_SIZE - gfLog[b]] : 0;
+}
+
+// Generator polynomial (x + alpha^0)(x + alpha^1)...(x + alpha^(parity-1)),
+// built on first use.
+static const unsigned char *generatorPoly(int parity)
+{
+    unsigned char *g = generator[parity];
+    if (g[parity] == 1)
+        return g;
+
+    memset(g, 0, FEC_MAX_PARITY + 1);
+    g[0] = 1;
+    for (int i = 0; i < parity; i++)
+    {
+        for (int j = i + 1; j > 0; j--)
+            g[j] = g[j - 1] ^ gfMul(g[j], gfExp[i]);
+        g[0] = gfMul(g[0], gfExp[i]);
+    }
+    return g;
+}
+
+// Number of interleaved codewords needed for "len" message bytes.
+static size_t codewordCount(size_t len, int parity)
+{
+    size_t data = FEC_CODEWORD_SIZE - parity;
+    return (len + data - 1) / data;
+}
+
+size_t fecEncodedSize(size_t len, int parity)
+{
+    return len + codewordCount(len, parity) * parity;
+}
+
+size_t fecEncode(const unsigned char *src, size_t len, int parity, unsigned char *dst)
+{
+    if (!gfTablesReady)
+        buildTables();
+
+    memmove(dst, src, len);
+    if (parity == 0)
+        return len;
+
+    const unsigned char *g = generatorPoly(parity);
+    size_t count = codewordCount(len, parity);
+
+    for (size_t cw = 0; cw < count; cw++)
+    {
+        // Remainder of message(x) * x^parity / g(x), highest degree in rem[parity - 1]
+        unsigned char rem[FEC_MAX_PARITY] = {0};
+        for (size_t i = cw; i < len; i += count)
+        {
+            unsigned char feedback = src[i] ^ rem[parity - 1];
+            for (int j = parity - 1; j > 0; j--)
+                rem[j] = rem[j - 1] ^ gfMul(feedback, g[j]);
+            rem[0] = gfMul(feedback, g[0]);
+        }
+
+        unsigned char *out = dst + len + cw * parity;
+        for (int j = 0; j < parity; j++)
+            out[j] = rem[parity - 1 - j];
+    }
+    return len + count * parity;
+}
+
+// Correct one codeword of "n" bytes (highest degree first) in place.
+// Return the number of corrected bytes or -1 if it is uncorrectable.
+static int decodeCodeword(unsigned char *cw, int n, int parity)
+{
+    unsigned char syndromes[FEC_MAX_PARITY];
+    int clean = 1;
+    for (int i = 0; i < parity; i++)
+    {
+        unsigned char s = 0;
+        for (int j = 0; j < n; j++)
+            s = gfMul(s, gfExp[i]) ^ cw[j];
+        syndromes[i] = s;
+        clean &= s == 0;
+    }
+    if (clean)
+        return 0;
+
+    // Berlekamp-Massey: error locator lambda(x), lowest degree first
+    unsigned char lambda[FEC_MAX_PARITY + 1] = {1}, prev[FEC_MAX_PARITY + 1] = {1};
+    int errors = 0, shift = 1;
+    unsigned char prevDiscrepancy = 1;
+    for (int k = 0; k < parity; k++)
+    {
+        unsigned char d = syndromes[k];
+        for (int i = 1; i <= errors; i++)
+            d ^= gfMul(lambda[i], syndromes[k - i]);
+
+        if (d == 0)
+        {
+            shift++;
+            continue;
+        }
+
+        unsigned char saved[FEC_MAX_PARITY + 1];
+        memcpy(saved, lambda, sizeof(saved));
+        unsigned char scale = gfDiv(d, prevDiscrepancy);
+        for (int i = 0; i + shift <= parity; i++)
+            lambda[i + shift] ^= gfMul(scale, prev[i]);
+
+        if (2 * errors <= k)
+        {
+            errors = k + 1 - errors;
+            memcpy(prev, saved, sizeof(prev));
+            prevDiscrepancy = d;
+            shift = 1;
+        }
+        else
+            shift++;
+    }
+    if (2 * errors > parity)
+        return -1;
+
+    // Error evaluator omega(x) = S(x) lambda(x) mod x^parity
+    unsigned char omega[FEC_MAX_PARITY] = {0};
+    for (int i = 0; i < parity; i++)
+    {
+        for (int j = 0; j <= i && j <= errors; j++)
+            omega[i] ^= gfMul(syndromes[i - j], lambda[j]);
+    }
+
+    // Chien search over the positions that exist in this (shortened) codeword
+    int found = 0;
+    unsigned char positions[FEC_MAX_PARITY], values[FEC_MAX_PARITY];
+    for (int j = 0; j < n && found <= errors; j++)
+    {
+        int degree = n - 1 - j;
+        int inverse = (FEC_CODEWORD_SIZE - degree) % FEC_CODEWORD_SIZE; // log of X^-1
+
+        unsigned char value = 0, derivative = 0, evaluator = 0;
+        for (int i = 0; i <= errors; i++)
+        {
+            unsigned char term = gfMul(lambda[i], gfExp[(inverse * i) % FEC_CODEWORD_SIZE]);
+            value ^= term;
+            if (i & 1)
+                derivative ^= gfMul(lambda[i], gfExp[(inverse * (i - 1)) % FEC_CODEWORD_SIZE]);
+        }
+        if (value != 0)
+            continue;
+
+        for (int i = 0; i < parity; i++)
+            evaluator ^= gfMul(omega[i], gfExp[(inverse * i) % FEC_CODEWORD_SIZE]);
+        if (derivative == 0 || found == errors)
+            return -1;
+
+        // Forney: e = X * omega(X^-1) / lambda'(X^-1)
+        positions[found] = j;
+        values[found] = gfMul(gfExp[degree], gfDiv(evaluator, derivative));
+        found++;
+    }
+    if (found != errors)
+        return -1;
+
+    for (int i = 0; i < found; i++)
+        cw[positions[i]] ^= values[i];
+    return found;
+}
+
+int fecDecode(unsigned char *buf, size_t size, int parity, int *corrected)
+{
+    if (parity == 0)
+        return size;
+    if (!gfTablesReady)
+        buildTables();
+
+    // Recover the message length from the encoded size
+    size_t len = 0, count;
+    for (count = 1; count * parity < size; count++)
+    {
+        len = size - count * parity;
+        if (codewordCount(len, parity) == count)
+            break;
+    }
+    if (count * parity >= size)
+        return -1;
+
+    int total = 0;
+    for (size_t cw = 0; cw < count; cw++)
+    {
+        unsigned char codeword[FEC_CODEWORD_SIZE];
+        int n = 0;
+        for (size_t i = cw; i < len; i += count)
+            codeword[n++] = buf[i];
+        memcpy(codeword + n, buf + len + cw * parity, parity);
+        n += parity;
+
+        int fixed = decodeCodeword(codeword, n, parity);
+        if (fixed < 0)
+            return -1;
+        if (fixed == 0)
+            continue;
+
+        n = 0;
+        for (size_t i = cw; i < len; i += count)
+            buf[i] = codeword[n++];
+        total += fixed;
+    }
+
+    *corrected += total;
+    return len;
+}
@@ -0,0 +1,27 @@
+// Forward error correction header.
+// Shortened Reed-Solomon codes over GF(256). A message is split across
+// several interleaved codewords (byte i goes to codeword i % count), so a
+// burst of corrupted bytes is spread over all of them. The message bytes are
+// sent unchanged, followed by the parity bytes of each codeword.
+
+#ifndef _FEC_H_
+#define _FEC_H_
+
+#include <stddef.h>
+
+#define FEC_CODEWORD_SIZE 255 // Longest codeword (data + parity)
+#define FEC_MAX_PARITY 16     // Parity bytes per codeword, corrects up to half
+
+// Size of a "len" byte message once encoded with "parity" bytes per codeword.
+size_t fecEncodedSize(size_t len, int parity);
+
+// Encode "len" bytes of "src" into "dst" (message, then parity).
+// Return the encoded size.
+size_t fecEncode(const unsigned char *src, size_t len, int parity, unsigned char *dst);
+
+// Correct an encoded block of "size" bytes in place. The message is left at
+// the start of "buf" and the number of fixed bytes is added to "corrected".
+// Return the message length or -1 if some codeword is uncorrectable.
+int fecDecode(unsigned char *buf, size_t size, int parity, int *corrected);
+
+#endif // _FEC_H_
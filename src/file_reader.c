@@ -0,0 +1,158 @@
+// File reader implementation.
+
+#include "file_reader.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define FALSE 0
+#define TRUE 1
+
+FileBlock readerPool[FILE_POOL_BLOCKS];
+BlockQueue readBlocks; // Reader → link: blocks holding file data
+BlockQueue freeBlocks; // Link → reader: blocks to fill again
+FILE *readerFile = NULL;
+BatchFile *readerBatch = NULL; // Files of a batch, NULL for a single file
+int readerBatchCount = 0;
+int readerBatchIndex = 0; // File being read (reader thread)
+pthread_t readerThread;
+atomic_int readerStop;
+int readerStalls = 0;
+
+// Fill a block with the next bytes of the batch, exactly as many as each
+// file's size says, opening the files in turn.
+static void readBatch(FileBlock *block)
+{
+    block->size = 0;
+    block->error = FALSE;
+    while (block->size < FILE_BLOCK_SIZE && readerBatchIndex < readerBatchCount)
+    {
+        BatchFile *file = &readerBatch[readerBatchIndex];
+        if (readerFile == NULL && (readerFile = fopen(file->path, "rb")) == NULL)
+        {
+            perror(file->path);
+            file->failed = block->error = TRUE;
+            break;
+        }
+
+        long want = file->size - file->done;
+        if (want > FILE_BLOCK_SIZE - block->size)
+            want = FILE_BLOCK_SIZE - block->size;
+        long n = fread(block->data + block->size, 1, want, readerFile);
+        block->size += n;
+        file->done += n;
+        if (n < want)
+        {
+            // Read error, or the file shrank since it was listed
+            file->failed = block->error = TRUE;
+            break;
+        }
+
+        if (file->done == file->size)
+        {
+            fclose(readerFile);
+            readerFile = NULL;
+            readerBatchIndex++;
+        }
+    }
+
+    // Never hand out part of the stream: the caller stops at the error
+    if (block->error)
+        block->size = 0;
+}
+
+static void *readFile(void *arg)
+{
+    while (1)
+    {
+        FileBlock *block = popBlock(&freeBlocks);
+        if (atomic_load(&readerStop))
+            break;
+
+        if (readerBatch != NULL)
+            readBatch(block);
+        else
+        {
+            block->size = fread(block->data, 1, FILE_BLOCK_SIZE, readerFile);
+            block->error = block->size == 0 && ferror(readerFile);
+        }
+        pushBlock(&readBlocks, block);
+        if (block->size == 0)
+            break;
+    }
+    return NULL;
+}
+
+// Start the reader thread once its source is set.
+static int startReader()
+{
+    initBlockQueue(&readBlocks);
+    initBlockQueue(&freeBlocks);
+    for (int i = 0; i < FILE_POOL_BLOCKS; i++)
+        pushBlock(&freeBlocks, &readerPool[i]);
+
+    readerStalls = 0;
+    atomic_init(&readerStop, FALSE);
+    if (pthread_create(&readerThread, NULL, readFile, NULL) != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+int startFileReader(FILE *file)
+{
+    readerFile = file;
+    readerBatch = NULL;
+    return startReader();
+}
+
+int startBatchReader(BatchFile *files, int count)
+{
+    readerFile = NULL;
+    readerBatch = files;
+    readerBatchCount = count;
+    readerBatchIndex = 0;
+    for (int i = 0; i < count; i++)
+    {
+        files[i].done = 0;
+        files[i].failed = FALSE;
+    }
+    return startReader();
+}
+
+FileBlock *nextFileBlock()
+{
+    FileBlock *block = tryPopBlock(&readBlocks);
+    if (block != NULL)
+        return block;
+    readerStalls++;
+    return popBlock(&readBlocks);
+}
+
+void releaseFileBlock(FileBlock *block)
+{
+    pushBlock(&freeBlocks, block);
+}
+
+int stopFileReader()
+{
+    // Hand queued blocks back so a reader waiting for room wakes up and stops
+    atomic_store(&readerStop, TRUE);
+    FileBlock *block;
+    while ((block = tryPopBlock(&readBlocks)) != NULL)
+        pushBlock(&freeBlocks, block);
+    pthread_join(readerThread, NULL);
+
+    // A batch reader owns the file it was reading
+    if (readerBatch != NULL && readerFile != NULL)
+    {
+        fclose(readerFile);
+        readerFile = NULL;
+    }
+
+    destroyBlockQueue(&readBlocks);
+    destroyBlockQueue(&freeBlocks);
+    return readerStalls;
+}
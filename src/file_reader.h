@@ -0,0 +1,35 @@
+// File reader header.
+// Reads the file to send on a background thread into a fixed pool of
+// blocks, handed to the link thread through a block queue and handed back
+// once sent. No allocation after startFileReader.
+
+#ifndef _FILE_READER_H_
+#define _FILE_READER_H_
+
+#include "block_queue.h"
+
+#include <stdio.h>
+
+// Start reading "file" from its current position.
+// Return 0 on success or -1 on error.
+int startFileReader(FILE *file);
+
+// Start reading the files of a batch, back to back, as one stream of
+// "size" bytes each. A file that cannot be read in full ends the stream
+// with an error block and is marked "failed".
+// Return 0 on success or -1 on error.
+int startBatchReader(BatchFile *files, int count);
+
+// Next block of the file (or batch), in order. Waits only if the reader is behind.
+// A block with size 0 marks the end of the file, or a read error if its
+// "error" is set.
+FileBlock *nextFileBlock();
+
+// Give a block obtained from nextFileBlock back to the reader.
+void releaseFileBlock(FileBlock *block);
+
+// Stop the reader (early or after the last block) and wait for it.
+// Return the number of times nextFileBlock had to wait for the disk.
+int stopFileReader();
+
+#endif // _FILE_READER_H_
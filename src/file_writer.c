@@ -0,0 +1,270 @@
+// File writer implementation.
+
+#include "file_writer.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FALSE 0
+#define TRUE 1
+
+FileBlock writerPool[FILE_POOL_BLOCKS];
+BlockQueue writeBlocks; // Link → writer: blocks to write
+BlockQueue emptyBlocks; // Writer → link: blocks to fill again
+int writerFd = -1;
+pthread_t writerThread;
+atomic_int writerFailed;
+long writerOffset = 0; // Bytes written so far (writer thread until joined)
+int writerStalls = 0;
+BatchFile *writerBatch = NULL; // Files of a batch, NULL for a single file
+int writerBatchCount = 0;
+int writerBatchIndex = 0; // File being written (writer thread)
+int writerDirFd = -1;     // Directory the batch is written into
+long writerFilePos = 0;   // Bytes of that file seen in the stream
+int writerCheckpointFd = -1; // Receives writerOffset once the data is on disk
+long writerCheckpointPosition = 0;
+
+// Write "size" bytes at "offset" of "fd".
+// Return 0 on success or -1 on error.
+static int writeAll(int fd, const unsigned char *data, int size, long offset)
+{
+    int done = 0;
+
+    while (done < size)
+    {
+        ssize_t n = pwrite(fd, data + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+// Write a whole block at the current offset.
+// Return 0 on success or -1 on error.
+static int writeBlock(const FileBlock *block)
+{
+    if (writeAll(writerFd, block->data, block->size, writerOffset) < 0)
+    {
+        perror("pwrite");
+        return -1;
+    }
+    writerOffset += block->size;
+
+    // The offset only moves once the bytes before it are durable
+    if (writerCheckpointFd >= 0)
+    {
+        unsigned char offset[8];
+        for (int i = 0; i < 8; i++)
+            offset[i] = ((uint64_t)writerOffset >> (8 * (7 - i))) & 0xFF;
+        if (fdatasync(writerFd) < 0 ||
+            pwrite(writerCheckpointFd, offset, 8, writerCheckpointPosition) != 8)
+            perror("checkpoint");
+    }
+    return 0;
+}
+
+// Create a file of the batch, with the directories leading to it.
+// Return its descriptor or -1 on error.
+static int createBatchFile(const char *path)
+{
+    char dir[256];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *slash = strchr(dir, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdirat(writerDirFd, dir, 0755) < 0 && errno != EEXIST)
+            break;
+        *slash = '/';
+    }
+
+    int fd = openat(writerDirFd, path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        perror(path);
+    return fd;
+}
+
+// Close the current file of the batch, if it is open.
+static void closeBatchFile()
+{
+    if (writerFd >= 0 && close(writerFd) < 0)
+        writerBatch[writerBatchIndex].failed = TRUE;
+    writerFd = -1;
+}
+
+// Create the current file of the batch and the empty files right after it,
+// stopping at the first file that still expects bytes.
+static void openBatchFiles()
+{
+    for (; writerBatchIndex < writerBatchCount; writerBatchIndex++)
+    {
+        BatchFile *file = &writerBatch[writerBatchIndex];
+        writerFd = createBatchFile(file->path);
+        file->failed = writerFd < 0;
+        if (file->size > 0)
+            return;
+        closeBatchFile();
+    }
+}
+
+// Split a block of the batch stream across its files. The bytes of a file
+// that cannot be written are skipped, so the files after it still arrive.
+static void writeBatchBlock(const FileBlock *block)
+{
+    int done = 0;
+
+    while (done < block->size && writerBatchIndex < writerBatchCount)
+    {
+        BatchFile *file = &writerBatch[writerBatchIndex];
+        int n = block->size - done;
+        if (n > file->size - writerFilePos)
+            n = file->size - writerFilePos;
+
+        if (!file->failed && writeAll(writerFd, block->data + done, n, writerFilePos) < 0)
+        {
+            perror(file->path);
+            file->failed = TRUE;
+        }
+        else if (!file->failed)
+        {
+            file->done += n;
+            writerOffset += n;
+        }
+        done += n;
+        writerFilePos += n;
+
+        if (writerFilePos == file->size)
+        {
+            closeBatchFile();
+            writerBatchIndex++;
+            writerFilePos = 0;
+            openBatchFiles();
+        }
+    }
+}
+
+static void *writeFile(void *arg)
+{
+    if (writerBatch != NULL)
+        openBatchFiles();
+
+    while (1)
+    {
+        // An empty block asks the writer to stop
+        FileBlock *block = popBlock(&writeBlocks);
+        int stop = block->size == 0;
+
+        // After a failure keep recycling blocks so the link thread never waits
+        if (!stop && writerBatch != NULL)
+            writeBatchBlock(block);
+        else if (!stop && !atomic_load(&writerFailed) && writeBlock(block) < 0)
+            atomic_store(&writerFailed, TRUE);
+        pushBlock(&emptyBlocks, block);
+        if (stop)
+            break;
+    }
+
+    // A batch that ends early leaves its current file open, and the files
+    // from there on incomplete
+    if (writerBatch != NULL && writerBatchIndex < writerBatchCount)
+    {
+        closeBatchFile();
+        for (int i = writerBatchIndex; i < writerBatchCount; i++)
+            writerBatch[i].failed = TRUE;
+    }
+    return NULL;
+}
+
+// Start the writer thread once its destination is set.
+static int startWriter(long offset)
+{
+    initBlockQueue(&writeBlocks);
+    initBlockQueue(&emptyBlocks);
+    for (int i = 0; i < FILE_POOL_BLOCKS; i++)
+        pushBlock(&emptyBlocks, &writerPool[i]);
+
+    writerStalls = 0;
+    atomic_init(&writerFailed, FALSE);
+    writerOffset = offset;
+    if (pthread_create(&writerThread, NULL, writeFile, NULL) != 0)
+    {
+        perror("pthread_create");
+        return -1;
+    }
+    return 0;
+}
+
+int startFileWriter(int fd, long offset)
+{
+    writerFd = fd;
+    writerBatch = NULL;
+    return startWriter(offset);
+}
+
+void setWriterCheckpoint(int fd, long position)
+{
+    writerCheckpointFd = fd;
+    writerCheckpointPosition = position;
+}
+
+int startBatchWriter(int dirFd, BatchFile *files, int count)
+{
+    writerFd = -1;
+    writerDirFd = dirFd;
+    writerBatch = files;
+    writerBatchCount = count;
+    writerBatchIndex = 0;
+    writerFilePos = 0;
+    for (int i = 0; i < count; i++)
+    {
+        files[i].done = 0;
+        files[i].failed = FALSE;
+    }
+    return startWriter(0);
+}
+
+FileBlock *nextWriteBlock()
+{
+    if (atomic_load(&writerFailed))
+        return NULL;
+
+    FileBlock *block = tryPopBlock(&emptyBlocks);
+    if (block == NULL)
+    {
+        writerStalls++;
+        block = popBlock(&emptyBlocks);
+    }
+    block->size = 0;
+    return block;
+}
+
+void queueWriteBlock(FileBlock *block)
+{
+    pushBlock(&writeBlocks, block);
+}
+
+int stopFileWriter(long *written)
+{
+    FileBlock *block = popBlock(&emptyBlocks);
+    block->size = 0;
+    pushBlock(&writeBlocks, block);
+    pthread_join(writerThread, NULL);
+
+    destroyBlockQueue(&writeBlocks);
+    destroyBlockQueue(&emptyBlocks);
+    *written = writerOffset;
+    writerCheckpointFd = -1;
+    int failed = atomic_load(&writerFailed);
+    for (int i = 0; writerBatch != NULL && i < writerBatchCount; i++)
+        failed |= writerBatch[i].failed;
+    return failed ? -1 : writerStalls;
+}
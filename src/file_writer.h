@@ -0,0 +1,41 @@
+// File writer header.
+// Writes the received file on a background thread so the link thread goes
+// back to llread as soon as a frame is acknowledged. Data is gathered into a
+// fixed pool of blocks and written one whole block at a time. No allocation
+// after startFileWriter.
+
+#ifndef _FILE_WRITER_H_
+#define _FILE_WRITER_H_
+
+#include "block_queue.h"
+
+// Start writing to "fd" from "offset" (0 unless resuming).
+// Return 0 on success or -1 on error.
+int startFileWriter(int fd, long offset);
+
+// Before startFileWriter: after each block, make the file durable and then
+// store the bytes written as 8 bytes (big endian) at "position" of "fd", so
+// an interrupted transfer can resume from there. Cleared by stopFileWriter.
+void setWriterCheckpoint(int fd, long position);
+
+// Start writing a batch into the directory "dirFd": the stream holds the
+// files back to back, "size" bytes each, and each is created (with its
+// parent directories) when the stream reaches it. A file that cannot be
+// written is marked "failed" and skipped; "done" counts the bytes written.
+// Return 0 on success or -1 on error.
+int startBatchWriter(int dirFd, BatchFile *files, int count);
+
+// An empty block to fill. Waits only if every block is queued for the disk.
+// Return NULL if a write already failed.
+FileBlock *nextWriteBlock();
+
+// Hand a filled block to the writer; blocks are written in the order queued.
+void queueWriteBlock(FileBlock *block);
+
+// Write the blocks still queued and stop the writer.
+// Set "written" to the bytes in the file (or batch) and return the number
+// of times nextWriteBlock had to wait for the disk, or -1 if a write failed
+// (for a batch, if any file failed).
+int stopFileWriter(long *written);
+
+#endif // _FILE_WRITER_H_
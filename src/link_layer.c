@@ -1,40 +1,62 @@
 #define _DEFAULT_SOURCE
 #define _XOPEN_SOURCE 700
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <unistd.h>
-#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <time.h>
 
 #define BUF_SIZE 5
 #define FALSE 0
 #define TRUE 1
 #define ESC 0x7D
-#define MAX_PACKET_SIZE (MAX_PAYLOAD_SIZE + 6)
+#define MAX_FCS_SIZE 4
+#define FEC_HEADER_SIZE 3 // Parity level, sent three times (majority vote)
+#define MAX_FEC_SIZE (FEC_HEADER_SIZE + FEC_MAX_PARITY * ((MAX_PAYLOAD_SIZE + MAX_FCS_SIZE + FEC_CODEWORD_SIZE - FEC_MAX_PARITY - 1) / (FEC_CODEWORD_SIZE - FEC_MAX_PARITY)))
+#define MAX_PACKET_SIZE (MAX_PAYLOAD_SIZE + MAX_FCS_SIZE + MAX_FEC_SIZE) // Destuffed data field
+#define MAX_FRAME_SIZE (4 + 2 * MAX_PACKET_SIZE + 1)
+#define MIN_RTO 0.05 // Lower bound of the adaptive retransmission timeout (s)
 
+#include "crc.h"
+#include "fec.h"
 #include "link_layer.h"
+#include "link_options.h"
+#include "log.h"
 #include "serial_port.h"
+#include "stuffing.h"
 
 // Frame constants
-const unsigned char FLAG = 0x7E;
-const unsigned char ADDRESS_TR = 0x03;
-const unsigned char ADDRESS_RT = 0x01;
+static const unsigned char FLAG = 0x7E;
+static const unsigned char ADDRESS_TR = 0x03;
+static const unsigned char ADDRESS_RT = 0x01;
 
 // Control field constants
-const unsigned char CONTROL_SET = 0x03;
-const unsigned char CONTROL_UA = 0x07;
-const unsigned char CONTROL_DISC = 0x0B;
-const unsigned char CONTROL_RR0 = 0x05;
-const unsigned char CONTROL_RR1 = 0x85;
-const unsigned char CONTROL_REJ0 = 0x01;
-const unsigned char CONTROL_REJ1 = 0x81;
+static const unsigned char CONTROL_SET = 0x03;
+static const unsigned char CONTROL_UA = 0x07;
+static const unsigned char CONTROL_DISC = 0x0B;
+static const unsigned char CONTROL_RR0 = 0x05;
+static const unsigned char CONTROL_RR1 = 0x85;
+static const unsigned char CONTROL_REJ0 = 0x01;
+static const unsigned char CONTROL_REJ1 = 0x81;
 
 // Helper macros
 #define C_RR(s) (((s) == 0) ? CONTROL_RR0 : CONTROL_RR1)
 #define C_REJ(s) (((s) == 0) ? CONTROL_REJ0 : CONTROL_REJ1)
 #define C_N(s) (((s) == 0) ? 0x00 : 0x40)
 
+// Extended control fields (windowed modes): 3-bit sequence number in bits 3-5,
+// frame type in bits 0-2. Ns/Nr = 0 coincides with the basic encoding.
+#define C_NX(s) ((unsigned char)((s) << 3))
+#define C_RRX(s) ((unsigned char)(((s) << 3) | 0x05))
+#define C_REJX(s) ((unsigned char)(((s) << 3) | 0x01))
+#define C_SREJX(s) ((unsigned char)(((s) << 3) | 0x06))
+#define C_SEQX(c) (((c) >> 3) & 0x07)
+#define C_TYPEX(c) ((c) & 0xC7)
+
 // State machine for frame reception
 typedef enum
 {
@@ -48,611 +70,2058 @@ typedef enum
     STOP_R
 } LinkLayerState;
 
-// Global variables for link control
-int alarmEnabled = FALSE;
-int alarmCount = 0;
-int connection_fd = -1;
-int tramaTx = 0;
-int tramaRx = 0;
-int retransmissions = 3;
-int timeout = 3;
-int discReceived = 0;
+// Result of waiting on the link
+typedef enum
+{
+    EVENT_ERROR = -1,
+    EVENT_NONE,  // Nothing ready (non-blocking wait only)
+    EVENT_BYTE,  // A received byte is available
+    EVENT_TIMER  // The retransmission timer expired
+} LinkEvent;
+
+// Progress of llclose, kept across non-blocking calls
+typedef enum
+{
+    CLOSE_START, // Not started
+    CLOSE_DRAIN, // Transmitter: waiting for the window to be acknowledged
+    CLOSE_DISC,  // Exchanging DISC frames
+    CLOSE_REPLY, // Sending the last frame (UA or DISC) and closing
+} ClosePhase;
+
+// Entry of the payload size timeline reported by llclose
+typedef struct
+{
+    double at; // Seconds since llopen
+    int frame; // I frames sent before the change
+    int size;
+} PayloadChange;
+
+// Supervision frame types
+typedef enum
+{
+    S_NONE,
+    S_RR,
+    S_REJ,
+    S_SREJ
+} SupervisionType;
+
+// Forward error correction: parity bytes per codeword at each level; the
+// transmitter steps through them following its estimate of the share of
+// frames that needed a retransmission
+static const int FEC_LEVELS[] = {0, 2, 4, 8, FEC_MAX_PARITY};
+#define FEC_LEVEL_COUNT (int)(sizeof(FEC_LEVELS) / sizeof(FEC_LEVELS[0]))
+#define FEC_RATE_GAIN (1.0 / 16)
+#define FEC_RAISE_RATE 0.10 // Step up when more than this share of frames fails
+#define FEC_LOWER_RATE 0.01 // Step down below this, after FEC_LOWER_FRAMES at a level
+#define FEC_LOWER_FRAMES 128
+
+// Adaptive payload size: smoothed frame outcomes seen by the transmitter,
+// turned into a bit error estimate and the block size with the best
+// expected goodput
+#define MIN_PAYLOAD_SIZE 64
+#define INITIAL_PAYLOAD_SIZE 512
+#define PAYLOAD_STEP 8
+#define PAYLOAD_GAIN (1.0 / 32)
+#define PAYLOAD_MIN_FRAMES 8    // Outcomes needed before the first decision
+#define PAYLOAD_HYSTERESIS 1.005 // Expected goodput gain needed to switch
+#define MAX_PAYLOAD_CHANGES 32  // Timeline entries kept for llclose
+
+// Everything one connection needs, so that a process can drive several
+// (see llopenh). llopen, llwrite, llread and llclose use defaultConnection.
+struct LinkConnection
+{
+    SerialPort port;
+    int timerFd; // Retransmission timer (timerfd), polled with the port
+    LinkLayerRole role;
+    int tramaTx;
+    int tramaRx;
+    int retransmissions;
+    int timeout;
+    int discReceived;
+
+    // Sliding window configuration (stop-and-wait is a window of 1, modulo 2)
+    LinkOptions linkOptions;
+    int seqModulus;
+
+    // Transmitter window: frames sent but not yet acknowledged, indexed by Ns
+    unsigned char txFrames[SEQ_MODULUS_EXT][MAX_FRAME_SIZE];
+    int txFrameSizes[SEQ_MODULUS_EXT];
+    int txBase;                           // Oldest unacknowledged Ns (tramaTx is the next new one)
+    int txAttempts;                       // Timeouts since the window last advanced
+    double txDueAt[SEQ_MODULUS_EXT];      // When the last byte of each frame leaves the line
+    double txDeadline[SEQ_MODULUS_EXT];   // Selective Repeat: when each frame times out
+    int txTimeouts[SEQ_MODULUS_EXT];      // Selective Repeat: timeouts of each frame
+    double lineFreeAt;                    // When everything written so far has left the line
+    int txRetransmitted[SEQ_MODULUS_EXT]; // Karn's rule: no RTT sample from these
+    unsigned char txPayloads[SEQ_MODULUS_EXT][MAX_PAYLOAD_SIZE]; // Kept to re-encode (FEC only)
+    int txPayloadSizes[SEQ_MODULUS_EXT];
+    int txFrameLevels[SEQ_MODULUS_EXT]; // FEC level each buffered frame was encoded with
+
+    // Adaptive retransmission timeout (Jacobson/Karels), bounded by "timeout".
+    // Round trips are measured from the moment a frame has been fully sent, so
+    // they do not depend on the frame size; the timer adds the send time.
+    double srtt;   // Smoothed round-trip time (s), 0 until the first sample
+    double rttvar; // Round-trip time variation (s)
+    double rto;    // Current retransmission timeout (s)
+    int rttSamples;
+
+    // Forward error correction level and failure rate at that level
+    int fecLevel;
+    double fecErrorRate;
+    int fecFramesAtLevel;
+    int fecLevelChanges;
+
+    // Adaptive payload size
+    double byteTime; // Seconds per byte on the line (10 bits)
+    double openedAt;
+    int payloadSize;
+    int payloadOutcomes;
+    double outcomeFrames, outcomeFailures;
+    double avgFrameBytes, avgPayloadBytes; // Smoothed sizes of new I frames
+    PayloadChange payloadTimeline[MAX_PAYLOAD_CHANGES];
+    int payloadChanges;
+
+    // Statistics reported by llclose
+    LinkStats linkStats;
+    int baudRate;
+    double closedAt;
+
+    // Acknowledgment parser state, kept across calls so partial frames survive
+    LinkLayerState ackState;
+    unsigned char ackField;
+
+    // Receiver: a REJ was sent and the expected frame has not arrived yet
+    int rejSent;
+
+    // Receiver reorder buffer (Selective Repeat): frames accepted ahead of tramaRx
+    unsigned char rxFrames[SEQ_MODULUS_EXT][MAX_PAYLOAD_SIZE];
+    int rxFrameSizes[SEQ_MODULUS_EXT];
+    int rxBuffered[SEQ_MODULUS_EXT]; // TRUE if the slot holds a frame
+    int srejSent[SEQ_MODULUS_EXT];   // TRUE if that Ns was already requested
+
+    // Receiver I frame parser, kept across non-blocking llread calls
+    LinkLayerState rxState;
+    unsigned char rxControl;
+    unsigned char rxData[MAX_PACKET_SIZE];
+    int rxDataIndex;
+
+    // Receiver: the timer checks that bytes keep arriving, so a transmitter
+    // that gave up is noticed instead of waited for forever
+    long rxActivity;     // Bytes received
+    long rxActivitySeen; // Bytes received when the timer was last armed
+    int rxIdleArmed;
+    int peerLost;
+
+    // Carried by the UA of llopen: sent (receiver) or received (transmitter)
+    unsigned char openData[LL_OPEN_DATA_MAX];
+    int openDataSize;
+
+    // SET/UA and DISC exchanges, kept across non-blocking llconnecth/llcloseh calls
+    int opened;             // The SET/UA exchange is over
+    ClosePhase closePhase;
+    int handshakeState;     // Parser state of the awaited frame
+    int handshakeAttempts;  // Frames sent in the current exchange
+    int handshakeWaiting;   // A frame was sent and its answer is awaited
+    unsigned char uaField[2 * (LL_OPEN_DATA_MAX + 1)]; // UA information field, still stuffed
+    int uaFieldSize;
+};
+
+static LinkConnection defaultConnection = {.port = {.fd = -1}, .timerFd = -1};
 
-// Alarm handler for timeout control
-void alarmHandler(int signal)
+// Connection of the call in progress: every entry point sets it before
+// working on a handle, which is why handles are single-threaded
+static LinkConnection *conn = &defaultConnection;
+
+// Options for the next llopen (set by llsetoptions)
+static LinkOptions defaultOptions = {.arqMode = ArqStopAndWait, .windowSize = 1, .fcsMode = FcsXor, .fecMode = FecOff};
+
+////////////////////////////////////////////////
+// OPTIONS
+////////////////////////////////////////////////
+void lldefaultoptions(LinkOptions *options)
 {
-    (void)signal;
-    alarmEnabled = FALSE;
-    alarmCount++;
+    options->arqMode = ArqStopAndWait;
+    options->windowSize = 1;
+    options->fcsMode = FcsXor;
+    options->fecMode = FecOff;
+    options->payloadSize = 0;
+    options->statsFile = NULL;
+    options->nonBlocking = FALSE;
+    options->openData = NULL;
+    options->openDataSize = 0;
+}
+
+// Return 0 if the options are valid or -1 otherwise.
+static int checkOptions(const LinkOptions *options)
+{
+    if (options->openDataSize < 0 || options->openDataSize > LL_OPEN_DATA_MAX)
+    {
+        logError("ERROR: Open data must be at most %d bytes\n", LL_OPEN_DATA_MAX);
+        return -1;
+    }
+    if (options->payloadSize < 0 || options->payloadSize > MAX_PAYLOAD_SIZE)
+    {
+        logError("ERROR: Payload size must be between 1 and %d (0 adapts it)\n", MAX_PAYLOAD_SIZE);
+        return -1;
+    }
+    if (options->arqMode == ArqStopAndWait)
+        return 0;
+
+    int maxWindow = options->arqMode == ArqSelectiveRepeat ? SEQ_MODULUS_EXT / 2 : SEQ_MODULUS_EXT - 1;
+    if (options->windowSize < 1 || options->windowSize > maxWindow)
+    {
+        logError("ERROR: Window size must be between 1 and %d\n", maxWindow);
+        return -1;
+    }
+    return 0;
+}
+
+int llsetoptions(const LinkOptions *options)
+{
+    if (checkOptions(options) < 0)
+        return -1;
+    defaultOptions = *options;
+    return 0;
+}
+
+int llenvoptions(LinkOptions *options)
+{
+    lldefaultoptions(options);
+
+    const char *arq = getenv("LL_ARQ");
+    if (arq != NULL)
+    {
+        if (strcmp(arq, "gbn") == 0)
+        {
+            options->arqMode = ArqGoBackN;
+            options->windowSize = 7;
+        }
+        else if (strcmp(arq, "sr") == 0)
+        {
+            options->arqMode = ArqSelectiveRepeat;
+            options->windowSize = 4;
+        }
+        else if (strcmp(arq, "sw") != 0)
+        {
+            logError("ERROR: LL_ARQ must be \"sw\", \"gbn\" or \"sr\"\n");
+            return -1;
+        }
+    }
+
+    const char *window = getenv("LL_WINDOW");
+    if (window != NULL)
+        options->windowSize = atoi(window);
+
+    const char *fcs = getenv("LL_FCS");
+    if (fcs != NULL)
+    {
+        if (strcmp(fcs, "crc16") == 0)
+            options->fcsMode = FcsCrc16;
+        else if (strcmp(fcs, "crc32") == 0)
+            options->fcsMode = FcsCrc32;
+        else if (strcmp(fcs, "xor") != 0)
+        {
+            logError("ERROR: LL_FCS must be \"xor\", \"crc16\" or \"crc32\"\n");
+            return -1;
+        }
+    }
+
+    const char *fec = getenv("LL_FEC");
+    if (fec != NULL)
+    {
+        if (strcmp(fec, "rs") == 0)
+            options->fecMode = FecReedSolomon;
+        else if (strcmp(fec, "off") != 0)
+        {
+            logError("ERROR: LL_FEC must be \"off\" or \"rs\"\n");
+            return -1;
+        }
+    }
+
+    const char *payload = getenv("LL_PAYLOAD");
+    if (payload != NULL && strcmp(payload, "adaptive") != 0)
+    {
+        options->payloadSize = atoi(payload);
+        if (options->payloadSize <= 0)
+        {
+            logError("ERROR: LL_PAYLOAD must be a size in bytes or \"adaptive\"\n");
+            return -1;
+        }
+    }
+
+    options->statsFile = getenv("LL_STATS");
+    return checkOptions(options);
+}
+
+// Apply valid options to the current connection.
+static void applyOptions(const LinkOptions *options)
+{
+    conn->linkOptions = *options;
+    if (options->arqMode == ArqStopAndWait)
+    {
+        conn->linkOptions.windowSize = 1;
+        conn->seqModulus = 2;
+    }
+    else
+        conn->seqModulus = SEQ_MODULUS_EXT;
 }
 
 ////////////////////////////////////////////////
-// LLOPEN
+// CONTROL FIELDS
 ////////////////////////////////////////////////
-int llopen(LinkLayer connectionParameters)
+static unsigned char controlI(int ns)
 {
-    int fd = openSerialPort(connectionParameters.serialPort, connectionParameters.baudRate);
-    if (fd < 0)
+    return conn->seqModulus == 2 ? C_N(ns) : C_NX(ns);
+}
+
+static unsigned char controlRR(int nr)
+{
+    return conn->seqModulus == 2 ? C_RR(nr) : C_RRX(nr);
+}
+
+static unsigned char controlREJ(int nr)
+{
+    return conn->seqModulus == 2 ? C_REJ(nr) : C_REJX(nr);
+}
+
+// Return the Ns of an I frame control field, or -1 if it is not one.
+static int parseI(unsigned char c)
+{
+    if (conn->seqModulus == 2)
+        return c == C_N(0) ? 0 : c == C_N(1) ? 1 : -1;
+    return C_TYPEX(c) == C_NX(0) ? C_SEQX(c) : -1;
+}
+
+// Decode a supervision control field into its type and Nr.
+static SupervisionType parseSupervision(unsigned char c, int *nr)
+{
+    if (conn->seqModulus == 2)
     {
-        printf("ERROR: Cannot open serial port %s\n", connectionParameters.serialPort);
+        if (c == C_RR(0) || c == C_RR(1))
+        {
+            *nr = c == C_RR(1);
+            return S_RR;
+        }
+        if (c == C_REJ(0) || c == C_REJ(1))
+        {
+            *nr = c == C_REJ(1);
+            return S_REJ;
+        }
+        return S_NONE;
+    }
+
+    *nr = C_SEQX(c);
+    if (C_TYPEX(c) == C_RRX(0))
+        return S_RR;
+    if (C_TYPEX(c) == C_REJX(0))
+        return S_REJ;
+    if (C_TYPEX(c) == C_SREJX(0))
+        return S_SREJ;
+    return S_NONE;
+}
+
+// Distance from "from" to "to" in sequence number space.
+static int seqDistance(int from, int to)
+{
+    return (to - from + conn->seqModulus) % conn->seqModulus;
+}
+
+// Send a supervision frame from the receiver.
+static void sendSupervision(unsigned char cField)
+{
+    unsigned char frame[5] = {FLAG, ADDRESS_RT, cField, ADDRESS_RT ^ cField, FLAG};
+    serialWrite(&conn->port, frame, 5);
+}
+
+// Compute the frame check sequence of a payload into "fcs" (LSB first).
+// Returns its length in bytes.
+static int computeFcs(const unsigned char *buf, int size, unsigned char *fcs)
+{
+    if (conn->linkOptions.fcsMode == FcsCrc16)
+    {
+        uint16_t crc = crc16Final(crc16Update(CRC16_INIT, buf, size));
+        fcs[0] = crc & 0xFF;
+        fcs[1] = crc >> 8;
+        return 2;
+    }
+    if (conn->linkOptions.fcsMode == FcsCrc32)
+    {
+        uint32_t crc = crc32Final(crc32Update(CRC32_INIT, buf, size));
+        for (int i = 0; i < 4; i++)
+            fcs[i] = (crc >> (8 * i)) & 0xFF;
+        return 4;
+    }
+
+    // BCC2: XOR of every data byte
+    fcs[0] = 0;
+    for (int i = 0; i < size; i++)
+        fcs[0] ^= buf[i];
+    return 1;
+}
+
+static int fcsSize()
+{
+    return conn->linkOptions.fcsMode == FcsCrc32 ? 4 : conn->linkOptions.fcsMode == FcsCrc16 ? 2 : 1;
+}
+
+////////////////////////////////////////////////
+// FORWARD ERROR CORRECTION
+////////////////////////////////////////////////
+
+// Build the FEC-protected data field: level header, then payload and BCC2
+// encoded together. Return its size.
+static int encodeDataField(const unsigned char *buf, int size, const unsigned char *fcs, int fcsLength,
+                           unsigned char *field)
+{
+    int parity = FEC_LEVELS[conn->fecLevel];
+    field[0] = field[1] = field[2] = parity;
+    memcpy(field + FEC_HEADER_SIZE, buf, size);
+    memcpy(field + FEC_HEADER_SIZE + size, fcs, fcsLength);
+    return FEC_HEADER_SIZE + fecEncode(field + FEC_HEADER_SIZE, size + fcsLength, parity, field + FEC_HEADER_SIZE);
+}
+
+// Correct a received data field in place and strip its header, leaving
+// payload and BCC2 at the start. Return their size or -1 if uncorrectable.
+static int decodeDataField(unsigned char *field, int size)
+{
+    if (size <= FEC_HEADER_SIZE)
+        return -1;
+
+    // Bitwise majority of the three copies of the level
+    unsigned char parity = (field[0] & field[1]) | (field[0] & field[2]) | (field[1] & field[2]);
+    int valid = FALSE;
+    for (int i = 0; i < FEC_LEVEL_COUNT; i++)
+        valid |= parity == FEC_LEVELS[i];
+    if (!valid)
         return -1;
+
+    int corrected = 0;
+    int length = fecDecode(field + FEC_HEADER_SIZE, size - FEC_HEADER_SIZE, parity, &corrected);
+    if (length < 0)
+        return -1;
+    if (corrected > 0)
+        logDebug("FEC corrected %d byte(s)\n", corrected);
+    conn->linkStats.fecCorrected += corrected;
+    memmove(field, field + FEC_HEADER_SIZE, length);
+    return length;
+}
+
+// Adapt the redundancy to the retransmission rate seen by the transmitter.
+// "acked" frames got through; "failed" is TRUE if frame "ns" was rejected or
+// timed out. Failures of frames encoded at an older level say nothing about
+// the current one and are ignored. Steps up on a noisy line as soon as two
+// failures come close together, and down only after a long clean run.
+static void updateFecLevel(int acked, int failed, int ns)
+{
+    if (conn->linkOptions.fecMode == FecOff)
+        return;
+
+    for (int i = 0; i < acked; i++)
+        conn->fecErrorRate *= 1 - FEC_RATE_GAIN;
+    if (failed && conn->txFrameLevels[ns] == conn->fecLevel)
+        conn->fecErrorRate += FEC_RATE_GAIN * (1 - conn->fecErrorRate);
+    conn->fecFramesAtLevel += acked;
+
+    int level = conn->fecLevel;
+    if (conn->fecErrorRate > FEC_RAISE_RATE && conn->fecLevel < FEC_LEVEL_COUNT - 1)
+        level++;
+    else if (conn->fecErrorRate < FEC_LOWER_RATE && conn->fecFramesAtLevel >= FEC_LOWER_FRAMES && conn->fecLevel > 0)
+        level--;
+
+    if (level != conn->fecLevel)
+    {
+        logInfo("FEC level %d -> %d (%d parity bytes per codeword, error rate %.3f)\n",
+                conn->fecLevel, level, FEC_LEVELS[level], conn->fecErrorRate);
+        if (level > conn->fecLevel)
+            conn->fecErrorRate = 0; // Judge the new level on its own failures
+        conn->fecLevel = level;
+        conn->fecFramesAtLevel = 0;
+        conn->fecLevelChanges++;
+    }
+}
+
+////////////////////////////////////////////////
+// RETRANSMISSION TIMEOUT
+////////////////////////////////////////////////
+static double monotonicNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Feed a round-trip sample (s) to the SRTT/RTTVAR estimator and recompute
+// RTO = SRTT + 4 * RTTVAR, kept between MIN_RTO and the configured timeout.
+static void sampleRtt(double rtt)
+{
+    if (conn->rttSamples++ == 0)
+    {
+        conn->srtt = rtt;
+        conn->rttvar = rtt / 2;
+    }
+    else
+    {
+        double error = conn->srtt > rtt ? conn->srtt - rtt : rtt - conn->srtt;
+        conn->rttvar = 0.75 * conn->rttvar + 0.25 * error;
+        conn->srtt = 0.875 * conn->srtt + 0.125 * rtt;
     }
 
-    connection_fd = fd;
-    retransmissions = connectionParameters.nRetransmissions;
-    timeout = connectionParameters.timeout;
+    conn->rto = conn->srtt + 4 * conn->rttvar;
+    if (conn->rto < MIN_RTO)
+        conn->rto = MIN_RTO;
+    if (conn->rto > conn->timeout)
+        conn->rto = conn->timeout;
+}
 
-    // Set alarm handler
-    struct sigaction act;
-    memset(&act, 0, sizeof(act));
-    act.sa_handler = alarmHandler;
-    sigaction(SIGALRM, &act, NULL);
+// Exponential backoff after a timeout; kept until a new valid sample.
+static void backoffRto()
+{
+    conn->rto *= 2;
+    if (conn->rto > conn->timeout)
+        conn->rto = conn->timeout;
+}
 
-    unsigned char buf[BUF_SIZE];
-    int state = 0, STOP = 0;
-    alarmEnabled = FALSE;
-    alarmCount = 0;
+////////////////////////////////////////////////
+// PAYLOAD SIZE
+////////////////////////////////////////////////
+int llpayloadsizeh(const LinkConnection *connection)
+{
+    return connection->linkOptions.payloadSize != 0 ? connection->linkOptions.payloadSize
+                                                    : connection->payloadSize;
+}
 
-    // ---------- TRANSMITTER ----------
-    if (connectionParameters.role == LlTx)
+int llpayloadsize()
+{
+    return llpayloadsizeh(&defaultConnection);
+}
+
+// (1 - p)^n for a whole number of trials (no libm in the course Makefile).
+static double survival(double p, int n)
+{
+    double result = 1, base = 1 - p;
+    for (; n > 0; n >>= 1, base *= base)
     {
-        // Build SET frame
-        buf[0] = FLAG;
-        buf[1] = ADDRESS_TR;
-        buf[2] = CONTROL_SET;
-        buf[3] = buf[1] ^ buf[2];
-        buf[4] = FLAG;
+        if (n & 1)
+            result *= base;
+    }
+    return result;
+}
+
+// -ln(1 - x) for 0 <= x < 1, by its series.
+static double negLog1m(double x)
+{
+    double sum = 0, power = x;
+    for (int k = 1; k < 200 && power / k > 1e-9; k++, power *= x)
+        sum += power / k;
+    return sum;
+}
 
-        // Send SET and wait for UA
-        while (!STOP && alarmCount < retransmissions)
+// Expected payload bytes delivered per byte time for "size"-byte blocks at
+// bit error rate "ber". Wire size follows the stuffing (and FEC) expansion
+// seen so far; the idle time is the part of the RTT the window cannot fill.
+// A lost frame costs itself, or the whole window with Go-Back-N.
+static double expectedGoodput(int size, double ber)
+{
+    double expansion = conn->avgPayloadBytes > 0 ? (conn->avgFrameBytes - 5) / (conn->avgPayloadBytes + fcsSize()) : 1;
+    double wire = 5 + expansion * (size + fcsSize());
+    double idle = conn->srtt / conn->byteTime - (conn->linkOptions.windowSize - 1) * conn->avgFrameBytes;
+    idle = idle > 0 ? idle / conn->linkOptions.windowSize : 0;
+
+    double success = survival(ber, (int)(8 * wire));
+    double cost = wire + idle;
+    if (conn->linkOptions.arqMode == ArqGoBackN)
+        cost *= 1 + (conn->linkOptions.windowSize - 1) * (1 - success);
+    return size * success / cost;
+}
+
+// Smooth the frame outcomes and move to the block size with the best
+// expected goodput once it beats the current one by PAYLOAD_HYSTERESIS.
+// At most one change per PAYLOAD_MIN_FRAMES outcomes.
+static void updatePayloadSize(int acked, int failed)
+{
+    if (conn->linkOptions.payloadSize != 0 || conn->avgFrameBytes == 0)
+        return;
+
+    for (int i = 0; i < acked + failed; i++)
+    {
+        conn->outcomeFrames = conn->outcomeFrames * (1 - PAYLOAD_GAIN) + 1;
+        conn->outcomeFailures = conn->outcomeFailures * (1 - PAYLOAD_GAIN) + (i >= acked);
+    }
+    conn->payloadOutcomes += acked + failed;
+    if (conn->payloadOutcomes < PAYLOAD_MIN_FRAMES)
+        return;
+
+    // Frame error rate → bit error rate: P(frame ok) = (1 - ber)^bits
+    double frameErrors = conn->outcomeFailures / conn->outcomeFrames;
+    if (frameErrors > 0.9)
+        frameErrors = 0.9;
+    double ber = negLog1m(frameErrors) / (8 * conn->avgFrameBytes);
+
+    int best = conn->payloadSize;
+    double bestGoodput = expectedGoodput(conn->payloadSize, ber) * PAYLOAD_HYSTERESIS;
+    for (int size = MIN_PAYLOAD_SIZE; size <= MAX_PAYLOAD_SIZE; size += PAYLOAD_STEP)
+    {
+        double goodput = expectedGoodput(size, ber);
+        if (goodput > bestGoodput)
         {
-            unsigned char byte;
+            best = size;
+            bestGoodput = goodput;
+        }
+    }
+    if (best == conn->payloadSize)
+        return;
 
-            if (!alarmEnabled)
-            {
-                printf("Sending SET frame (attempt %d)\n", alarmCount + 1);
-                writeBytesSerialPort(buf, 5);
-                alarm(timeout);
-                alarmEnabled = TRUE;
-            }
+    logInfo("Payload size %d -> %d bytes (frame error rate %.3f, BER estimate %.1e)\n",
+            conn->payloadSize, best, frameErrors, ber);
+    conn->payloadSize = best;
+    conn->payloadOutcomes = 0; // Let the new size collect its own outcomes
+    if (conn->payloadChanges < MAX_PAYLOAD_CHANGES)
+    {
+        PayloadChange change = {monotonicNow() - conn->openedAt, conn->linkStats.framesSent, best};
+        conn->payloadTimeline[conn->payloadChanges] = change;
+    }
+    conn->payloadChanges++;
+}
 
-            state = 0;
-            while (alarmEnabled && !STOP)
-            {
-                if (readByteSerialPort(&byte) <= 0)
-                    continue;
-                printf("Byte received = 0x%02X\n", byte);
-                switch (state)
-                {
-                case 0:
-                    if (byte == FLAG)
-                        state = 1;
-                    break;
-                case 1:
-                    if (byte == ADDRESS_RT)
-                        state = 2;
-                    else
-                        state = 0;
-                    break;
-                case 2:
-                    if (byte == CONTROL_UA)
-                        state = 3;
-                    else
-                        state = 0;
-                    break;
-                case 3:
-                    if (byte == (ADDRESS_RT ^ CONTROL_UA))
-                        state = 4;
-                    else
-                        state = 0;
-                    break;
-                case 4:
-                    if (byte == FLAG)
-                    {
-                        printf("Received UA frame  - connection opened\n");
-                        STOP = 1;
-                    }
-                    else
-                        state = 0;
-                    break;
-                }
-            }
+////////////////////////////////////////////////
+// EVENTS
+////////////////////////////////////////////////
+
+// Arm the retransmission timer to fire once after "seconds" (0 disarms it).
+static void setTimer(double seconds)
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = (time_t)seconds;
+    spec.it_value.tv_nsec = (long)((seconds - spec.it_value.tv_sec) * 1e9);
+    timerfd_settime(conn->timerFd, 0, &spec, NULL);
+}
+
+// Arm the timer for the oldest outstanding frame (or a supervision frame):
+// RTO after its last byte is due to leave the line. Selective Repeat resends
+// frames one by one, so its timer follows the earliest deadline of any.
+static void startTimer()
+{
+    double now = monotonicNow();
+    if (conn->linkOptions.arqMode == ArqSelectiveRepeat && seqDistance(conn->txBase, conn->tramaTx) > 0)
+    {
+        double deadline = conn->txDeadline[conn->txBase];
+        for (int ns = conn->txBase; ns != conn->tramaTx; ns = (ns + 1) % conn->seqModulus)
+        {
+            if (conn->txDeadline[ns] < deadline)
+                deadline = conn->txDeadline[ns];
+        }
+        setTimer(deadline > now ? deadline - now : 1e-6); // 0 would disarm it
+        return;
+    }
+
+    double wait = conn->rto;
+    if (seqDistance(conn->txBase, conn->tramaTx) > 0 && conn->txDueAt[conn->txBase] > now)
+        wait += conn->txDueAt[conn->txBase] - now;
+    setTimer(wait);
+}
+
+// Estimate when a frame just written will have left the line, queued behind
+// whatever was written before it, and when it times out.
+static void noteSent(int ns)
+{
+    double now = monotonicNow();
+    conn->lineFreeAt = (conn->lineFreeAt > now ? conn->lineFreeAt : now) + conn->txFrameSizes[ns] * conn->byteTime;
+    conn->txDueAt[ns] = conn->lineFreeAt;
+    conn->txDeadline[ns] = conn->txDueAt[ns] + conn->rto;
+}
+
+static void stopTimer()
+{
+    setTimer(0);
+}
+
+// Sleep in poll() until a byte arrives or the retransmission timer fires.
+// If "block" is FALSE, return EVENT_NONE instead of sleeping.
+// A byte wins over a simultaneous timeout, since it may be the awaited reply.
+static LinkEvent nextEvent(int block, unsigned char *byte)
+{
+    while (1)
+    {
+        if (serialPending(&conn->port) > 0)
+            return serialReadByte(&conn->port, byte) > 0 ? EVENT_BYTE : EVENT_ERROR;
+
+        struct pollfd fds[2] = {{.fd = conn->port.fd, .events = POLLIN},
+                                {.fd = conn->timerFd, .events = POLLIN}};
+        int ready = poll(fds, 2, block ? -1 : 0);
+        if (ready < 0 && errno == EINTR)
+            continue;
+        if (ready < 0)
+            return EVENT_ERROR;
+        if (ready == 0)
+            return EVENT_NONE;
+
+        if (fds[0].revents & POLLIN)
+        {
+            int n = serialReadByte(&conn->port, byte);
+            if (n > 0)
+                return EVENT_BYTE;
+            if (n < 0 || (fds[0].revents & POLLHUP))
+                return EVENT_ERROR;
+        }
+        else if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+            return EVENT_ERROR;
+
+        if (fds[1].revents & POLLIN)
+        {
+            uint64_t expirations;
+            if (read(conn->timerFd, &expirations, sizeof(expirations)) > 0)
+                return EVENT_TIMER;
+        }
+    }
+}
+
+////////////////////////////////////////////////
+// LLOPEN
+////////////////////////////////////////////////
+// Send the UA that answers SET. Open data travels in an information field:
+// stuffed, followed by its XOR, like the data of an I frame.
+static void sendUa()
+{
+    unsigned char frame[4 + 2 * (LL_OPEN_DATA_MAX + 1) + 1];
+    unsigned char data[LL_OPEN_DATA_MAX + 1];
+    int size = 0;
+
+    frame[size++] = FLAG;
+    frame[size++] = ADDRESS_RT;
+    frame[size++] = CONTROL_UA;
+    frame[size++] = ADDRESS_RT ^ CONTROL_UA;
+    if (conn->openDataSize > 0)
+    {
+        unsigned char bcc = 0;
+        for (int i = 0; i < conn->openDataSize; i++)
+            bcc ^= data[i] = conn->openData[i];
+        data[conn->openDataSize] = bcc;
+        size += stuffBytes(data, conn->openDataSize + 1, frame + size);
+    }
+    frame[size++] = FLAG;
+    serialWrite(&conn->port, frame, size);
+}
+
+// Take the open data of a UA from its stuffed information field.
+// Return 0 on success or -1 if it is damaged.
+static int receiveOpenData(const unsigned char *field, int size)
+{
+    unsigned char data[LL_OPEN_DATA_MAX + 1];
+    int escaped = FALSE;
+    int length = destuffBytes(field, size, data, &escaped);
+    if (escaped || length < 2 || length > LL_OPEN_DATA_MAX + 1)
+        return -1;
+
+    unsigned char bcc = 0;
+    for (int i = 0; i < length - 1; i++)
+        bcc ^= data[i];
+    if (bcc != data[length - 1])
+        return -1;
+    memcpy(conn->openData, data, length - 1);
+    conn->openDataSize = length - 1;
+    return 0;
+}
+
+// Close the port and the timer of the current connection.
+static void releasePort()
+{
+    serialClose(&conn->port);
+    close(conn->timerFd);
+    conn->timerFd = -1;
+    conn->closedAt = monotonicNow();
+}
+
+// Advance the parser of the 5-byte frame with "address" and "control" by
+// one byte. Return TRUE once the whole frame has arrived.
+static int matchFrame(unsigned char byte, unsigned char address, unsigned char control)
+{
+    switch (conn->handshakeState)
+    {
+    case 0:
+        if (byte == FLAG)
+            conn->handshakeState = 1;
+        break;
+    case 1:
+        conn->handshakeState = byte == address ? 2 : 0;
+        break;
+    case 2:
+        conn->handshakeState = byte == control ? 3 : 0;
+        break;
+    case 3:
+        conn->handshakeState = byte == (address ^ control) ? 4 : 0;
+        break;
+    case 4:
+        conn->handshakeState = 0;
+        return byte == FLAG;
+    }
+    return FALSE;
+}
+
+// Advance the parser of a UA, which may carry open data, by one byte.
+// Return TRUE once the whole frame has arrived.
+static int matchUa(unsigned char byte)
+{
+    if (conn->handshakeState < 4)
+        return matchFrame(byte, ADDRESS_RT, CONTROL_UA);
+
+    if (conn->handshakeState == 4)
+    {
+        if (byte == FLAG)
+        {
+            logInfo("Received UA frame  - connection opened\n");
+            return TRUE;
         }
+        conn->uaField[0] = byte;
+        conn->uaFieldSize = 1;
+        conn->handshakeState = 5;
+    }
+    // UA with open data
+    else if (byte == FLAG && receiveOpenData(conn->uaField, conn->uaFieldSize) == 0)
+    {
+        logInfo("Received UA frame with %d bytes of open data - connection opened\n", conn->openDataSize);
+        return TRUE;
+    }
+    else if (byte == FLAG)
+        conn->handshakeState = 1;
+    else if (conn->uaFieldSize < (int)sizeof(conn->uaField))
+        conn->uaField[conn->uaFieldSize++] = byte;
+    else
+        conn->handshakeState = 0;
+    return FALSE;
+}
 
-        if (!STOP)
+// Matches the DISC the receiver answers with.
+static int matchDiscReply(unsigned char byte)
+{
+    return matchFrame(byte, ADDRESS_RT, CONTROL_DISC);
+}
+
+// Transmitter: send the command "control" (SET or DISC) and wait one RTO for
+// the answer recognised by "matchAnswer", up to the retransmission limit.
+// With "backoff", the RTO doubles after each attempt but the first.
+// Return 0 once answered, -1 if it never is or on error, or LL_WOULDBLOCK
+// if "block" is FALSE and that would mean waiting.
+static int exchangeFrame(unsigned char control, const char *name, int (*matchAnswer)(unsigned char),
+                         int backoff, int block)
+{
+    while (TRUE)
+    {
+        if (!conn->handshakeWaiting)
         {
-            printf("Failed to receive UA, closing\n");
-            closeSerialPort();
+            if (conn->handshakeAttempts >= conn->retransmissions)
+                return -1;
+            logInfo("Sending %s frame (attempt %d)\n", name, conn->handshakeAttempts + 1);
+            unsigned char frame[5] = {FLAG, ADDRESS_TR, control, ADDRESS_TR ^ control, FLAG};
+            serialWrite(&conn->port, frame, 5);
+            if (backoff && conn->handshakeAttempts > 0)
+                backoffRto();
+            startTimer();
+            conn->handshakeAttempts++;
+            conn->handshakeWaiting = TRUE;
+            conn->handshakeState = 0;
+        }
+
+        unsigned char byte;
+        LinkEvent event = nextEvent(block, &byte);
+        if (event == EVENT_NONE)
+            return LL_WOULDBLOCK;
+        if (event == EVENT_ERROR)
             return -1;
+        if (event == EVENT_TIMER)
+        {
+            conn->handshakeWaiting = FALSE;
+            continue;
+        }
+        logTrace("Byte received = 0x%02X\n", byte);
+        if (matchAnswer(byte))
+        {
+            conn->handshakeWaiting = FALSE;
+            return 0;
         }
+    }
+}
 
-        printf("Connection established successfully as the transmitter\n\n");
-        return fd;
+// Receiver: wait for the command "control" (SET or DISC) from the transmitter.
+// Return 0 once it arrives, 1 if the timer fires first, -1 on error, or
+// LL_WOULDBLOCK if "block" is FALSE and that would mean waiting.
+static int awaitFrame(unsigned char control, int block)
+{
+    while (TRUE)
+    {
+        unsigned char byte;
+        LinkEvent event = nextEvent(block, &byte);
+        if (event == EVENT_NONE)
+            return LL_WOULDBLOCK;
+        if (event == EVENT_ERROR)
+            return -1;
+        if (event == EVENT_TIMER)
+            return 1;
+        logTrace("Byte received = 0x%02X\n", byte);
+        if (matchFrame(byte, ADDRESS_TR, control))
+            return 0;
+    }
+}
+
+// Open the port of the current connection and set it up with "options"
+// (already checked), ready for the SET/UA exchange.
+// Return the port's file descriptor or -1 on error.
+static int setupLink(LinkLayer connectionParameters, const LinkOptions *options)
+{
+    int fd = serialOpen(&conn->port, connectionParameters.serialPort, connectionParameters.baudRate);
+    if (fd < 0)
+    {
+        logError("ERROR: Cannot open serial port %s\n", connectionParameters.serialPort);
+        return -1;
+    }
+
+    conn->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (conn->timerFd < 0)
+    {
+        perror("timerfd_create");
+        serialClose(&conn->port);
+        return -1;
+    }
+
+    applyOptions(options);
+    conn->role = connectionParameters.role;
+    conn->retransmissions = connectionParameters.nRetransmissions;
+    conn->timeout = connectionParameters.timeout;
+    conn->discReceived = 0;
+
+    // Reset sliding window state and the RTT estimator
+    conn->rto = conn->timeout;
+    conn->srtt = conn->rttvar = 0;
+    conn->rttSamples = 0;
+    conn->fecLevel = conn->fecFramesAtLevel = conn->fecLevelChanges = 0;
+    conn->fecErrorRate = 0;
+    conn->byteTime = 10.0 / connectionParameters.baudRate;
+    conn->lineFreeAt = 0;
+    conn->openedAt = monotonicNow();
+    memset(&conn->linkStats, 0, sizeof(conn->linkStats));
+    conn->baudRate = connectionParameters.baudRate;
+    conn->payloadSize = INITIAL_PAYLOAD_SIZE;
+    conn->payloadOutcomes = 0;
+    conn->outcomeFrames = conn->outcomeFailures = conn->avgFrameBytes = conn->avgPayloadBytes = 0;
+    conn->payloadTimeline[0] = (PayloadChange){0, 0, conn->payloadSize};
+    conn->payloadChanges = 1;
+    conn->tramaTx = conn->txBase = conn->tramaRx = 0;
+    conn->txAttempts = 0;
+    conn->rejSent = FALSE;
+    conn->ackState = START;
+    memset(conn->rxBuffered, 0, sizeof(conn->rxBuffered));
+    memset(conn->srejSent, 0, sizeof(conn->srejSent));
+    conn->rxState = START;
+    conn->rxDataIndex = 0;
+    conn->rxActivity = conn->rxActivitySeen = 0;
+    conn->rxIdleArmed = conn->peerLost = FALSE;
+    conn->openDataSize = conn->role == LlRx ? options->openDataSize : 0;
+    if (conn->openDataSize > 0)
+        memcpy(conn->openData, options->openData, options->openDataSize);
+
+    conn->opened = FALSE;
+    conn->closePhase = CLOSE_START;
+    conn->handshakeState = conn->handshakeAttempts = 0;
+    conn->handshakeWaiting = FALSE;
+
+    if (conn->role == LlRx)
+        logInfo("Waiting for SET frame...\n");
+    return fd;
+}
+
+// Carry on the SET/UA exchange of the current connection.
+// Return 0 once it is open, -1 on error (the port is then closed), or
+// LL_WOULDBLOCK if "block" is FALSE and that would mean waiting.
+static int openHandshake(int block)
+{
+    int status;
+
+    // ---------- TRANSMITTER ----------
+    if (conn->role == LlTx)
+    {
+        status = exchangeFrame(CONTROL_SET, "SET", matchUa, FALSE, block);
+        if (status == LL_WOULDBLOCK)
+            return status;
+        stopTimer();
+        if (status < 0)
+        {
+            logError("ERROR: Failed to receive UA, closing\n");
+            releasePort();
+            return -1;
+        }
+        logInfo("Connection established successfully as the transmitter\n\n");
     }
     // ---------- RECEIVER ----------
     else
     {
-        printf("Waiting for SET frame...\n");
-        while (!STOP)
+        // The timer is not armed yet: wait as long as it takes
+        do
+            status = awaitFrame(CONTROL_SET, block);
+        while (status == 1);
+        if (status == LL_WOULDBLOCK)
+            return status;
+        if (status < 0)
         {
-            unsigned char byte;
-            if (readByteSerialPort(&byte) <= 0)
-                continue;
-            printf("Byte received = 0x%02X\n", byte);
-            switch (state)
+            logError("ERROR: Serial port failed while waiting for SET\n");
+            releasePort();
+            return -1;
+        }
+        logInfo("Received SET frame - sending UA response\n");
+        sendUa();
+        logInfo("Connection opened successfully as the receiver\n\n");
+    }
+
+    conn->opened = TRUE;
+    return 0;
+}
+
+int llopen(LinkLayer connectionParameters)
+{
+    conn = &defaultConnection;
+    int fd = setupLink(connectionParameters, &defaultOptions);
+    if (fd < 0 || openHandshake(TRUE) < 0)
+        return -1;
+    return fd;
+}
+
+LinkConnection *llopenh(LinkLayer connectionParameters, const LinkOptions *options)
+{
+    if (checkOptions(options) < 0)
+        return NULL;
+
+    LinkConnection *connection = calloc(1, sizeof(LinkConnection));
+    if (connection == NULL)
+    {
+        perror("calloc");
+        return NULL;
+    }
+    connection->port.fd = connection->timerFd = -1;
+
+    conn = connection;
+    if (setupLink(connectionParameters, options) < 0 || (!options->nonBlocking && openHandshake(TRUE) < 0))
+    {
+        free(connection);
+        return NULL;
+    }
+    return connection;
+}
+
+int llconnecth(LinkConnection *connection)
+{
+    conn = connection;
+    if (conn->opened)
+        return 0;
+    if (conn->port.fd < 0)
+        return -1;
+    return openHandshake(!conn->linkOptions.nonBlocking);
+}
+
+void llpollfds(const LinkConnection *connection, struct pollfd fds[2])
+{
+    fds[0] = (struct pollfd){.fd = connection->port.fd, .events = POLLIN};
+    fds[1] = (struct pollfd){.fd = connection->timerFd, .events = POLLIN};
+}
+
+int llopendatah(const LinkConnection *connection, unsigned char *data)
+{
+    memcpy(data, connection->openData, connection->openDataSize);
+    return connection->openDataSize;
+}
+
+int llopendata(unsigned char *data)
+{
+    return llopendatah(&defaultConnection, data);
+}
+
+////////////////////////////////////////////////
+// LLWRITE
+////////////////////////////////////////////////
+
+// Number of frames sent and not yet acknowledged.
+static int outstandingFrames()
+{
+    return seqDistance(conn->txBase, conn->tramaTx);
+}
+
+// Build I frame "ns" in the retransmission buffer from its payload.
+// Return the number of bytes added by byte stuffing.
+static int buildFrame(int ns, const unsigned char *buf, int bufSize)
+{
+    unsigned char *frame = conn->txFrames[ns];
+    int frameSize = 0;
+
+    // Header
+    frame[frameSize++] = FLAG;
+    frame[frameSize++] = ADDRESS_TR;
+    frame[frameSize++] = controlI(ns);
+    frame[frameSize++] = frame[1] ^ frame[2];
+
+    // Compute BCC2 (frame check sequence) while the payload is cache-hot
+    unsigned char fcs[MAX_FCS_SIZE];
+    int fcsLength = computeFcs(buf, bufSize, fcs);
+
+    // Byte stuffing, then BCC2 (both inside the FEC block when enabled)
+    int fieldSize;
+    if (conn->linkOptions.fecMode == FecOff)
+    {
+        fieldSize = bufSize + fcsLength;
+        frameSize += stuffBytes(buf, bufSize, frame + frameSize);
+        frameSize += stuffBytes(fcs, fcsLength, frame + frameSize);
+    }
+    else
+    {
+        unsigned char field[MAX_PACKET_SIZE];
+        fieldSize = encodeDataField(buf, bufSize, fcs, fcsLength, field);
+        frameSize += stuffBytes(field, fieldSize, frame + frameSize);
+    }
+    int stuffed = frameSize - 4 - fieldSize;
+    frame[frameSize++] = FLAG;
+    conn->txFrameSizes[ns] = frameSize;
+    conn->txFrameLevels[ns] = conn->fecLevel;
+    return stuffed;
+}
+
+// Re-encode a buffered frame if the FEC level changed since it was built.
+static void refreshFrame(int ns)
+{
+    if (conn->linkOptions.fecMode != FecOff && conn->txFrameLevels[ns] != conn->fecLevel)
+        buildFrame(ns, conn->txPayloads[ns], conn->txPayloadSizes[ns]);
+}
+
+// Resend a single outstanding frame from the retransmission buffer
+// (Selective Repeat).
+static void retransmitFrame(int ns)
+{
+    refreshFrame(ns);
+    logDebug("Sending I frame (Ns=%d), attempt %d\n", ns, conn->txAttempts + 1);
+    serialWrite(&conn->port, conn->txFrames[ns], conn->txFrameSizes[ns]);
+    noteSent(ns);
+    conn->txRetransmitted[ns] = TRUE;
+    conn->linkStats.retransmissions++;
+    conn->linkStats.lineBytes += conn->txFrameSizes[ns];
+    startTimer();
+}
+
+// Resend every outstanding frame, oldest first, in a single write.
+static void retransmitWindow()
+{
+    struct iovec frames[SEQ_MODULUS_EXT];
+    int count = 0;
+    for (int ns = conn->txBase; ns != conn->tramaTx; ns = (ns + 1) % conn->seqModulus)
+    {
+        logDebug("Sending I frame (Ns=%d), attempt %d\n", ns, conn->txAttempts + 1);
+        refreshFrame(ns);
+        frames[count].iov_base = conn->txFrames[ns];
+        frames[count].iov_len = conn->txFrameSizes[ns];
+        conn->txRetransmitted[ns] = TRUE;
+        conn->linkStats.retransmissions++;
+        conn->linkStats.lineBytes += conn->txFrameSizes[ns];
+        count++;
+    }
+    serialWriteBuffers(&conn->port, frames, count);
+    for (int ns = conn->txBase; ns != conn->tramaTx; ns = (ns + 1) % conn->seqModulus)
+        noteSent(ns);
+    startTimer();
+}
+
+// Feed one byte to the acknowledgment parser.
+// Return TRUE with the control field in "cField" once a full RR/REJ/SREJ
+// frame has been parsed.
+static int parseAckByte(unsigned char byte, unsigned char *cField)
+{
+    int nr;
+
+    switch (conn->ackState)
+    {
+    case START:
+        if (byte == FLAG)
+            conn->ackState = FLAG_RCV;
+        break;
+    case FLAG_RCV:
+        if (byte == ADDRESS_RT)
+            conn->ackState = A_RCV;
+        else if (byte != FLAG)
+            conn->ackState = START;
+        break;
+    case A_RCV:
+        if (parseSupervision(byte, &nr) != S_NONE)
+        {
+            conn->ackField = byte;
+            conn->ackState = C_RCV;
+        }
+        else
+            conn->ackState = byte == FLAG ? FLAG_RCV : START;
+        break;
+    case C_RCV:
+        if (byte == (ADDRESS_RT ^ conn->ackField))
+            conn->ackState = BCC1_OK;
+        else
+            conn->ackState = byte == FLAG ? FLAG_RCV : START;
+        break;
+    case BCC1_OK:
+        if (byte == FLAG)
+        {
+            conn->ackState = FLAG_RCV;
+            *cField = conn->ackField;
+            return TRUE;
+        }
+        conn->ackState = START;
+        break;
+    default:
+        conn->ackState = START;
+        break;
+    }
+    return FALSE;
+}
+
+// Feed frame outcomes to the FEC and payload size controllers: "acked"
+// frames got through, "failed" is TRUE if frame "ns" was rejected or timed out.
+static void recordOutcome(int acked, int failed, int ns)
+{
+    updateFecLevel(acked, failed, ns);
+    updatePayloadSize(acked, failed);
+}
+
+// Apply an RR/REJ/SREJ to the transmitter window. RR is cumulative; REJ also
+// acknowledges everything before Nr and rewinds the window to Nr; SREJ asks
+// for frame Nr alone.
+static void handleSupervision(unsigned char cField)
+{
+    int nr;
+    SupervisionType type = parseSupervision(cField, &nr);
+    int acked = seqDistance(conn->txBase, nr);
+    int outstanding = outstandingFrames();
+
+    if (type == S_SREJ)
+    {
+        if (acked < outstanding)
+        {
+            logDebug("Received SREJ%d - retransmitting that frame\n", nr);
+            conn->linkStats.rejReceived++;
+            recordOutcome(0, TRUE, nr);
+            retransmitFrame(nr);
+
+            // The frames after the gap are only acknowledged once it is
+            // filled: they wait as long as the frame just resent
+            for (int ns = conn->txBase; ns != conn->tramaTx; ns = (ns + 1) % conn->seqModulus)
             {
-            case 0:
-                if (byte == FLAG)
-                    state = 1;
-                break;
-            case 1:
-                if (byte == ADDRESS_TR)
-                    state = 2;
-                else
-                    state = 0;
-                break;
-            case 2:
-                if (byte == CONTROL_SET)
-                    state = 3;
-                else
-                    state = 0;
-                break;
-            case 3:
-                if (byte == (ADDRESS_TR ^ CONTROL_SET))
-                    state = 4;
-                else
-                    state = 0;
-                break;
-            case 4:
-                if (byte == FLAG)
-                {
-                    printf("Received SET frame - sending UA response\n");
-                    STOP = 1;
-                }
-                else
-                    state = 0;
-                break;
+                if (conn->txDeadline[ns] < conn->txDeadline[nr])
+                    conn->txDeadline[ns] = conn->txDeadline[nr];
             }
+            startTimer();
         }
+        return;
+    }
 
-        // Send UA back
-        buf[0] = FLAG;
-        buf[1] = ADDRESS_RT;
-        buf[2] = CONTROL_UA;
-        buf[3] = buf[1] ^ buf[2];
-        buf[4] = FLAG;
-        writeBytesSerialPort(buf, 5);
-        printf("Connection opened successfully as the receiver\n\n");
-        return fd;
+    if (acked > outstanding)
+        return; // Stale or out-of-window acknowledgment
+
+    if (acked > 0)
+    {
+        // RTT sample from the newest frame covered by this acknowledgment
+        int newest = (nr + conn->seqModulus - 1) % conn->seqModulus;
+        if (!conn->txRetransmitted[newest])
+        {
+            double rtt = monotonicNow() - conn->txDueAt[newest];
+            sampleRtt(rtt > 0 ? rtt : 0);
+        }
+
+        conn->txBase = nr;
+        conn->txAttempts = 0;
+        recordOutcome(acked, FALSE, nr);
+        if (outstandingFrames() > 0)
+            startTimer();
+        else
+            stopTimer();
+    }
+
+    if (type == S_RR)
+    {
+        if (acked > 0)
+            logDebug("Received RR%d - frame accepted\n", nr);
+    }
+    else if (outstandingFrames() > 0)
+    {
+        logDebug("Received REJ%d - retransmitting\n", nr);
+        conn->linkStats.rejReceived++;
+        recordOutcome(0, TRUE, nr);
+        retransmitWindow();
+    }
+}
+
+// Selective Repeat timeout: resend every frame whose own deadline has
+// passed, so frames lost at the tail of the window, which no SREJ will
+// report, do not each wait for a later timeout. The RTO backs off once per
+// round, when a frame times out more often than any did before.
+// Return 0 on success or -1 once a frame exhausts the retransmission limit.
+static int handleSelectiveTimeout()
+{
+    double now = monotonicNow();
+    int expired[SEQ_MODULUS_EXT];
+    int count = 0, attempts = 0;
+    for (int ns = conn->txBase; ns != conn->tramaTx; ns = (ns + 1) % conn->seqModulus)
+    {
+        if (conn->txDeadline[ns] > now)
+            continue;
+        expired[count++] = ns;
+        if (++conn->txTimeouts[ns] > attempts)
+            attempts = conn->txTimeouts[ns];
+    }
+    if (count == 0)
+    {
+        startTimer(); // Early: a deadline moved since the timer was armed
+        return 0;
+    }
+
+    conn->linkStats.timeouts++;
+    if (attempts > conn->txAttempts)
+    {
+        conn->txAttempts = attempts;
+        backoffRto();
+    }
+    logInfo("Timeout - retrying %d frame(s) (%d/%d), RTO now %.3f s\n", count, attempts,
+            conn->retransmissions, conn->rto);
+    if (attempts >= conn->retransmissions)
+    {
+        logError("ERROR: Transmission failed after %d attempts\n", conn->retransmissions);
+        return -1;
+    }
+
+    // Later frames of the window may already sit in the receiver's reorder
+    // buffer: only the expired ones go again
+    for (int i = 0; i < count; i++)
+    {
+        recordOutcome(0, TRUE, expired[i]);
+        retransmitFrame(expired[i]);
+    }
+    return 0;
+}
+
+// The retransmission timer expired: resend and count the attempt.
+// Return 0 on success or -1 once the retransmission limit is exhausted.
+static int handleTimeout()
+{
+    if (outstandingFrames() == 0)
+        return 0;
+    if (conn->linkOptions.arqMode == ArqSelectiveRepeat)
+        return handleSelectiveTimeout();
+
+    conn->txAttempts++;
+    conn->linkStats.timeouts++;
+    backoffRto();
+    recordOutcome(0, TRUE, conn->txBase);
+    logInfo("Timeout - retrying (%d/%d), RTO now %.3f s\n", conn->txAttempts, conn->retransmissions, conn->rto);
+    if (conn->txAttempts >= conn->retransmissions)
+    {
+        logError("ERROR: Transmission failed after %d attempts\n", conn->retransmissions);
+        return -1;
     }
+
+    retransmitWindow();
+    return 0;
 }
 
-////////////////////////////////////////////////
-// LLWRITE
-////////////////////////////////////////////////
-int llwrite(const unsigned char *buf, int bufSize)
+// Handle one transmitter-side event (acknowledgment byte or timeout).
+// Return 0 on success or -1 if the link failed.
+static int handleTxEvent(LinkEvent event, unsigned char byte)
 {
-    if (connection_fd < 0)
+    unsigned char cField;
+
+    if (event == EVENT_ERROR)
         return -1;
+    if (event == EVENT_TIMER)
+        return handleTimeout();
+    if (event == EVENT_BYTE && parseAckByte(byte, &cField))
+        handleSupervision(cField);
+    return 0;
+}
 
-    unsigned char frame[MAX_PACKET_SIZE * 2];
-    int frameSize = 0;
+// Process events until at most "target" frames remain outstanding.
+// Return 0 on success, -1 once the retransmission limit is exhausted, or
+// LL_WOULDBLOCK if "block" is FALSE and that would mean waiting.
+static int drainWindow(int target, int block)
+{
+    if (conn->txAttempts >= conn->retransmissions)
+        return -1;
 
-    // Header
-    frame[frameSize++] = FLAG;
-    frame[frameSize++] = ADDRESS_TR;
-    frame[frameSize++] = C_N(tramaTx);
-    frame[frameSize++] = frame[1] ^ frame[2];
+    while (outstandingFrames() > target)
+    {
+        unsigned char byte = 0;
+        LinkEvent event = nextEvent(block, &byte);
+        if (event == EVENT_NONE)
+            return LL_WOULDBLOCK;
+        if (handleTxEvent(event, byte) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// llwrite on the current connection.
+static int writeLink(const unsigned char *buf, int bufSize)
+{
+    if (conn->port.fd < 0 || !conn->opened || bufSize <= 0 || bufSize > MAX_PAYLOAD_SIZE)
+        return -1;
 
-    // Compute BCC2
-    unsigned char BCC2 = buf[0];
-    for (int i = 1; i < bufSize; i++)
-        BCC2 ^= buf[i];
+    // Wait for room in the window
+    int block = !conn->linkOptions.nonBlocking;
+    int status = drainWindow(conn->linkOptions.windowSize - 1, block);
+    if (status < 0)
+        return status;
 
-    // Byte stuffing
-    for (int i = 0; i < bufSize; i++)
+    conn->linkStats.stuffedBytes += buildFrame(conn->tramaTx, buf, bufSize);
+    if (conn->linkOptions.fecMode != FecOff)
     {
-        if (buf[i] == FLAG || buf[i] == ESC)
-        {
-            frame[frameSize++] = ESC;
-            frame[frameSize++] = buf[i] ^ 0x20;
-        }
-        else
-        {
-            frame[frameSize++] = buf[i];
-        }
+        memcpy(conn->txPayloads[conn->tramaTx], buf, bufSize);
+        conn->txPayloadSizes[conn->tramaTx] = bufSize;
     }
 
-    // Add BCC2
-    if (BCC2 == FLAG || BCC2 == ESC)
+    logDebug("Sending I frame (Ns=%d), attempt 1\n", conn->tramaTx);
+    serialWrite(&conn->port, conn->txFrames[conn->tramaTx], conn->txFrameSizes[conn->tramaTx]);
+
+    // Smoothed frame and payload sizes for the payload size model
+    if (conn->linkStats.framesSent++ == 0)
     {
-        frame[frameSize++] = ESC;
-        frame[frameSize++] = BCC2 ^ 0x20;
+        conn->avgFrameBytes = conn->txFrameSizes[conn->tramaTx];
+        conn->avgPayloadBytes = bufSize;
     }
     else
     {
-        frame[frameSize++] = BCC2;
+        conn->avgFrameBytes += (conn->txFrameSizes[conn->tramaTx] - conn->avgFrameBytes) / 8;
+        conn->avgPayloadBytes += (bufSize - conn->avgPayloadBytes) / 8;
     }
-    frame[frameSize++] = FLAG;
-
-    int attempts = 0, ackReceived = FALSE;
-
-    // Send frame and wait for RR/REJ
-    while (attempts < retransmissions && !ackReceived)
+    noteSent(conn->tramaTx);
+    conn->txRetransmitted[conn->tramaTx] = FALSE;
+    conn->txTimeouts[conn->tramaTx] = 0;
+    conn->linkStats.payloadBytes += bufSize;
+    conn->linkStats.lineBytes += conn->txFrameSizes[conn->tramaTx];
+    int first = outstandingFrames() == 0;
+    conn->tramaTx = (conn->tramaTx + 1) % conn->seqModulus;
+    if (first)
     {
-        printf("Sending I frame (Ns=%d), attempt %d\n", tramaTx, attempts + 1);
-        writeBytesSerialPort(frame, frameSize);
+        conn->txAttempts = 0;
+        startTimer();
+    }
 
-        struct timeval start, now;
-        gettimeofday(&start, NULL);
+    // Stop-and-wait keeps its synchronous semantics unless non-blocking;
+    // otherwise only pick up acknowledgments that have already arrived
+    if (conn->linkOptions.arqMode == ArqStopAndWait && block)
+    {
+        if (drainWindow(0, TRUE) < 0)
+            return -1;
+    }
+    else
+    {
+        LinkEvent event;
+        unsigned char byte = 0;
+        while ((event = nextEvent(FALSE, &byte)) != EVENT_NONE)
+        {
+            if (handleTxEvent(event, byte) < 0)
+                return -1;
+        }
+    }
 
-        LinkLayerState state = START;
-        unsigned char byte = 0, cField = 0;
+    return bufSize;
+}
 
-        while (!ackReceived)
-        {
-            gettimeofday(&now, NULL);
-            double elapsed = (now.tv_sec - start.tv_sec) + (now.tv_usec - start.tv_usec) / 1e6;
-            if (elapsed > timeout)
-                break;
+int llwrite(const unsigned char *buf, int bufSize)
+{
+    conn = &defaultConnection;
+    return writeLink(buf, bufSize);
+}
 
-            if (readByteSerialPort(&byte) <= 0)
-            {
-                usleep(100);
-                continue;
-            }
-            
-            // Parse acknowledgment frame
-            switch (state)
-            {
-            case START:
-                if (byte == FLAG)
-                    state = FLAG_RCV;
-                else
-                    state = START;
-                break;
-            case FLAG_RCV:
-                if (byte == ADDRESS_RT)
-                    state = A_RCV;
-                else
-                    state = START;
-                break;
-            case A_RCV:
-                if (byte == C_RR(0) || byte == C_RR(1) ||
-                    byte == C_REJ(0) || byte == C_REJ(1))
-                {
-                    cField = byte;
-                    state = C_RCV;
-                }
-                else
-                {
-                    state = START;
-                }
-                break;
-            case C_RCV:
-                if (byte == (ADDRESS_RT ^ cField))
-                    state = BCC1_OK;
-                else
-                    state = START;
-                break;
-            case BCC1_OK:
-                if (byte == FLAG)
-                {
-                    if (cField == C_RR((tramaTx + 1) % 2))
-                    {
-                        printf("Received RR%d - frame accepted\n", (tramaTx + 1) % 2);
-                        tramaTx = (tramaTx + 1) % 2;
-                        ackReceived = TRUE;
-                    }
-                    else if (cField == C_REJ(tramaTx))
-                    {
-                        printf("Received REJ%d - retransmitting\n", tramaTx);
-                    }
-                }
-                else
-                    state = START;
-                break;
+int llwriteh(LinkConnection *connection, const unsigned char *buf, int bufSize)
+{
+    conn = connection;
+    return writeLink(buf, bufSize);
+}
 
-            default:
-                state = START;
-                break;
-            }
-        }
+int llflushh(LinkConnection *connection)
+{
+    conn = connection;
+    return drainWindow(0, !conn->linkOptions.nonBlocking);
+}
 
-        if (!ackReceived)
-        {
-            attempts++;
-            printf("Timeout or REJ - retrying (%d/%d)\n", attempts, retransmissions);
-        }
-    }
+////////////////////////////////////////////////
+// LLREAD
+////////////////////////////////////////////////
+// Seconds without a byte after which the receiver stops waiting: longer than
+// the transmitter keeps retrying before it gives up.
+static double idleLimit()
+{
+    return (conn->retransmissions + 1) * (double)conn->timeout;
+}
 
-    if (!ackReceived)
+// The idle timer fired: re-arm it if bytes arrived since it was armed.
+// Return 0 if so, or -1 if the transmitter has gone quiet.
+static int checkActivity()
+{
+    if (conn->rxActivity == conn->rxActivitySeen)
     {
-        printf("ERROR: Transmission failed after %d attempts\n", retransmissions);
+        logError("ERROR: Nothing received for %.0f s - the transmitter is gone\n", idleLimit());
+        conn->peerLost = TRUE;
         return -1;
     }
-
-    return bufSize;
+    conn->rxActivitySeen = conn->rxActivity;
+    setTimer(idleLimit());
+    return 0;
 }
 
-////////////////////////////////////////////////
-// LLREAD
-////////////////////////////////////////////////
-int llread(unsigned char *packet)
+// llread on the current connection.
+static int readLink(unsigned char *packet)
 {
-    if (connection_fd < 0)
+    if (conn->port.fd < 0 || !conn->opened || conn->peerLost)
         return -1;
+    if (!conn->rxIdleArmed)
+    {
+        conn->rxIdleArmed = TRUE;
+        conn->rxActivitySeen = conn->rxActivity;
+        setTimer(idleLimit());
+    }
 
-    LinkLayerState state = START;
-    unsigned char byte = 0, cField = 0;
-    unsigned char data[MAX_PACKET_SIZE];
-    int dataIndex = 0;
+    // Deliver frames already waiting in the reorder buffer, in order
+    if (conn->rxBuffered[conn->tramaRx])
+    {
+        int packetSize = conn->rxFrameSizes[conn->tramaRx];
+        memcpy(packet, conn->rxFrames[conn->tramaRx], packetSize);
+        conn->rxBuffered[conn->tramaRx] = FALSE;
+        conn->tramaRx = (conn->tramaRx + 1) % conn->seqModulus;
+        conn->linkStats.framesReceived++;
+        conn->linkStats.payloadBytes += packetSize;
+        return packetSize;
+    }
+
+    unsigned char byte = 0;
+    int block = !conn->linkOptions.nonBlocking;
 
     // Receive and parse I frame
     while (1)
     {
-        if (readByteSerialPort(&byte) <= 0)
+        // Destuff buffered data in bulk up to the next flag
+        if ((conn->rxState == READING_DATA || conn->rxState == DATA_FOUND_ESC) && serialPending(&conn->port) > 0)
+        {
+            int count;
+            const unsigned char *bytes = serialPeek(&conn->port, &count);
+            const unsigned char *flag = memchr(bytes, FLAG, count);
+            int run = flag != NULL ? flag - bytes : count;
+            if (run > MAX_PACKET_SIZE - conn->rxDataIndex)
+                run = MAX_PACKET_SIZE - conn->rxDataIndex; // Overflow is handled byte by byte
+            if (run > 0)
+            {
+                int escaped = conn->rxState == DATA_FOUND_ESC;
+                int destuffed = destuffBytes(bytes, run, conn->rxData + conn->rxDataIndex, &escaped);
+                conn->rxDataIndex += destuffed;
+                conn->linkStats.stuffedBytes += run - destuffed;
+                serialConsume(&conn->port, run);
+                conn->rxState = escaped ? DATA_FOUND_ESC : READING_DATA;
+                conn->rxActivity += run;
+                continue;
+            }
+        }
+
+        LinkEvent event = nextEvent(block, &byte);
+        if (event == EVENT_ERROR)
+            return -1;
+        if (event == EVENT_NONE)
+            return LL_WOULDBLOCK;
+        if (event == EVENT_TIMER && checkActivity() < 0)
+            return -1;
+        if (event != EVENT_BYTE)
             continue;
+        conn->rxActivity++;
 
-        switch (state)
+        switch (conn->rxState)
         {
         case START:
             if (byte == FLAG)
-                state = FLAG_RCV;
+                conn->rxState = FLAG_RCV;
             break;
         case FLAG_RCV:
             if (byte == ADDRESS_TR)
-                state = A_RCV;
+                conn->rxState = A_RCV;
             else if (byte != FLAG)
-                state = START;
+                conn->rxState = START;
             break;
         case A_RCV:
-            if (byte == C_N(0) || byte == C_N(1))
+            if (parseI(byte) >= 0)
             {
-                cField = byte;
-                state = C_RCV;
+                conn->rxControl = byte;
+                conn->rxState = C_RCV;
             }
             else if (byte == CONTROL_DISC)
             {
-                printf("Received DISC - closing link\n");
-                discReceived = 1;
+                logInfo("Received DISC - closing link\n");
+                conn->discReceived = 1;
+                conn->rxState = START;
                 return 0;
             }
+            else if (byte == CONTROL_SET)
+            {
+                // Our UA was lost: the transmitter is still opening
+                logInfo("Received SET again - resending UA\n");
+                sendUa();
+                conn->rxState = START;
+            }
             else
-                state = START;
+                conn->rxState = byte == FLAG ? FLAG_RCV : START;
             break;
         case C_RCV:
-            if (byte == (ADDRESS_TR ^ cField))
-                state = READING_DATA;
+            if (byte == (ADDRESS_TR ^ conn->rxControl))
+            {
+                conn->rxState = READING_DATA;
+                conn->rxDataIndex = 0;
+            }
             else
-                state = START;
+                conn->rxState = byte == FLAG ? FLAG_RCV : START;
             break;
         case READING_DATA:
             if (byte == ESC)
             {
-                state = DATA_FOUND_ESC;
+                conn->rxState = DATA_FOUND_ESC;
             }
             else if (byte == FLAG)
             {
-                if (dataIndex < 1)
+                // Correct the data field first; a failure counts as a BCC2 error
+                int fecOk = TRUE;
+                if (conn->linkOptions.fecMode != FecOff)
+                {
+                    int length = decodeDataField(conn->rxData, conn->rxDataIndex);
+                    fecOk = length >= 0;
+                    if (fecOk)
+                        conn->rxDataIndex = length;
+                }
+
+                int fcsLength = fcsSize();
+                int packetSize = conn->rxDataIndex - fcsLength;
+                if (packetSize < 1 && fecOk)
+                {
+                    conn->rxState = FLAG_RCV;
+                    break;
+                }
+
+                // Check BCC2 (frame check sequence). A payload longer than
+                // MAX_PAYLOAD_SIZE cannot be a valid frame (e.g. two frames
+                // merged by a corrupted flag) and fails like a BCC2 error
+                int fcsOk = FALSE;
+                if (fecOk && packetSize <= MAX_PAYLOAD_SIZE)
+                {
+                    unsigned char fcs[MAX_FCS_SIZE];
+                    computeFcs(conn->rxData, packetSize, fcs);
+                    fcsOk = memcmp(fcs, conn->rxData + packetSize, fcsLength) == 0;
+                }
+
+                int ns = parseI(conn->rxControl);
+                conn->rxState = FLAG_RCV;
+
+                int selective = conn->linkOptions.arqMode == ArqSelectiveRepeat;
+                int ahead = seqDistance(conn->tramaRx, ns) < conn->linkOptions.windowSize;
+                if (!fcsOk)
+                    conn->linkStats.frameErrors++;
+
+                // BCC2 error → ask for that frame alone (Selective Repeat).
+                // Repeated on every corrupt copy: each one answers the last SREJ
+                if (!fcsOk && selective)
+                {
+                    if (ahead && !conn->rxBuffered[ns])
+                    {
+                        logDebug("BCC2 error - sending SREJ%d\n", ns);
+                        sendSupervision(C_SREJX(ns));
+                        conn->linkStats.rejSent++;
+                        conn->srejSent[ns] = TRUE;
+                    }
+                    break;
+                }
+
+                // BCC2 error → send REJ (once per gap in windowed modes)
+                if (!fcsOk)
                 {
-                    state = START;
-                    dataIndex = 0;
+                    if (!conn->rejSent)
+                    {
+                        logDebug("BCC2 error - sending REJ%d\n", conn->tramaRx);
+                        sendSupervision(controlREJ(conn->tramaRx));
+                        conn->linkStats.rejSent++;
+                        conn->rejSent = conn->linkOptions.arqMode != ArqStopAndWait;
+                    }
                     break;
                 }
-                
-                // Check BCC2
-                unsigned char receivedBCC2 = data[dataIndex - 1];
-                unsigned char computedBCC2 = data[0];
-                for (int i = 1; i < dataIndex - 1; i++)
-                    computedBCC2 ^= data[i];
-
-                // Valid data
-                if (computedBCC2 == receivedBCC2)
+
+                // Valid data, in sequence
+                if (ns == conn->tramaRx)
                 {
-                    memcpy(packet, data, dataIndex - 1);
-                    int packetSize = dataIndex - 1;
-                    int ns = (cField >> 6) & 0x01;
-                    int expectedNext = (ns + 1) % 2;
-
-                    unsigned char rrFrame[5] = {
-                        FLAG, ADDRESS_RT,
-                        C_RR(expectedNext),
-                        ADDRESS_RT ^ C_RR(expectedNext),
-                        FLAG};
-                    writeBytesSerialPort(rrFrame, 5);
-                    printf("Sent RR%d acknowledgment\n", expectedNext);
-                    tramaRx = expectedNext;
+                    memcpy(packet, conn->rxData, packetSize);
+                    conn->tramaRx = (conn->tramaRx + 1) % conn->seqModulus;
+                    conn->rejSent = FALSE;
+                    conn->srejSent[ns] = FALSE;
+
+                    // Frames already in the reorder buffer are acknowledged too
+                    int nr = conn->tramaRx;
+                    while (conn->rxBuffered[nr])
+                        nr = (nr + 1) % conn->seqModulus;
+                    sendSupervision(controlRR(nr));
+                    logDebug("Sent RR%d acknowledgment\n", nr);
+                    conn->linkStats.framesReceived++;
+                    conn->linkStats.payloadBytes += packetSize;
                     return packetSize;
                 }
-                // BCC2 error → send REJ
+
+                // Frame after a gap → keep it and ask for each missing one
+                if (selective && ahead)
+                {
+                    if (!conn->rxBuffered[ns])
+                    {
+                        logDebug("Out of sequence I frame (Ns=%d) - buffered\n", ns);
+                        memcpy(conn->rxFrames[ns], conn->rxData, packetSize);
+                        conn->rxFrameSizes[ns] = packetSize;
+                        conn->rxBuffered[ns] = TRUE;
+                        conn->srejSent[ns] = FALSE;
+                    }
+                    for (int missing = conn->tramaRx; missing != ns; missing = (missing + 1) % conn->seqModulus)
+                    {
+                        if (!conn->rxBuffered[missing] && !conn->srejSent[missing])
+                        {
+                            logDebug("Sending SREJ%d\n", missing);
+                            sendSupervision(C_SREJX(missing));
+                            conn->linkStats.rejSent++;
+                            conn->srejSent[missing] = TRUE;
+                        }
+                    }
+                }
+                // Frame after a gap → ask for the missing one (once)
+                else if (ahead && !conn->rejSent)
+                {
+                    logDebug("Out of sequence I frame (Ns=%d) - sending REJ%d\n", ns, conn->tramaRx);
+                    sendSupervision(controlREJ(conn->tramaRx));
+                    conn->linkStats.rejSent++;
+                    conn->rejSent = TRUE;
+                }
+                // Duplicate (its RR was lost) or gap already reported → re-acknowledge
                 else
                 {
-                    printf("BCC2 error - sending REJ%d\n", tramaRx);
-                    unsigned char rejFrame[5] = {
-                        FLAG, ADDRESS_RT,
-                        C_REJ(tramaRx),
-                        ADDRESS_RT ^ C_REJ(tramaRx),
-                        FLAG};
-                    writeBytesSerialPort(rejFrame, 5);
-                    state = START;
-                    dataIndex = 0;
+                    logDebug("Unexpected I frame (Ns=%d) - sending RR%d\n", ns, conn->tramaRx);
+                    sendSupervision(controlRR(conn->tramaRx));
+                    if (!ahead)
+                        conn->linkStats.duplicates++;
                 }
             }
             else
             {
                 // Append data byte
-                if (dataIndex < MAX_PACKET_SIZE)
-                    data[dataIndex++] = byte;
+                if (conn->rxDataIndex < MAX_PACKET_SIZE)
+                    conn->rxData[conn->rxDataIndex++] = byte;
                 else
                 {
-                    printf("ERROR: Frame too long - discarded\n");
-                    dataIndex = 0;
-                    state = START;
+                    logError("ERROR: Frame too long - discarded\n");
+                    conn->rxState = START;
                 }
             }
             break;
         case DATA_FOUND_ESC:
-            data[dataIndex++] = byte ^ 0x20;
-            state = READING_DATA;
+            if (conn->rxDataIndex < MAX_PACKET_SIZE)
+            {
+                conn->rxData[conn->rxDataIndex++] = byte ^ 0x20;
+                conn->linkStats.stuffedBytes++;
+                conn->rxState = READING_DATA;
+            }
+            else
+            {
+                logError("ERROR: Frame too long - discarded\n");
+                conn->rxState = START;
+            }
             break;
         default:
-            state = START;
+            conn->rxState = START;
             break;
         }
     }
 }
 
+int llread(unsigned char *packet)
+{
+    conn = &defaultConnection;
+    return readLink(packet);
+}
+
+int llreadh(LinkConnection *connection, unsigned char *packet)
+{
+    conn = connection;
+    return readLink(packet);
+}
+
 ////////////////////////////////////////////////
-// LLCLOSE
+// STATISTICS
 ////////////////////////////////////////////////
-int llclose(LinkLayer connectionParameters)
+void llstatsh(const LinkConnection *connection, LinkStats *stats)
 {
-    if (connection_fd < 0)
-        return -1;
+    *stats = connection->linkStats;
+    stats->seconds = (connection->port.fd >= 0 ? monotonicNow() : connection->closedAt) - connection->openedAt;
+}
 
-    unsigned char buf[BUF_SIZE];
-    int STOP = 0, state = 0;
+void llstats(LinkStats *stats)
+{
+    llstatsh(&defaultConnection, stats);
+}
 
-    printf("Closure procedure started\n");
+// Efficiency S: payload bits per second over the baud rate.
+static double measuredEfficiency(const LinkStats *stats)
+{
+    return stats->seconds > 0 ? stats->payloadBytes * 8 / stats->seconds / conn->baudRate : 0;
+}
 
-    // ---------- TRANSMITTER ----------
-    if (connectionParameters.role == LlTx)
+// Share of frame transmissions that failed (REJ, SREJ or timeout), counting
+// each failure once even when Go-Back-N resent several frames for it.
+static double frameErrorRate(const LinkStats *stats)
+{
+    int failures = stats->rejReceived + stats->timeouts;
+    return failures > 0 ? (double)failures / (stats->framesSent + failures) : 0;
+}
+
+// Efficiency of stop-and-wait on this line with the average frame sent: each
+// frame takes its send time plus a round trip (measured from its last byte,
+// or just the RR's send time without samples). Each failed transmission
+// costs one more frame, so a share "errorRate" of them scales S by 1 - rate.
+static double stopAndWaitEfficiency(const LinkStats *stats, double errorRate)
+{
+    int attempts = stats->framesSent + stats->retransmissions;
+    if (stats->framesSent == 0)
+        return 0;
+
+    double payloadTime = (double)stats->payloadBytes * 8 / stats->framesSent / conn->baudRate;
+    double frameTime = (double)stats->lineBytes / attempts * conn->byteTime;
+    double roundTrip = conn->rttSamples > 0 ? conn->srtt : BUF_SIZE * conn->byteTime;
+    return (1 - errorRate) * payloadTime / (frameTime + roundTrip);
+}
+
+static void printStats(LinkLayerRole role, const LinkStats *stats)
+{
+    double efficiency = measuredEfficiency(stats);
+
+    if (role == LlTx)
+    {
+        double errorRate = frameErrorRate(stats);
+        logInfo("Statistics: %d I frames (%ld payload bytes), %d retransmissions, %d REJ/SREJ, "
+                "%d timeouts, %.2f s\n",
+                stats->framesSent, stats->payloadBytes, stats->retransmissions, stats->rejReceived,
+                stats->timeouts, stats->seconds);
+        logInfo("Line: %ld I frame bytes, %ld added by byte stuffing (%.1f%%)\n", stats->lineBytes,
+                stats->stuffedBytes,
+                stats->lineBytes > 0 ? 100.0 * stats->stuffedBytes / stats->lineBytes : 0);
+        logInfo("Efficiency: S = %.3f measured; stop-and-wait at %d baud: %.3f without errors, "
+                "%.3f at the observed frame error rate %.3f\n",
+                efficiency, conn->baudRate, stopAndWaitEfficiency(stats, 0),
+                stopAndWaitEfficiency(stats, errorRate), errorRate);
+    }
+    else
     {
-        printf("This is the transmitter - initiating closure\n");
+        logInfo("Statistics: %d I frames (%ld payload bytes), %d BCC2 errors, %d REJ/SREJ sent, "
+                "%d duplicates, %.2f s\n",
+                stats->framesReceived, stats->payloadBytes, stats->frameErrors, stats->rejSent,
+                stats->duplicates, stats->seconds);
+        logInfo("Line: %ld bytes removed by byte destuffing\n", stats->stuffedBytes);
+        logInfo("Efficiency: S = %.3f measured at %d baud\n", efficiency, conn->baudRate);
+    }
+}
 
-        // Send DISC and wait for DISC response
-        buf[0] = FLAG;
-        buf[1] = ADDRESS_TR;
-        buf[2] = CONTROL_DISC;
-        buf[3] = buf[1] ^ buf[2];
-        buf[4] = FLAG;
+// Append the statistics to the options' file as one JSON line or CSV row
+// (with a header if the file is new), to compare runs.
+static void dumpStats(LinkLayerRole role, const LinkStats *stats)
+{
+    const char *ARQ_NAMES[] = {"sw", "gbn", "sr"};
+    const char *FCS_NAMES[] = {"xor", "crc16", "crc32"};
+    const char *FEC_NAMES[] = {"off", "rs"};
+    const char *path = conn->linkOptions.statsFile;
+
+    FILE *file = fopen(path, "a");
+    if (file == NULL)
+    {
+        perror(path);
+        return;
+    }
+
+    double errorRate = role == LlTx ? frameErrorRate(stats) : 0;
+    double swEfficiency = role == LlTx ? stopAndWaitEfficiency(stats, 0) : 0;
+    size_t length = strlen(path);
+
+    if (length >= 5 && strcmp(path + length - 5, ".json") == 0)
+    {
+        fprintf(file,
+                "{\"role\": \"%s\", \"baud\": %d, \"arq\": \"%s\", \"window\": %d, "
+                "\"fcs\": \"%s\", \"fec\": \"%s\", \"payload_size\": %d, \"seconds\": %.3f, "
+                "\"frames_sent\": %d, \"retransmissions\": %d, \"rej_received\": %d, "
+                "\"timeouts\": %d, \"line_bytes\": %ld, \"frames_received\": %d, "
+                "\"frame_errors\": %d, \"rej_sent\": %d, \"duplicates\": %d, "
+                "\"fec_corrected\": %d, \"payload_bytes\": %ld, \"stuffed_bytes\": %ld, "
+                "\"srtt_ms\": %.3f, \"frame_error_rate\": %.4f, \"efficiency\": %.4f, "
+                "\"sw_efficiency\": %.4f}\n",
+                role == LlTx ? "tx" : "rx", conn->baudRate, ARQ_NAMES[conn->linkOptions.arqMode],
+                conn->linkOptions.windowSize, FCS_NAMES[conn->linkOptions.fcsMode],
+                FEC_NAMES[conn->linkOptions.fecMode], conn->linkOptions.payloadSize, stats->seconds,
+                stats->framesSent, stats->retransmissions, stats->rejReceived, stats->timeouts,
+                stats->lineBytes, stats->framesReceived, stats->frameErrors, stats->rejSent,
+                stats->duplicates, stats->fecCorrected, stats->payloadBytes, stats->stuffedBytes,
+                conn->srtt * 1000, errorRate, measuredEfficiency(stats), swEfficiency);
+    }
+    else
+    {
+        if (ftell(file) == 0)
+            fprintf(file, "role,baud,arq,window,fcs,fec,payload_size,seconds,frames_sent,"
+                          "retransmissions,rej_received,timeouts,line_bytes,frames_received,"
+                          "frame_errors,rej_sent,duplicates,fec_corrected,payload_bytes,"
+                          "stuffed_bytes,srtt_ms,frame_error_rate,efficiency,sw_efficiency\n");
+        fprintf(file, "%s,%d,%s,%d,%s,%s,%d,%.3f,%d,%d,%d,%d,%ld,%d,%d,%d,%d,%d,%ld,%ld,%.3f,%.4f,%.4f,%.4f\n",
+                role == LlTx ? "tx" : "rx", conn->baudRate, ARQ_NAMES[conn->linkOptions.arqMode],
+                conn->linkOptions.windowSize, FCS_NAMES[conn->linkOptions.fcsMode],
+                FEC_NAMES[conn->linkOptions.fecMode], conn->linkOptions.payloadSize, stats->seconds,
+                stats->framesSent, stats->retransmissions, stats->rejReceived, stats->timeouts,
+                stats->lineBytes, stats->framesReceived, stats->frameErrors, stats->rejSent,
+                stats->duplicates, stats->fecCorrected, stats->payloadBytes, stats->stuffedBytes,
+                conn->srtt * 1000, errorRate, measuredEfficiency(stats), swEfficiency);
+    }
+    fclose(file);
+}
+
+////////////////////////////////////////////////
+// LLCLOSE
+////////////////////////////////////////////////
+// llclose on the current connection, waiting for the peer only if "block".
+// Return 0 once closed, -1 on error, or LL_WOULDBLOCK (call it again when
+// the connection's descriptors are ready).
+static int closeLink(int block)
+{
+    if (conn->port.fd < 0)
+        return -1;
+
+    unsigned char buf[BUF_SIZE];
 
-        while (!STOP && alarmCount <= retransmissions)
+    if (conn->closePhase == CLOSE_START)
+    {
+        logInfo("Closure procedure started\n");
+        conn->handshakeState = conn->handshakeAttempts = 0;
+        conn->handshakeWaiting = FALSE;
+        if (conn->role == LlTx)
         {
-            unsigned char byte;
-            if (!alarmEnabled)
+            logInfo("This is the transmitter - initiating closure\n");
+            conn->closePhase = CLOSE_DRAIN;
+        }
+        else
+        {
+            logInfo("This is the receiver - waiting for a DISC from the transmitter\n");
+            conn->closePhase = CLOSE_DISC;
+            // Wait for DISC (if not already received), unless the transmitter is gone
+            if (conn->discReceived || conn->peerLost)
             {
-                printf("Sending DISC frame (attempt %d)\n", alarmCount);
-                writeBytesSerialPort(buf, 5);
-                alarm(timeout);
-                alarmEnabled = TRUE;
+                if (conn->discReceived)
+                    logInfo("Disc already received during reading\n");
+                conn->closePhase = CLOSE_REPLY;
             }
+            else
+                setTimer(idleLimit());
+        }
+    }
 
-            while (alarmEnabled && !STOP)
-            {
-                if (readByteSerialPort(&byte) <= 0)
-                    continue;
-                printf("Byte received = 0x%02X\n", byte);
-                switch (state)
-                {
-                case 0:
-                    if (byte == FLAG)
-                        state = 1;
-                    else
-                        state = 0;
-                    break;
-                case 1:
-                    if (byte == ADDRESS_RT)
-                        state = 2;
-                    else
-                        state = 0;
-                    break;
-                case 2:
-                    if (byte == CONTROL_DISC)
-                        state = 3;
-                    else
-                        state = 0;
-                    break;
-                case 3:
-                    if (byte == (ADDRESS_RT ^ CONTROL_DISC))
-                        state = 4;
-                    else
-                        state = 0;
-                    break;
-                case 4:
-                    if (byte == FLAG)
-                    {
-                        printf("Received a DISC from receiver - sending UA\n");
-                        STOP = 1;
-                    }
-                    else
-                        state = 0;
-                    break;
-                }
-            }
+    if (conn->closePhase == CLOSE_DRAIN)
+    {
+        // Wait for every frame still in the window to be acknowledged
+        int status = drainWindow(0, block);
+        if (status == LL_WOULDBLOCK)
+            return status;
+        if (status < 0)
+            logError("ERROR: Unacknowledged frames lost before closure\n");
+        conn->closePhase = CLOSE_DISC;
+    }
+
+    if (conn->closePhase == CLOSE_DISC)
+    {
+        if (conn->role == LlTx)
+        {
+            // Send DISC and wait for DISC response
+            int status = exchangeFrame(CONTROL_DISC, "DISC", matchDiscReply, TRUE, block);
+            if (status == LL_WOULDBLOCK)
+                return status;
+            if (status == 0)
+                logInfo("Received a DISC from receiver - sending UA\n");
+        }
+        else
+        {
+            int status = awaitFrame(CONTROL_DISC, block);
+            if (status == LL_WOULDBLOCK)
+                return status;
+            if (status == 0)
+                logInfo("Received DISC from the transmitter - responding with a DISC\n");
+            else if (status == 1)
+                logError("ERROR: No DISC from the transmitter - closing anyway\n");
         }
+        conn->closePhase = CLOSE_REPLY;
+    }
 
+    // ---------- TRANSMITTER ----------
+    if (conn->role == LlTx)
+    {
         // Send UA
         buf[0] = FLAG;
         buf[1] = ADDRESS_TR;
         buf[2] = CONTROL_UA;
         buf[3] = buf[1] ^ buf[2];
         buf[4] = FLAG;
-        writeBytesSerialPort(buf, 5);
-        printf("Sent UA acknowledgment\n");
+        serialWrite(&conn->port, buf, 5);
+        logInfo("Sent UA acknowledgment\n");
+
+        logInfo("Retransmission timeout: RTO=%.1f ms (SRTT=%.1f ms, RTTVAR=%.1f ms, "
+                "%d samples, upper bound %d s)\n",
+                conn->rto * 1000, conn->srtt * 1000, conn->rttvar * 1000, conn->rttSamples, conn->timeout);
+        if (conn->linkOptions.fecMode != FecOff)
+            logInfo("FEC: final level %d (%d parity bytes per codeword), %d level changes\n",
+                    conn->fecLevel, FEC_LEVELS[conn->fecLevel], conn->fecLevelChanges);
+        if (conn->linkOptions.payloadSize == 0)
+        {
+            logInfo("Payload size over time (%d I frames sent):\n", conn->linkStats.framesSent);
+            for (int i = 0; i < conn->payloadChanges && i < MAX_PAYLOAD_CHANGES; i++)
+                logInfo("  from frame %5d (%7.2f s): %4d bytes\n", conn->payloadTimeline[i].frame,
+                        conn->payloadTimeline[i].at, conn->payloadTimeline[i].size);
+            if (conn->payloadChanges > MAX_PAYLOAD_CHANGES)
+                logInfo("  ... %d later changes not kept, final size %d bytes\n",
+                        conn->payloadChanges - MAX_PAYLOAD_CHANGES, conn->payloadSize);
+        }
     }
     // ---------- RECEIVER ----------
     else
     {
-        printf("This is the receiver - waiting for a DISC from the transmitter\n");
-
-        // Wait for DISC (if not already received)
-        if (discReceived == 0) 
-        {
-            while (!STOP)
-            {
-                unsigned char byte;
-                if (readByteSerialPort(&byte) <= 0)
-                    continue;
-                printf("Byte received = 0x%02X\n", byte);
-                switch (state)
-                {
-                case 0:
-                    if (byte == FLAG)
-                        state = 1;
-                    break;
-                case 1:
-                    if (byte == ADDRESS_TR)
-                        state = 2;
-                    break;
-                case 2:
-                    if (byte == CONTROL_DISC)
-                        state = 3;
-                    break;
-                case 3:
-                    if (byte == (ADDRESS_TR ^ CONTROL_DISC))
-                        state = 4;
-                    break;
-                case 4:
-                    if (byte == FLAG)
-                    {
-                        printf("Received DISC from the transmitter - responding with a DISC\n");
-                        STOP = 1;
-                    }
-                    else
-                        state = 0;
-                    break;
-                }
-            }
-        }
-        else {
-            printf("Disc already received during reading\n");
-        }
-
         // Send DISC back
         buf[0] = FLAG;
         buf[1] = ADDRESS_RT;
         buf[2] = CONTROL_DISC;
         buf[3] = buf[1] ^ buf[2];
         buf[4] = FLAG;
-        writeBytesSerialPort(buf, 5);
-        printf("Sending a DISC response\n");
+        serialWrite(&conn->port, buf, 5);
+        logInfo("Sending a DISC response\n");
+        if (conn->linkOptions.fecMode != FecOff)
+            logInfo("FEC: %d byte(s) corrected\n", conn->linkStats.fecCorrected);
     }
 
     // Close port
-    closeSerialPort();
-    connection_fd = -1;
-    printf("Connection closed successfully\n");
+    stopTimer();
+    releasePort();
+
+    LinkStats stats;
+    llstatsh(conn, &stats);
+    printStats(conn->role, &stats);
+    if (conn->linkOptions.statsFile != NULL)
+        dumpStats(conn->role, &stats);
+    logInfo("Connection closed successfully\n");
     return 0;
-}
\ No newline at end of file
+}
+
+int llclose(LinkLayer connectionParameters)
+{
+    conn = &defaultConnection;
+    return closeLink(TRUE);
+}
+
+int llcloseh(LinkConnection *connection)
+{
+    conn = connection;
+    int status = closeLink(!conn->linkOptions.nonBlocking);
+    if (status == LL_WOULDBLOCK)
+        return status;
+    free(connection);
+    conn = &defaultConnection;
+    return status;
+}
@@ -0,0 +1,161 @@
+// Link layer options header.
+// Extra knobs on top of link_layer.h, whose interface must stay unchanged.
+
+#ifndef _LINK_OPTIONS_H_
+#define _LINK_OPTIONS_H_
+
+#include "link_layer.h"
+
+#include <poll.h>
+
+typedef enum
+{
+    ArqStopAndWait,
+    ArqGoBackN,
+    ArqSelectiveRepeat,
+} LinkArqMode;
+
+// Frame check sequence carried in the BCC2 field of I frames
+typedef enum
+{
+    FcsXor,   // 1-byte XOR of the data (default)
+    FcsCrc16, // 2-byte CRC-16-CCITT (HDLC FCS-16)
+    FcsCrc32, // 4-byte CRC-32 (HDLC FCS-32)
+} LinkFcsMode;
+
+// Forward error correction inside the data field of I frames
+typedef enum
+{
+    FecOff,         // No correction, errors are repaired by retransmission (default)
+    FecReedSolomon, // Interleaved Reed-Solomon, redundancy adapted to the REJ rate
+} LinkFecMode;
+
+typedef struct
+{
+    LinkArqMode arqMode;
+    int windowSize; // Frames in flight (1 for stop-and-wait)
+    LinkFcsMode fcsMode;
+    LinkFecMode fecMode;
+    int payloadSize; // Fixed llwrite block size, or 0 to adapt it to the error rate
+    const char *statsFile; // llclose appends its statistics here (NULL for none):
+                           // one JSON object per line if it ends in ".json", else CSV
+    int nonBlocking;       // TRUE: llconnecth/llwriteh/llreadh/llflushh/llcloseh return
+                           // LL_WOULDBLOCK instead of waiting (connections opened with llopenh)
+    const unsigned char *openData; // Receiver: bytes sent back with the UA of llopen
+    int openDataSize;              // (copied by llopen; at most LL_OPEN_DATA_MAX)
+} LinkOptions;
+
+// Returned instead of waiting by non-blocking connections
+#define LL_WOULDBLOCK (-2)
+
+#define LL_OPEN_DATA_MAX 512
+
+// Counters kept since llopen and reported by llclose
+typedef struct
+{
+    double seconds; // Since llopen (until llclose once closed)
+
+    // Transmitter
+    int framesSent;      // New I frames
+    int retransmissions; // I frames sent again
+    int rejReceived;     // REJ and SREJ
+    int timeouts;
+    long lineBytes; // I frame bytes written, retransmissions included
+
+    // Receiver
+    int framesReceived; // I frames delivered in order
+    int frameErrors;    // I frames discarded for a BCC2 (or FEC) error
+    int rejSent;        // REJ and SREJ
+    int duplicates;     // I frames already delivered, acknowledged again
+    int fecCorrected;   // Bytes repaired by the FEC decoder
+
+    // Both
+    long payloadBytes; // Accepted by llwrite or delivered by llread
+    long stuffedBytes; // Added by byte stuffing, or removed by destuffing
+} LinkStats;
+
+// Size of the extended (3-bit) sequence number space used by windowed modes.
+// Go-Back-N windows go up to SEQ_MODULUS_EXT - 1, Selective Repeat up to half.
+#define SEQ_MODULUS_EXT 8
+
+// Fill "options" with the defaults (stop-and-wait, XOR BCC2, no FEC,
+// adaptive payload size, no statistics file, blocking, no open data).
+void lldefaultoptions(LinkOptions *options);
+
+// Select the options used by the next llopen. Both ends must agree.
+// Return 0 on success or -1 if the options are invalid.
+int llsetoptions(const LinkOptions *options);
+
+// Fill "options" from the environment, starting from the defaults:
+//   LL_ARQ: sw | gbn | sr (default sw)
+//   LL_WINDOW: frames in flight for windowed modes (default 7 for gbn, 4 for sr)
+//   LL_FCS: xor | crc16 | crc32 (default xor)
+//   LL_FEC: off | rs (default off)
+//   LL_PAYLOAD: fixed block size in bytes, or "adaptive" (default)
+//   LL_STATS: file llclose appends its statistics to (.json or CSV)
+// Return 0 on success or -1 if a value is invalid.
+int llenvoptions(LinkOptions *options);
+
+// Number of bytes the application should pass to the next llwrite: the fixed
+// size from the options, or the adaptive controller's current choice.
+int llpayloadsize();
+
+// Copy the counters of the current (or last closed) connection.
+void llstats(LinkStats *stats);
+
+// Transmitter, after llopen: copy the bytes the receiver sent with its UA
+// (its openData option) into "data", which must hold LL_OPEN_DATA_MAX bytes.
+// Return their number, 0 if there were none.
+int llopendata(unsigned char *data);
+
+////////////////////////////////////////////////
+// CONNECTION HANDLES
+////////////////////////////////////////////////
+// The calls above work on a single connection per process. The ones below
+// keep all state in a handle, so one process can drive several ports, e.g.
+// from one poll() loop with non-blocking connections. Handles are
+// single-threaded: the calls share internal state, so all of them, on every
+// handle, must come from the same thread.
+
+typedef struct LinkConnection LinkConnection;
+
+// llopen with its own options (llsetoptions is not used). A blocking
+// connection is open on return; a non-blocking one only has its port open,
+// and llconnecth carries out the SET/UA exchange.
+// Return the new connection or NULL on error.
+LinkConnection *llopenh(LinkLayer connectionParameters, const LinkOptions *options);
+
+// Carry on the SET/UA exchange of a connection from llopenh: call it until
+// it returns 0 (open), polling between calls. Return -1 on error (close the
+// connection with llcloseh to free it) or LL_WOULDBLOCK.
+int llconnecth(LinkConnection *connection);
+
+// llwrite: when non-blocking, returns LL_WOULDBLOCK (nothing sent) while the
+// window is full. A stop-and-wait llwrite then returns once the frame is sent.
+int llwriteh(LinkConnection *connection, const unsigned char *buf, int bufSize);
+
+// llread: when non-blocking, returns LL_WOULDBLOCK once the received bytes
+// hold no complete frame. Call it until then before polling again.
+int llreadh(LinkConnection *connection, unsigned char *packet);
+
+// Process acknowledgments and timeouts until every frame sent is
+// acknowledged. Return 0 once they are, -1 on error or LL_WOULDBLOCK.
+// A transmitter calls it before llcloseh, and whenever the link is ready
+// while it has nothing to write.
+int llflushh(LinkConnection *connection);
+
+// llclose, then free the connection. When non-blocking, returns
+// LL_WOULDBLOCK (the connection is kept) until the DISC exchange is over;
+// call it again whenever the connection's descriptors are ready.
+int llcloseh(LinkConnection *connection);
+
+// The two descriptors to poll for POLLIN: the port and the retransmission
+// timer. When either is ready, call whichever of llconnecth, llwriteh/llflushh
+// (transmitter), llreadh (receiver) or llcloseh the connection is waiting in.
+void llpollfds(const LinkConnection *connection, struct pollfd fds[2]);
+
+int llpayloadsizeh(const LinkConnection *connection);
+void llstatsh(const LinkConnection *connection, LinkStats *stats);
+int llopendatah(const LinkConnection *connection, unsigned char *data);
+
+#endif // _LINK_OPTIONS_H_
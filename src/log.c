@@ -0,0 +1,184 @@
+// Logging implementation.
+// The ring holds whole messages between logHead and logTail (byte counts
+// that only grow). The writer thread wakes up every LOG_FLUSH_MS, or early
+// when the ring is half full or an error is queued, and writes everything
+// pending with the lock released.
+
+#define _DEFAULT_SOURCE
+#include "log.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FALSE 0
+#define TRUE 1
+#define LOG_BUFFER_SIZE (64 * 1024)
+#define LOG_MESSAGE_SIZE 512
+#define LOG_FLUSH_MS 50
+
+int logLevel = LOG_LEVEL_INFO;
+
+char logBuffer[LOG_BUFFER_SIZE];
+unsigned long logHead = 0; // Bytes written to stdout
+unsigned long logTail = 0; // Bytes queued
+long logDropped = 0;       // Messages that did not fit since the last write
+int logStarted = FALSE;
+int logDirect = FALSE; // No writer thread: write in the caller
+int logStopping = FALSE;
+int logAtFork = FALSE;
+pthread_mutex_t logMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t logWake = PTHREAD_COND_INITIALIZER;
+pthread_cond_t logDrained = PTHREAD_COND_INITIALIZER;
+pthread_t logThread;
+
+int logSetLevel(const char *name)
+{
+    const char *NAMES[] = {"error", "info", "debug", "trace"};
+    for (int level = LOG_LEVEL_ERROR; level <= LOG_LEVEL_TRACE; level++)
+    {
+        if (strcmp(name, NAMES[level]) == 0)
+        {
+            logLevel = level;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void *writeLog(void *arg)
+{
+    pthread_mutex_lock(&logMutex);
+    while (1)
+    {
+        if (logHead == logTail)
+        {
+            if (logStopping)
+                break;
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_nsec += LOG_FLUSH_MS * 1000000L;
+            if (until.tv_nsec >= 1000000000L)
+            {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&logWake, &logMutex, &until);
+            continue;
+        }
+
+        // Up to the end of the buffer; the rest on the next pass
+        unsigned long start = logHead % LOG_BUFFER_SIZE;
+        unsigned long length = logTail - logHead;
+        if (length > LOG_BUFFER_SIZE - start)
+            length = LOG_BUFFER_SIZE - start;
+        long dropped = logDropped;
+        logDropped = 0;
+        pthread_mutex_unlock(&logMutex);
+
+        fwrite(logBuffer + start, 1, length, stdout);
+        if (dropped > 0)
+            printf("[log: %ld messages dropped]\n", dropped);
+        fflush(stdout);
+
+        pthread_mutex_lock(&logMutex);
+        logHead += length;
+        pthread_cond_broadcast(&logDrained);
+    }
+    pthread_mutex_unlock(&logMutex);
+    return NULL;
+}
+
+static void stopLog()
+{
+    pthread_mutex_lock(&logMutex);
+    int started = logStarted && !logDirect;
+    logStopping = TRUE;
+    pthread_cond_signal(&logWake);
+    pthread_mutex_unlock(&logMutex);
+
+    if (started)
+        pthread_join(logThread, NULL);
+}
+
+// A forked child has no writer thread: start its own on its first message,
+// without the messages its parent will write anyway.
+static void resetAfterFork()
+{
+    pthread_mutex_init(&logMutex, NULL);
+    pthread_cond_init(&logWake, NULL);
+    pthread_cond_init(&logDrained, NULL);
+    logHead = logTail = 0;
+    logDropped = 0;
+    logStarted = logDirect = logStopping = FALSE;
+}
+
+// Called with the lock held.
+static void startLog()
+{
+    logStarted = TRUE;
+    if (!logAtFork)
+    {
+        pthread_atfork(NULL, NULL, resetAfterFork);
+        atexit(stopLog);
+        logAtFork = TRUE;
+    }
+    if (pthread_create(&logThread, NULL, writeLog, NULL) != 0)
+        logDirect = TRUE;
+}
+
+void logWrite(int level, const char *format, ...)
+{
+    char message[LOG_MESSAGE_SIZE];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (length < 0)
+        return;
+    if (length >= (int)sizeof(message))
+    {
+        length = sizeof(message) - 1;
+        message[length - 1] = '\n';
+    }
+
+    pthread_mutex_lock(&logMutex);
+    if (!logStarted)
+        startLog();
+
+    if (logDirect)
+    {
+        fwrite(message, 1, length, stdout);
+    }
+    else if (LOG_BUFFER_SIZE - (logTail - logHead) < (unsigned long)length)
+    {
+        logDropped++;
+    }
+    else
+    {
+        unsigned long start = logTail % LOG_BUFFER_SIZE;
+        unsigned long first = LOG_BUFFER_SIZE - start < (unsigned long)length ? LOG_BUFFER_SIZE - start : length;
+        memcpy(logBuffer + start, message, first);
+        memcpy(logBuffer, message + first, length - first);
+        logTail += length;
+        if (level == LOG_LEVEL_ERROR || logTail - logHead > LOG_BUFFER_SIZE / 2)
+            pthread_cond_signal(&logWake);
+    }
+    pthread_mutex_unlock(&logMutex);
+}
+
+void logFlush()
+{
+    pthread_mutex_lock(&logMutex);
+    if (logDirect)
+        fflush(stdout);
+    while (logStarted && !logDirect && logHead != logTail)
+    {
+        pthread_cond_signal(&logWake);
+        pthread_cond_wait(&logDrained, &logMutex);
+    }
+    pthread_mutex_unlock(&logMutex);
+}
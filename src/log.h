@@ -0,0 +1,48 @@
+// Logging header.
+// Messages are formatted into a ring buffer and written to stdout by a
+// background thread, so logging never waits for the terminal. A message that
+// does not fit is dropped (and counted) instead of blocking the caller.
+//
+// Levels are checked twice: against LOG_COMPILED_LEVEL at compile time, so
+// calls above it cost nothing, and against the runtime level set with
+// logSetLevel. Per-byte tracing is only compiled in with
+// -DLOG_COMPILED_LEVEL=LOG_LEVEL_TRACE.
+
+#ifndef _LOG_H_
+#define _LOG_H_
+
+#define LOG_LEVEL_ERROR 0 // Failures
+#define LOG_LEVEL_INFO 1  // Connection events and reports (runtime default)
+#define LOG_LEVEL_DEBUG 2 // One line per frame or packet
+#define LOG_LEVEL_TRACE 3 // One line per byte
+
+#ifndef LOG_COMPILED_LEVEL
+#define LOG_COMPILED_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_AT(level, ...)                                              \
+    do                                                                  \
+    {                                                                   \
+        if ((level) <= LOG_COMPILED_LEVEL && (level) <= logLevel)       \
+            logWrite((level), __VA_ARGS__);                             \
+    } while (0)
+
+#define logError(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define logInfo(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define logDebug(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define logTrace(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+
+// Messages above this level are skipped at runtime.
+extern int logLevel;
+
+// Set the runtime level from a name: error, info, debug or trace.
+// Return 0 on success or -1 if the name is unknown.
+int logSetLevel(const char *name);
+
+// Queue a printf-style message. Use the level macros instead.
+void logWrite(int level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// Wait until every queued message has been written.
+void logFlush();
+
+#endif // _LOG_H_
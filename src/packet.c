@@ -0,0 +1,173 @@
+// Application packet implementation.
+
+#include "packet.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// Append a TLV holding "value" as "length" bytes, big endian. Return its size.
+static int putNumber(unsigned char *packet, int type, uint64_t value, int length)
+{
+    int size = 0;
+    packet[size++] = type;
+    packet[size++] = length;
+    for (int i = length - 1; i >= 0; i--)
+        packet[size++] = (value >> (8 * i)) & 0xFF;
+    return size;
+}
+
+// Append a FILE_NAME TLV. Return its size.
+static int putName(unsigned char *packet, const char *name)
+{
+    int length = strlen(name);
+    packet[0] = TLV_FILE_NAME;
+    packet[1] = length;
+    memcpy(packet + 2, name, length);
+    return 2 + length;
+}
+
+static uint64_t getNumber(const unsigned char *value, int length)
+{
+    uint64_t number = 0;
+    for (int k = 0; k < length; k++)
+        number = number << 8 | value[k];
+    return number;
+}
+
+static void getName(char *name, const unsigned char *value, int length)
+{
+    memcpy(name, value, length);
+    name[length] = '\0';
+}
+
+int buildControlPacket(unsigned char *packet, int control, const FileInfo *info)
+{
+    int size = 0;
+    packet[size++] = control;
+    size += putNumber(packet + size, TLV_FILE_SIZE, info->size, 8);
+    size += putName(packet + size, info->name);
+    size += putNumber(packet + size, TLV_CODEC, info->codec, 1);
+    if (info->fileCount > 0)
+        size += putNumber(packet + size, TLV_FILE_COUNT, info->fileCount, 4);
+    if (info->mtime != 0)
+        size += putNumber(packet + size, TLV_FILE_MTIME, info->mtime, 8);
+    if (info->offset > 0)
+    {
+        size += putNumber(packet + size, TLV_OFFSET, info->offset, 8);
+        size += putNumber(packet + size, TLV_TAIL_CRC, info->tailCrc, 4);
+    }
+    if (info->digestAlgorithm != DIGEST_NONE)
+        size += putNumber(packet + size, TLV_DIGEST_ALG, info->digestAlgorithm, 1);
+    if (info->digestSize > 0)
+    {
+        packet[size++] = TLV_DIGEST;
+        packet[size++] = info->digestSize;
+        memcpy(packet + size, info->digest, info->digestSize);
+        size += info->digestSize;
+    }
+    return size;
+}
+
+int parseControlPacket(const unsigned char *packet, int size, FileInfo *info)
+{
+    memset(info, 0, sizeof(*info));
+    info->size = -1;
+
+    for (int i = 1; i < size;)
+    {
+        if (size - i < 2 || packet[i + 1] > size - i - 2)
+            return -1;
+        int type = packet[i], length = packet[i + 1];
+        const unsigned char *value = packet + i + 2;
+
+        if (type == TLV_FILE_SIZE && length <= 8)
+            info->size = getNumber(value, length);
+        else if (type == TLV_FILE_NAME)
+            getName(info->name, value, length);
+        else if (type == TLV_CODEC && length == 1)
+            info->codec = value[0];
+        else if (type == TLV_FILE_COUNT && length == 4)
+        {
+            info->fileCount = getNumber(value, length);
+            if (info->fileCount < 0)
+                return -1;
+        }
+        else if (type == TLV_FILE_MTIME && length == 8)
+            info->mtime = getNumber(value, length);
+        else if (type == TLV_OFFSET && length == 8)
+        {
+            info->offset = getNumber(value, length);
+            if (info->offset < 0)
+                return -1;
+        }
+        else if (type == TLV_TAIL_CRC && length == 4)
+            info->tailCrc = getNumber(value, length);
+        else if (type == TLV_DIGEST_ALG && length == 1)
+            info->digestAlgorithm = value[0];
+        else if (type == TLV_DIGEST && length <= DIGEST_MAX_SIZE)
+        {
+            memcpy(info->digest, value, length);
+            info->digestSize = length;
+        }
+        i += 2 + length;
+    }
+    return info->size >= 0 && info->offset <= info->size ? 0 : -1;
+}
+
+int buildManifestPacket(unsigned char *packet, int capacity, const FileInfo *files, int count,
+                        int *used)
+{
+    int size = 0;
+    packet[size++] = CTRL_MANIFEST;
+
+    *used = 0;
+    while (*used < count)
+    {
+        const FileInfo *file = &files[*used];
+        int entrySize = 2 + 8 + 2 + strlen(file->name);
+        if (*used > 0 && size + entrySize > capacity)
+            break;
+        size += putNumber(packet + size, TLV_FILE_SIZE, file->size, 8);
+        size += putName(packet + size, file->name);
+        (*used)++;
+    }
+    return size;
+}
+
+int parseManifestPacket(const unsigned char *packet, int size, FileInfo *files, int room)
+{
+    int count = 0;
+
+    // Each FILE_SIZE starts a file, named by the FILE_NAME that follows it
+    for (int i = 1; i < size;)
+    {
+        if (size - i < 2 || packet[i + 1] > size - i - 2)
+            return -1;
+        int type = packet[i], length = packet[i + 1];
+        const unsigned char *value = packet + i + 2;
+
+        if (type == TLV_FILE_SIZE && length <= 8)
+        {
+            if (count == room)
+                return -1;
+            memset(&files[count], 0, sizeof(FileInfo));
+            files[count++].size = getNumber(value, length);
+            if (files[count - 1].size < 0)
+                return -1;
+        }
+        else if (type == TLV_FILE_NAME)
+        {
+            if (count == 0)
+                return -1;
+            getName(files[count - 1].name, value, length);
+        }
+        i += 2 + length;
+    }
+
+    for (int k = 0; k < count; k++)
+    {
+        if (files[k].name[0] == '\0')
+            return -1;
+    }
+    return count;
+}
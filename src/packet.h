@@ -0,0 +1,60 @@
+// Application packet header.
+// Every llwrite carries one packet; its first byte says what it holds.
+
+#ifndef _PACKET_H_
+#define _PACKET_H_
+
+#include "digest.h"
+
+#define CTRL_DATA 1    // [1][seq][L2][L1][file bytes]
+#define CTRL_START 2   // [2][TLV...] before the first DATA
+#define CTRL_END 3     // [3][TLV...] repeats START once all DATA is sent
+#define CTRL_DATA_LZ 4 // Like DATA, bytes LZ-compressed (APP_COMPRESS=lz)
+#define CTRL_MANIFEST 5 // [5][TLV...] files of a batch, after its START
+#define CTRL_RESUME 6   // [6][TLV...] resume offer, sent back with the receiver's UA
+#define DATA_HEADER_SIZE 4
+
+// START/END parameters: [T][L][V]
+#define TLV_FILE_SIZE 0 // 8 bytes, big endian
+#define TLV_FILE_NAME 1 // Name only, without directories
+#define TLV_CODEC 2     // 1 byte: 0 none, 1 LZ
+#define TLV_FILE_COUNT 3 // 4 bytes, big endian: files in a batch
+#define TLV_FILE_MTIME 4 // 8 bytes, big endian: modification time (ns since the epoch)
+#define TLV_OFFSET 5     // 8 bytes, big endian: file bytes already at the receiver
+#define TLV_TAIL_CRC 6   // 4 bytes, big endian: CRC-32 of the bytes before the offset
+#define TLV_DIGEST_ALG 7 // 1 byte, START: digest the DATA bytes are checked with (DIGEST_*)
+#define TLV_DIGEST 8     // END: digest of the DATA bytes (32 bytes SHA-256, 8 bytes XXH64)
+
+// File described by a START/END packet
+typedef struct
+{
+    long size;
+    char name[256];
+    int codec;
+    int fileCount;        // Files in the batch, 0 for a single file
+    long mtime;           // Modification time in ns, 0 if not sent
+    long offset;          // Where the DATA starts, 0 unless resuming
+    unsigned int tailCrc; // Sent with a nonzero offset
+    int digestAlgorithm;  // DIGEST_*, DIGEST_NONE if not sent
+    unsigned char digest[DIGEST_MAX_SIZE];
+    int digestSize;       // END only, 0 if not sent
+} FileInfo;
+
+// Build a START, END or RESUME packet. Return its size.
+int buildControlPacket(unsigned char *packet, int control, const FileInfo *info);
+
+// Parse the parameters of a START, END or RESUME packet. Unknown types are skipped.
+// Return 0 on success or -1 if the packet is malformed.
+int parseControlPacket(const unsigned char *packet, int size, FileInfo *info);
+
+// Build a MANIFEST packet of at most "capacity" bytes listing files from
+// "files" (a FILE_SIZE and FILE_NAME pair each), at least one of them.
+// Set "used" to the number of files listed and return the packet size.
+int buildManifestPacket(unsigned char *packet, int capacity, const FileInfo *files, int count,
+                        int *used);
+
+// Parse a MANIFEST packet into at most "room" files.
+// Return the number of files listed or -1 if the packet is malformed.
+int parseManifestPacket(const unsigned char *packet, int size, FileInfo *files, int room);
+
+#endif // _PACKET_H_
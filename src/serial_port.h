@@ -1,25 +1,58 @@
 // Serial port header.
-// NOTE: This file must not be changed.
+// A SerialPort holds the descriptor, the settings to restore on closing and
+// a buffer of received bytes. serialPending tells how many bytes can be read
+// with serialReadByte (or serialPeek/serialConsume) without waiting; poll the
+// descriptor only once it is 0. serialWriteBuffers writes a whole window of
+// frames with one system call.
 
 #ifndef _SERIAL_PORT_H_
 #define _SERIAL_PORT_H_
 
+#include <sys/uio.h>
+#include <termios.h>
+
+#define RX_BUFFER_SIZE 4096
+
+// State of one open port
+typedef struct
+{
+    int fd;                // -1 when closed
+    struct termios oldtio; // Settings to restore on closing
+    unsigned char rxBuffer[RX_BUFFER_SIZE];
+    int rxHead; // Next buffered byte to hand out
+    int rxTail; // One past the last valid byte
+} SerialPort;
+
 // Open and configure the serial port.
-// Returns a positive number if the port was opened successfully or -1 on error.
-int openSerialPort(const char *serialPort, int baudRate);
+// Returns the file descriptor or -1 on error.
+int serialOpen(SerialPort *port, const char *serialPort, int baudRate);
 
 // Restore original port settings and close the serial port.
 // Returns 0 if the port was closed successfully or -1 on error.
-int closeSerialPort();
+int serialClose(SerialPort *port);
 
 // Wait up to 0.1 second (VTIME) for a byte received from the serial port (must
 // check whether a byte was actually received from the return value).
+// Input is buffered: one read() fetches every byte available.
 // Returns -1 on error, 0 if no byte was received, 1 if a byte was received.
-int readByteSerialPort(unsigned char *byte);
+int serialReadByte(SerialPort *port, unsigned char *byte);
 
-// Write up to numBytes to the serial port (must check how many were actually
+// Returns the number of received bytes already buffered (readable without
+// waiting). Check it before polling the file descriptor directly.
+int serialPending(const SerialPort *port);
+
+// Access the buffered input bytes in place, for bulk parsing: peek returns
+// them (count in "count") and consume drops the first "count" of them.
+const unsigned char *serialPeek(const SerialPort *port, int *count);
+void serialConsume(SerialPort *port, int count);
+
+// Write up to nBytes to the serial port (must check how many were actually
 // written in the return value).
 // Returns -1 on error, otherwise the number of bytes written.
-int writeBytesSerialPort(const unsigned char *bytes, int nBytes);
+int serialWrite(SerialPort *port, const unsigned char *bytes, int nBytes);
+
+// Write several buffers (e.g. a window of frames) with a single system call.
+// Returns -1 on error, otherwise the total number of bytes written.
+int serialWriteBuffers(SerialPort *port, const struct iovec *buffers, int count);
 
 #endif // _SERIAL_PORT_H_
@@ -0,0 +1,138 @@
+// Byte stuffing implementation.
+
+#include "stuffing.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define STUFFING_X86 1
+#endif
+
+// Length of the prefix of "p" that contains neither "a" nor "b".
+typedef size_t (*ScanFn)(const unsigned char *p, size_t len, unsigned char a, unsigned char b);
+
+static size_t scanScalar(const unsigned char *p, size_t len, unsigned char a, unsigned char b)
+{
+    size_t i = 0;
+    while (i < len && p[i] != a && p[i] != b)
+        i++;
+    return i;
+}
+
+#ifdef STUFFING_X86
+__attribute__((target("sse2"))) static size_t scanSse2(const unsigned char *p, size_t len,
+                                                       unsigned char a, unsigned char b)
+{
+    const __m128i va = _mm_set1_epi8((char)a);
+    const __m128i vb = _mm_set1_epi8((char)b);
+    size_t i = 0;
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        int mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scanScalar(p + i, len - i, a, b);
+}
+
+__attribute__((target("avx2"))) static size_t scanAvx2(const unsigned char *p, size_t len,
+                                                       unsigned char a, unsigned char b)
+{
+    const __m256i va = _mm256_set1_epi8((char)a);
+    const __m256i vb = _mm256_set1_epi8((char)b);
+    size_t i = 0;
+    for (; i + 32 <= len; i += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+        unsigned mask = _mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+        if (mask)
+            return i + __builtin_ctz(mask);
+    }
+    return i + scanSse2(p + i, len - i, a, b);
+}
+#endif
+
+static ScanFn scan = NULL;
+static const char *scanName = "scalar";
+
+static void selectKernel()
+{
+    scan = scanScalar;
+#ifdef STUFFING_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        scan = scanAvx2;
+        scanName = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        scan = scanSse2;
+        scanName = "sse2";
+    }
+#endif
+}
+
+size_t stuffBytes(const unsigned char *src, size_t len, unsigned char *dst)
+{
+    if (scan == NULL)
+        selectKernel();
+
+    size_t in = 0, out = 0;
+    while (in < len)
+    {
+        // Escapes in a row skip the vector scan
+        if (src[in] == STUFF_FLAG || src[in] == STUFF_ESC)
+        {
+            dst[out++] = STUFF_ESC;
+            dst[out++] = src[in++] ^ 0x20;
+            continue;
+        }
+
+        size_t run = scan(src + in, len - in, STUFF_FLAG, STUFF_ESC);
+        memcpy(dst + out, src + in, run);
+        in += run;
+        out += run;
+    }
+    return out;
+}
+
+size_t destuffBytes(const unsigned char *src, size_t len, unsigned char *dst, int *escaped)
+{
+    if (scan == NULL)
+        selectKernel();
+
+    size_t in = 0, out = 0;
+    if (*escaped && len > 0)
+    {
+        dst[out++] = src[in++] ^ 0x20;
+        *escaped = 0;
+    }
+
+    while (in < len)
+    {
+        if (src[in] == STUFF_ESC)
+        {
+            if (++in < len)
+                dst[out++] = src[in++] ^ 0x20;
+            else
+                *escaped = 1;
+            continue;
+        }
+
+        size_t run = scan(src + in, len - in, STUFF_ESC, STUFF_ESC);
+        memcpy(dst + out, src + in, run);
+        in += run;
+        out += run;
+    }
+    return out;
+}
+
+const char *stuffingKernel()
+{
+    if (scan == NULL)
+        selectKernel();
+    return scanName;
+}
@@ -0,0 +1,26 @@
+// Byte stuffing header.
+// FLAG (0x7E) and ESC (0x7D) inside a frame are sent as ESC followed by the
+// byte XOR 0x20. Clean runs are found 16/32 bytes at a time (SSE2/AVX2,
+// chosen at run time) and copied in bulk; other CPUs use a scalar scan.
+
+#ifndef _STUFFING_H_
+#define _STUFFING_H_
+
+#include <stddef.h>
+
+#define STUFF_FLAG 0x7E
+#define STUFF_ESC 0x7D
+
+// Stuff "len" bytes of "src" into "dst", which must hold 2 * len bytes.
+// Returns the number of bytes written.
+size_t stuffBytes(const unsigned char *src, size_t len, unsigned char *dst);
+
+// Destuff "len" bytes of "src" (no FLAG inside) into "dst", which must hold
+// len bytes. "escaped" carries a trailing ESC over to the next call.
+// Returns the number of bytes written.
+size_t destuffBytes(const unsigned char *src, size_t len, unsigned char *dst, int *escaped);
+
+// Name of the scan kernel in use ("avx2", "sse2" or "scalar").
+const char *stuffingKernel();
+
+#endif // _STUFFING_H_
@@ -0,0 +1,429 @@
+// Multi-link file transfer driver.
+// Moves one file over each of several serial ports from a single thread: every
+// link is a non-blocking connection handle, and one poll() loop waits on the
+// descriptors of all of them and steps whichever links are ready.
+//
+// Usage: ./bin/multilink tx|rx baudrate port:file [port:file ...]
+// Each port talks to a main or multilink of the other role. The SET/UA and
+// DISC exchanges are stepped from the same loop as the transfers, so a slow
+// or silent peer on one port does not hold up the others. Files are sent
+// uncompressed; the LL_* variables apply to every link.
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <libgen.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "../src/link_layer.h"
+#include "../src/link_options.h"
+#include "../src/log.h"
+#include "../src/packet.h"
+
+#define MAX_LINKS 16
+#define N_TRIES 3
+#define TIMEOUT 4
+
+typedef enum
+{
+    PHASE_OPEN,  // SET/UA exchange
+    PHASE_START, // START packet next
+    PHASE_DATA,  // DATA packets until the end of the file
+    PHASE_END,   // END packet next
+    PHASE_FLUSH, // Waiting for the last acknowledgments
+    PHASE_CLOSE, // DISC exchange
+    PHASE_DONE,  // Closed
+} Phase;
+
+typedef struct
+{
+    char *port;
+    char *file;
+    LinkConnection *connection;
+    int fd;
+    Phase phase;
+    FileInfo info;
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    int packetSize; // Packet built but not yet accepted by llwriteh (0 for none)
+    long fileBytes; // Sent or received so far
+    int sequence;
+    int failed;
+    LinkStats stats;
+} Link;
+
+Link links[MAX_LINKS];
+int linkCount = 0;
+LinkLayerRole role;
+
+// Carry on closing the connection of a link; once closed, close its file.
+static void stepClose(Link *link)
+{
+    int status = llcloseh(link->connection);
+    if (status == LL_WOULDBLOCK)
+        return;
+    if (status < 0)
+        link->failed = TRUE;
+    link->connection = NULL;
+    if (link->fd >= 0)
+        close(link->fd);
+    link->phase = PHASE_DONE;
+    logInfo("%s: %s %s\n", link->port, link->file, link->failed ? "FAILED" : "done");
+}
+
+// Start closing a link, keeping its statistics.
+static void finishLink(Link *link, int failed)
+{
+    link->failed |= failed;
+    llstatsh(link->connection, &link->stats);
+    link->phase = PHASE_CLOSE;
+    stepClose(link);
+}
+
+////////////////////////////////////////////////
+// TRANSMITTER
+////////////////////////////////////////////////
+
+// Build the packet for the current phase: the START packet, the next DATA
+// packet, or the END packet once the file has been sent.
+// Return 0 on success or -1 on error.
+static int buildPacket(Link *link)
+{
+    if (link->phase == PHASE_DATA)
+    {
+        int capacity = llpayloadsizeh(link->connection) - DATA_HEADER_SIZE;
+        long left = link->info.size - link->fileBytes;
+        int size = left < capacity ? left : capacity;
+        if (size > 0)
+        {
+            if (pread(link->fd, link->packet + DATA_HEADER_SIZE, size, link->fileBytes) != size)
+            {
+                logError("ERROR: %s: cannot read %s\n", link->port, link->file);
+                return -1;
+            }
+            link->packet[0] = CTRL_DATA;
+            link->packet[1] = link->sequence & 0xFF;
+            link->packet[2] = size >> 8;
+            link->packet[3] = size & 0xFF;
+            link->packetSize = DATA_HEADER_SIZE + size;
+            return 0;
+        }
+        link->phase = PHASE_END;
+    }
+
+    int control = link->phase == PHASE_START ? CTRL_START : CTRL_END;
+    link->packetSize = buildControlPacket(link->packet, control, &link->info);
+    return 0;
+}
+
+// Send as much of the file as the window takes without waiting.
+static void stepTransmitter(Link *link)
+{
+    while (link->phase < PHASE_CLOSE)
+    {
+        if (link->phase == PHASE_FLUSH)
+        {
+            int status = llflushh(link->connection);
+            if (status != LL_WOULDBLOCK)
+                finishLink(link, status < 0);
+            return;
+        }
+
+        if (link->packetSize == 0 && buildPacket(link) < 0)
+        {
+            finishLink(link, TRUE);
+            return;
+        }
+
+        int status = llwriteh(link->connection, link->packet, link->packetSize);
+        if (status == LL_WOULDBLOCK)
+            return;
+        if (status < 0)
+        {
+            logError("ERROR: %s: failed to send\n", link->port);
+            finishLink(link, TRUE);
+            return;
+        }
+
+        if (link->phase == PHASE_START)
+            link->phase = PHASE_DATA;
+        else if (link->phase == PHASE_DATA)
+        {
+            link->fileBytes += link->packetSize - DATA_HEADER_SIZE;
+            link->sequence++;
+        }
+        else
+            link->phase = PHASE_FLUSH;
+        link->packetSize = 0;
+    }
+}
+
+////////////////////////////////////////////////
+// RECEIVER
+////////////////////////////////////////////////
+
+// Handle one received packet.
+// Return 0 on success or -1 if the transfer cannot go on.
+static int handlePacket(Link *link, const unsigned char *packet, int size)
+{
+    if (packet[0] == CTRL_START && link->phase == PHASE_START)
+    {
+        if (parseControlPacket(packet, size, &link->info) < 0 || link->info.codec != 0)
+        {
+            logError("ERROR: %s: malformed or compressed START packet\n", link->port);
+            return -1;
+        }
+        link->fd = open(link->file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (link->fd < 0)
+        {
+            perror(link->file);
+            return -1;
+        }
+        logInfo("%s: receiving %s (%ld bytes) as %s\n", link->port, link->info.name, link->info.size,
+                link->file);
+        link->phase = PHASE_DATA;
+        return 0;
+    }
+
+    if (packet[0] == CTRL_END && link->phase == PHASE_DATA)
+    {
+        FileInfo end;
+        if (parseControlPacket(packet, size, &end) < 0 || end.size != link->info.size ||
+            strcmp(end.name, link->info.name) != 0)
+        {
+            logError("ERROR: %s: END packet does not match START\n", link->port);
+            return -1;
+        }
+        link->phase = PHASE_END;
+        return 0;
+    }
+
+    int dataSize = size >= DATA_HEADER_SIZE ? packet[2] << 8 | packet[3] : -1;
+    if (packet[0] != CTRL_DATA || link->phase != PHASE_DATA || dataSize != size - DATA_HEADER_SIZE ||
+        packet[1] != (link->sequence & 0xFF) || dataSize > link->info.size - link->fileBytes)
+    {
+        logError("ERROR: %s: unexpected packet (type %d)\n", link->port, packet[0]);
+        return -1;
+    }
+    if (pwrite(link->fd, packet + DATA_HEADER_SIZE, dataSize, link->fileBytes) != dataSize)
+    {
+        logError("ERROR: %s: cannot write %s\n", link->port, link->file);
+        return -1;
+    }
+    link->fileBytes += dataSize;
+    link->sequence++;
+    return 0;
+}
+
+// Handle every packet already received. After an error the rest of the
+// transfer is read and dropped, so the transmitter can still close.
+static void stepReceiver(Link *link)
+{
+    unsigned char packet[MAX_PAYLOAD_SIZE];
+    while (link->phase < PHASE_CLOSE)
+    {
+        int size = llreadh(link->connection, packet);
+        if (size == LL_WOULDBLOCK)
+            return;
+        if (size < 0)
+        {
+            logError("ERROR: %s: failed to receive\n", link->port);
+            finishLink(link, TRUE);
+            return;
+        }
+        if (size == 0)
+        {
+            // DISC: the transmitter is done
+            int complete = link->phase == PHASE_END && link->fileBytes == link->info.size;
+            if (!complete && !link->failed)
+                logError("ERROR: %s: link closed after %ld bytes\n", link->port, link->fileBytes);
+            finishLink(link, !complete);
+            return;
+        }
+        if (!link->failed && handlePacket(link, packet, size) < 0)
+            link->failed = TRUE;
+    }
+}
+
+////////////////////////////////////////////////
+// MAIN
+////////////////////////////////////////////////
+
+// Move a link on as far as it can go without waiting.
+static void stepLink(Link *link)
+{
+    if (link->phase == PHASE_OPEN)
+    {
+        int status = llconnecth(link->connection);
+        if (status == LL_WOULDBLOCK)
+            return;
+        if (status < 0)
+        {
+            logError("ERROR: %s: cannot open the link\n", link->port);
+            finishLink(link, TRUE);
+            return;
+        }
+        link->phase = PHASE_START;
+    }
+
+    if (link->phase == PHASE_CLOSE)
+        stepClose(link);
+    else if (role == LlTx)
+        stepTransmitter(link);
+    else
+        stepReceiver(link);
+}
+
+// Open the port (and, for the transmitter, the file) of a link; stepLink
+// then carries out the SET/UA exchange.
+// Return 0 on success or -1 on error.
+static int openLink(Link *link, int baudRate, const LinkOptions *options)
+{
+    link->fd = -1;
+    link->phase = PHASE_OPEN;
+
+    if (role == LlTx)
+    {
+        struct stat st;
+        link->fd = open(link->file, O_RDONLY);
+        if (link->fd < 0 || fstat(link->fd, &st) < 0)
+        {
+            perror(link->file);
+            return -1;
+        }
+        link->info.size = st.st_size;
+        link->info.codec = 0;
+        snprintf(link->info.name, sizeof(link->info.name), "%s", basename(link->file));
+    }
+
+    LinkLayer parameters = {.role = role, .baudRate = baudRate, .nRetransmissions = N_TRIES,
+                            .timeout = TIMEOUT};
+    snprintf(parameters.serialPort, sizeof(parameters.serialPort), "%s", link->port);
+    link->connection = llopenh(parameters, options);
+    if (link->connection == NULL)
+    {
+        logError("ERROR: %s: cannot open the link\n", link->port);
+        return -1;
+    }
+    return 0;
+}
+
+static void printReport()
+{
+    int failures = 0;
+    logInfo("%-16s %-24s %12s %8s %12s\n", "port", "file", "bytes", "time(s)", "bit/s");
+    for (int i = 0; i < linkCount; i++)
+    {
+        Link *link = &links[i];
+        double seconds = link->stats.seconds;
+        logInfo("%-16s %-24s %12ld %8.2f %12.0f%s\n", link->port, link->file, link->fileBytes, seconds,
+                seconds > 0 ? link->fileBytes * 8 / seconds : 0, link->failed ? "  FAILED" : "");
+        failures += link->failed;
+    }
+    logInfo("%d of %d transfers succeeded\n", linkCount - failures, linkCount);
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 4 || (strcmp(argv[1], "tx") != 0 && strcmp(argv[1], "rx") != 0) ||
+        argc - 3 > MAX_LINKS)
+    {
+        printf("Usage: %s tx|rx baudrate port:file [port:file ...] (up to %d links)\n", argv[0],
+               MAX_LINKS);
+        return 1;
+    }
+    role = strcmp(argv[1], "tx") == 0 ? LlTx : LlRx;
+    int baudRate = atoi(argv[2]);
+
+    const char *level = getenv("LL_LOG");
+    if (level != NULL && logSetLevel(level) < 0)
+    {
+        logError("ERROR: LL_LOG must be \"error\", \"info\", \"debug\" or \"trace\"\n");
+        return 1;
+    }
+
+    LinkOptions options;
+    if (llenvoptions(&options) < 0)
+        return 1;
+    options.nonBlocking = TRUE;
+
+    for (int i = 3; i < argc; i++)
+    {
+        Link *link = &links[linkCount++];
+        link->port = argv[i];
+        link->file = strchr(argv[i], ':');
+        if (link->file == NULL || link->file[1] == '\0')
+        {
+            logError("ERROR: \"%s\" is not port:file\n", argv[i]);
+            return 1;
+        }
+        *link->file++ = '\0';
+    }
+
+    int active = 0;
+    for (int i = 0; i < linkCount; i++)
+    {
+        if (openLink(&links[i], baudRate, &options) < 0)
+        {
+            if (links[i].fd >= 0)
+                close(links[i].fd);
+            links[i].failed = TRUE;
+            links[i].phase = PHASE_DONE;
+            continue;
+        }
+        active++;
+    }
+
+    // Step every link once, then whenever one of its descriptors is ready
+    struct pollfd fds[2 * MAX_LINKS];
+    int owners[2 * MAX_LINKS];
+    int pending = TRUE;
+    while (active > 0)
+    {
+        for (int i = 0; i < linkCount; i++)
+        {
+            Link *link = &links[i];
+            int ready = pending;
+            for (int k = 0; k < 2 * linkCount && !ready; k++)
+                ready = owners[k] == i && fds[k].revents != 0;
+            if (link->phase == PHASE_DONE || !ready)
+                continue;
+
+            stepLink(link);
+            if (link->phase == PHASE_DONE)
+                active--;
+        }
+        pending = FALSE;
+
+        int nfds = 0;
+        for (int i = 0; i < linkCount; i++)
+        {
+            if (links[i].phase == PHASE_DONE)
+                continue;
+            llpollfds(links[i].connection, fds + nfds);
+            owners[nfds] = owners[nfds + 1] = i;
+            nfds += 2;
+        }
+        if (nfds > 0 && poll(fds, nfds, -1) < 0)
+        {
+            perror("poll");
+            for (int i = 0; i < linkCount; i++)
+                links[i].failed |= links[i].phase != PHASE_DONE;
+            break;
+        }
+        for (int k = nfds; k < 2 * linkCount; k++)
+            owners[k] = -1;
+    }
+
+    printReport();
+    logFlush();
+    for (int i = 0; i < linkCount; i++)
+    {
+        if (links[i].failed)
+            return 1;
+    }
+    return 0;
+}